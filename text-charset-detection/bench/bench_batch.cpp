@@ -0,0 +1,188 @@
+// Throughput of validating a column of many short strings: row by row vs ValidateUTF8Batch() over offsets + data.
+//
+// Build (from this directory):	g++ -O2 -std=c++20 bench_batch.cpp ../detcharset.cpp -o bench_batch
+// Usage:	bench_batch [--rows 1000000] [--min-time 0.2] [--repeat 1] [--json results.json]
+//
+// Columns (row lengths uniform in 4...32 bytes, like names and tags):
+//	ascii		letters and digits only
+//	mixed		10% of the rows with Latin-1 accents, 2% CJK, the rest as ascii
+//	invalid		mixed with 1% of the rows holding an invalid sequence
+// Methods:
+//	check-buffer	CheckBufferForUTF8NoBOM() per row (reason text, tuning, metrics), the pre-batch way
+//	is-valid		IsValidUTF8() per row
+//	batch			ValidateUTF8Batch() on the whole column
+// --repeat N measures every row N times, --json writes all repetitions as samples for bench_compare (see bench_report.h).
+
+#include "../detcharset.h"
+#include "bench_common.h"
+#include "bench_report.h"
+
+#include <cstdio>
+#include <functional>
+#include <iostream>
+
+using namespace text_charset_detection;
+using namespace text_charset_detection::bench;
+
+namespace
+{
+	constexpr size_t MIN_ROW_LENGTH = 4;
+	constexpr size_t MAX_ROW_LENGTH = 32;
+
+	struct Column
+	{
+		const char* name;
+		std::vector<byte_t> data;
+		std::vector<int32_t> offsets = { 0 };
+	};
+
+	Column GenerateColumn(const char* name, size_t rows, double latinShare, double cjkShare, double invalidShare)
+	{
+		static const char ALPHANUMERIC[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+		std::mt19937_64 rng(0x5EED);
+		std::uniform_real_distribution<double> share(0, 1);
+		Column column{ name, {}, { 0 } };
+		for (size_t row = 0; row < rows; ++row)
+		{
+			const size_t length = MIN_ROW_LENGTH + rng() % (MAX_ROW_LENGTH - MIN_ROW_LENGTH + 1);
+			const size_t rowStart = column.data.size();
+			const double kind = share(rng);
+			while (column.data.size() - rowStart < length)
+			{
+				if (kind < cjkShare)
+					AppendUTF8(column.data, 0x4E00 + static_cast<uint32_t>(rng() % 0x5000));
+				else if (kind < cjkShare + latinShare && rng() % 4 == 0)
+					AppendUTF8(column.data, 0xC0 + static_cast<uint32_t>(rng() % 0x40));
+				else
+					column.data.push_back(static_cast<byte_t>(ALPHANUMERIC[rng() % (sizeof(ALPHANUMERIC) - 1)]));
+			}
+			if (share(rng) < invalidShare)
+				column.data[rowStart + rng() % (column.data.size() - rowStart)] = 0xFF;
+			column.offsets.push_back(static_cast<int32_t>(column.data.size()));
+		}
+		return column;
+	}
+
+	struct Method
+	{
+		const char* name;
+		size_t (*run)(const Column& column, std::vector<uint8_t>& bitmap);		// returns the number of invalid rows
+	};
+
+	size_t RowCount(const Column& column)
+	{
+		return column.offsets.size() - 1;
+	}
+
+	size_t CheckBufferPerRow(const Column& column, std::vector<uint8_t>& bitmap)
+	{
+		size_t invalidRows = 0;
+		std::string reason;
+		for (size_t row = 0; row < RowCount(column); ++row)
+		{
+			reason.clear();
+			const byte_t* rowStart = column.data.data() + column.offsets[row];
+			const size_t rowSize = column.offsets[row + 1] - column.offsets[row];
+			// CheckBufferForUTF8NoBOM() reports pure 7-bit ASCII as false, the reason text tells them apart
+			const bool bValid = CheckBufferForUTF8NoBOM(rowStart, rowSize, reason) || reason.find("ASCII 7-bit text") != std::string::npos;
+			invalidRows += !bValid;
+			bitmap[row / 8] = static_cast<uint8_t>((bitmap[row / 8] & ~(1u << (row % 8))) | (unsigned(bValid) << (row % 8)));
+		}
+		return invalidRows;
+	}
+
+	size_t IsValidPerRow(const Column& column, std::vector<uint8_t>& bitmap)
+	{
+		size_t invalidRows = 0;
+		for (size_t row = 0; row < RowCount(column); ++row)
+		{
+			const bool bValid = IsValidUTF8(column.data.data() + column.offsets[row], column.offsets[row + 1] - column.offsets[row]);
+			invalidRows += !bValid;
+			bitmap[row / 8] = static_cast<uint8_t>((bitmap[row / 8] & ~(1u << (row % 8))) | (unsigned(bValid) << (row % 8)));
+		}
+		return invalidRows;
+	}
+
+	size_t Batch(const Column& column, std::vector<uint8_t>& bitmap)
+	{
+		return ValidateUTF8Batch(column.data.data(), column.data.size(), column.offsets.data(), RowCount(column), bitmap.data());
+	}
+
+	const Method METHODS[] = {
+		{ "check-buffer", &CheckBufferPerRow },
+		{ "is-valid", &IsValidPerRow },
+		{ "batch", &Batch },
+	};
+}
+
+int main(int argc, char** argv)
+{
+	size_t rows = 1000000;
+	double minTimeSeconds = 0.2;
+	size_t repeat = 1;
+	std::string jsonPath;
+	for (int i = 1; i < argc; i += 2)
+	{
+		const std::string arg = argv[i];
+		if (i + 1 < argc && arg == "--rows")
+			rows = std::strtoull(argv[i + 1], nullptr, 10);
+		else if (i + 1 < argc && arg == "--min-time")
+			minTimeSeconds = std::atof(argv[i + 1]);
+		else if (i + 1 < argc && arg == "--repeat")
+			repeat = std::strtoull(argv[i + 1], nullptr, 10);
+		else if (i + 1 < argc && arg == "--json")
+			jsonPath = argv[i + 1];
+		else
+			repeat = 0;
+	}
+	if (repeat == 0 || rows == 0)
+	{
+		std::cerr << "usage: " << argv[0] << " [--rows N] [--min-time SECONDS] [--repeat N] [--json PATH]\n";
+		return 2;
+	}
+
+	const Column columns[] = {
+		GenerateColumn("ascii", rows, 0, 0, 0),
+		GenerateColumn("mixed", rows, 0.10, 0.02, 0),
+		GenerateColumn("invalid", rows, 0.10, 0.02, 0.01),
+	};
+
+	BenchReport report("bench_batch");
+	std::printf("%-9s %-13s %12s %10s %12s\n", "column", "method", "Mrows/s", "GB/s", "invalid rows");
+	for (const Column& column : columns)
+	{
+		std::vector<uint8_t> bitmap((RowCount(column) + 7) / 8);
+		for (const Method& method : METHODS)
+		{
+			for (size_t rep = 0; rep < repeat; ++rep)
+			{
+				size_t passes = 0, invalidRows = 0;
+				const bench_clock_t::time_point start = bench_clock_t::now();
+				do
+				{
+					invalidRows = method.run(column, bitmap);
+					DoNotOptimize(bitmap.data());
+					++passes;
+				} while (SecondsSince(start) < minTimeSeconds);
+				const double seconds = SecondsSince(start) / passes;
+				const double rowsPerSecond = RowCount(column) / seconds;
+				const double bytesPerSecond = column.data.size() / seconds;
+				std::printf("%-9s %-13s %12.1f %10.2f %12zu\n", column.name, method.name, rowsPerSecond / 1e6, bytesPerSecond / 1e9, invalidRows);
+				const std::string key = std::string(column.name) + "/" + method.name;
+				report.AddSample(key, "rows_per_s", true, rowsPerSecond);
+				report.AddSample(key, "gb_per_s", true, bytesPerSecond / 1e9);
+			}
+		}
+	}
+
+	if (!jsonPath.empty())
+	{
+		std::string error;
+		if (!report.Write(jsonPath, error))
+		{
+			std::cerr << error << "\n";
+			return 1;
+		}
+	}
+	return 0;
+}
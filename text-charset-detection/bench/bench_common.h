@@ -0,0 +1,214 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace text_charset_detection
+{
+	namespace bench {
+		typedef unsigned char byte_t;
+
+		// synthetic corpus kinds, each one stresses a different branch of UTF8CharValidate()
+		enum class CorpusKind
+		{
+			ASCII,				// printable 7-bit ASCII with spaces and line breaks, never leaves the 1-byte branch
+			Latin,				// mostly ASCII, ~25% 2-byte sequences (U+00C0...U+00FF), like western european prose
+			CJK,				// 3-byte sequences (U+4E00...U+9FFF) with sparse ASCII punctuation and line breaks
+			Emoji,				// 4-byte sequences (U+1F300...U+1F64F) with sparse spaces
+			Binary,				// uniformly random bytes, invalid almost immediately
+			ErrorDense,			// Latin-like text with an invalid sequence injected every ~64 bytes (all error classes of UTF8CheckErrors())
+		};
+
+		constexpr CorpusKind ALL_CORPUS_KINDS[] = { CorpusKind::ASCII, CorpusKind::Latin, CorpusKind::CJK, CorpusKind::Emoji, CorpusKind::Binary, CorpusKind::ErrorDense };
+
+		inline const char* CorpusKindName(CorpusKind kind)
+		{
+			switch (kind)
+			{
+			case CorpusKind::ASCII:			return "ascii";
+			case CorpusKind::Latin:			return "latin";
+			case CorpusKind::CJK:			return "cjk";
+			case CorpusKind::Emoji:			return "emoji";
+			case CorpusKind::Binary:		return "binary";
+			case CorpusKind::ErrorDense:	return "error-dense";
+			}
+			return "?";
+		}
+
+		// appends UTF-8 encoding of codePoint (no validity checks, callers only pass scalar values)
+		inline void AppendUTF8(std::vector<byte_t>& out, uint32_t codePoint)
+		{
+			if (codePoint < 0x80)
+			{
+				out.push_back(static_cast<byte_t>(codePoint));
+			}
+			else if (codePoint < 0x800)
+			{
+				out.push_back(static_cast<byte_t>(0xC0 | (codePoint >> 6)));
+				out.push_back(static_cast<byte_t>(0x80 | (codePoint & 0x3F)));
+			}
+			else if (codePoint < 0x10000)
+			{
+				out.push_back(static_cast<byte_t>(0xE0 | (codePoint >> 12)));
+				out.push_back(static_cast<byte_t>(0x80 | ((codePoint >> 6) & 0x3F)));
+				out.push_back(static_cast<byte_t>(0x80 | (codePoint & 0x3F)));
+			}
+			else
+			{
+				out.push_back(static_cast<byte_t>(0xF0 | (codePoint >> 18)));
+				out.push_back(static_cast<byte_t>(0x80 | ((codePoint >> 12) & 0x3F)));
+				out.push_back(static_cast<byte_t>(0x80 | ((codePoint >> 6) & 0x3F)));
+				out.push_back(static_cast<byte_t>(0x80 | (codePoint & 0x3F)));
+			}
+		}
+
+		inline uint32_t RandomPrintableASCII(std::mt19937_64& rng)
+		{
+			// letters dominate, spaces every few chars, line breaks every ~64 chars, like real text
+			const uint32_t r = static_cast<uint32_t>(rng() % 64);
+			if (r == 0)
+				return '\n';
+			if (r < 10)
+				return ' ';
+			return 0x21 + static_cast<uint32_t>(rng() % (0x7E - 0x21 + 1));
+		}
+
+		// generates exactly `size` bytes of the given kind, deterministic for a given seed
+		// multibyte chars are never cut at the end, the remainder is padded with spaces
+		inline std::vector<byte_t> GenerateCorpus(CorpusKind kind, size_t size, uint64_t seed = 0x5EED)
+		{
+			std::mt19937_64 rng(seed ^ (static_cast<uint64_t>(kind) << 56));
+			std::vector<byte_t> out;
+			out.reserve(size + 8);
+
+			if (kind == CorpusKind::Binary)
+			{
+				while (out.size() + 8 <= size)
+				{
+					const uint64_t r = rng();
+					for (int i = 0; i < 8; ++i)
+						out.push_back(static_cast<byte_t>(r >> (8 * i)));
+				}
+				while (out.size() < size)
+					out.push_back(static_cast<byte_t>(rng()));
+				return out;
+			}
+
+			// invalid sequences injected into ErrorDense, one for each error class UTF8CheckErrors() reports
+			static const std::vector<std::vector<byte_t>> injectedErrors = {
+				{ 0x80 },						// stray continuation byte (invalid leading byte)
+				{ 0xF8, 0x88, 0x80, 0x80, 0x80 },	// 5-byte sequence
+				{ 0xC3, 0x41 },					// missing continuation byte
+				{ 0x01 },						// control char
+				{ 0xC0, 0xAF },					// 2-byte overlong
+				{ 0xE0, 0x80, 0xAF },			// 3-byte overlong
+				{ 0xED, 0xA0, 0x80 },			// UTF-16 surrogate half
+				{ 0xF0, 0x80, 0x80, 0xAF },		// 4-byte overlong
+				{ 0xF4, 0x90, 0x80, 0x80 },		// code point above U+10FFFF (F4)
+				{ 0xF5, 0x80, 0x80, 0x80 },		// code point above U+10FFFF (non-F4)
+			};
+
+			std::vector<byte_t> scratch;
+			size_t nextErrorAt = 64;
+			while (true)
+			{
+				scratch.clear();
+				switch (kind)
+				{
+				case CorpusKind::ASCII:
+					scratch.push_back(static_cast<byte_t>(RandomPrintableASCII(rng)));
+					break;
+				case CorpusKind::Latin:
+				case CorpusKind::ErrorDense:
+					if (kind == CorpusKind::ErrorDense && out.size() >= nextErrorAt)
+					{
+						scratch = injectedErrors[rng() % injectedErrors.size()];
+						nextErrorAt = out.size() + 32 + rng() % 64;
+					}
+					else if (rng() % 4 == 0)
+						AppendUTF8(scratch, 0xC0 + static_cast<uint32_t>(rng() % 0x40));
+					else
+						scratch.push_back(static_cast<byte_t>(RandomPrintableASCII(rng)));
+					break;
+				case CorpusKind::CJK:
+					if (rng() % 16 == 0)
+						scratch.push_back(rng() % 4 == 0 ? '\n' : ' ');
+					else
+						AppendUTF8(scratch, 0x4E00 + static_cast<uint32_t>(rng() % (0x9FFF - 0x4E00 + 1)));
+					break;
+				case CorpusKind::Emoji:
+					if (rng() % 16 == 0)
+						scratch.push_back(' ');
+					else
+						AppendUTF8(scratch, 0x1F300 + static_cast<uint32_t>(rng() % (0x1F64F - 0x1F300 + 1)));
+					break;
+				case CorpusKind::Binary:
+					break;
+				}
+				if (out.size() + scratch.size() > size)
+					break;
+				out.insert(out.end(), scratch.begin(), scratch.end());
+			}
+			out.resize(size, ' ');
+			return out;
+		}
+
+		// keeps the optimizer from dropping computations whose results are otherwise unused
+		template <typename T>
+		inline void DoNotOptimize(const T& value)
+		{
+#if defined(__GNUC__) || defined(__clang__)
+			asm volatile("" : : "r,m"(value) : "memory");
+#else
+			static volatile const T* sink;
+			sink = &value;
+#endif
+		}
+
+		typedef std::chrono::steady_clock bench_clock_t;
+
+		inline double SecondsSince(bench_clock_t::time_point start)
+		{
+			return std::chrono::duration<double>(bench_clock_t::now() - start).count();
+		}
+
+		// "64", "4K", "1M", "1G" <--> bytes
+		inline std::string FormatSize(size_t bytes)
+		{
+			if (bytes >= (size_t(1) << 30) && bytes % (size_t(1) << 30) == 0)
+				return std::to_string(bytes >> 30) + "G";
+			if (bytes >= (size_t(1) << 20) && bytes % (size_t(1) << 20) == 0)
+				return std::to_string(bytes >> 20) + "M";
+			if (bytes >= (size_t(1) << 10) && bytes % (size_t(1) << 10) == 0)
+				return std::to_string(bytes >> 10) + "K";
+			return std::to_string(bytes);
+		}
+
+		// throws std::invalid_argument on malformed input
+		inline size_t ParseSize(const std::string& text)
+		{
+			size_t idx = 0;
+			const unsigned long long value = std::stoull(text, &idx);
+			size_t shift = 0;
+			if (idx < text.size())
+			{
+				switch (text[idx])
+				{
+				case 'k': case 'K': shift = 10; break;
+				case 'm': case 'M': shift = 20; break;
+				case 'g': case 'G': shift = 30; break;
+				default: throw std::invalid_argument("bad size suffix: " + text);
+				}
+				++idx;
+			}
+			if (idx != text.size())
+				throw std::invalid_argument("bad size: " + text);
+			return static_cast<size_t>(value) << shift;
+		}
+
+	} // namespace text_charset_detection::bench
+} // namespace text_charset_detection
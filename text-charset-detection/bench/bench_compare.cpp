@@ -0,0 +1,197 @@
+// Compares two benchmark reports (written with --json) and flags statistically significant regressions.
+//
+// Build (from this directory):	g++ -O2 -std=c++20 bench_compare.cpp ../detcharset.cpp -o bench_compare
+// Usage:	bench_compare [--threshold 0.02] [--confidence 0.95] BASELINE.json CANDIDATE.json
+//
+// For every (key, metric) present in both reports the difference of the means gets a Welch confidence interval from the
+// per-repetition samples (run the benchmarks with --repeat 5 or more). A key is a regression if the whole interval lies
+// beyond --threshold on the worse side, i.e. the slowdown is both significant and large enough to matter, an improvement
+// vice versa, noise otherwise.
+// Exit code: 0 no regression, 1 at least one regression, 2 usage or input error.
+
+#include "bench_report.h"
+
+#include <algorithm>
+#include <iostream>
+
+using namespace text_charset_detection::bench;
+
+namespace
+{
+	struct Stats
+	{
+		size_t n = 0;
+		double mean = 0;
+		double variance = 0;		// sample variance, 0 for n < 2
+	};
+
+	Stats ComputeStats(const std::vector<double>& samples)
+	{
+		Stats stats;
+		stats.n = samples.size();
+		if (stats.n == 0)
+			return stats;
+		for (double s : samples)
+			stats.mean += s;
+		stats.mean /= stats.n;
+		if (stats.n >= 2)
+		{
+			for (double s : samples)
+				stats.variance += (s - stats.mean) * (s - stats.mean);
+			stats.variance /= stats.n - 1;
+		}
+		return stats;
+	}
+
+	// inverse of the standard normal CDF (Acklam's rational approximation, relative error < 1.2e-9)
+	double NormalQuantile(double p)
+	{
+		static const double a[] = { -3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02, 1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00 };
+		static const double b[] = { -5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02, 6.680131188771972e+01, -1.328068155288572e+01 };
+		static const double c[] = { -7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00, -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00 };
+		static const double d[] = { 7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00, 3.754408661907416e+00 };
+		if (p < 0.02425)
+		{
+			const double q = std::sqrt(-2 * std::log(p));
+			return (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) / ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+		}
+		if (p > 1 - 0.02425)
+			return -NormalQuantile(1 - p);
+		const double q = p - 0.5;
+		const double r = q * q;
+		return (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q / (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1);
+	}
+
+	// Student t quantile by Cornish-Fisher expansion around the normal quantile, good to ~1% from 3 degrees of freedom
+	double StudentTQuantile(double p, double df)
+	{
+		const double z = NormalQuantile(p);
+		const double z3 = z * z * z, z5 = z3 * z * z, z7 = z5 * z * z;
+		return z
+			+ (z3 + z) / (4 * df)
+			+ (5 * z5 + 16 * z3 + 3 * z) / (96 * df * df)
+			+ (3 * z7 + 19 * z5 + 17 * z3 - 15 * z) / (384 * df * df * df);
+	}
+
+	enum class Verdict { Regression, Improvement, Noise, Insufficient };
+
+	const char* VerdictName(Verdict verdict)
+	{
+		switch (verdict)
+		{
+		case Verdict::Regression:	return "REGRESSION";
+		case Verdict::Improvement:	return "improvement";
+		case Verdict::Noise:		return "~";
+		case Verdict::Insufficient:	return "need >=2 samples";
+		}
+		return "?";
+	}
+
+	void PrintUsage(const char* argv0)
+	{
+		std::cerr << "usage: " << argv0 << " [--threshold RELATIVE] [--confidence LEVEL] BASELINE.json CANDIDATE.json\n";
+	}
+}
+
+int main(int argc, char** argv)
+{
+	double threshold = 0.02;
+	double confidence = 0.95;
+	std::vector<std::string> files;
+	try
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string arg = argv[i];
+			if (arg == "--threshold" && i + 1 < argc)
+				threshold = std::stod(argv[++i]);
+			else if (arg == "--confidence" && i + 1 < argc)
+				confidence = std::stod(argv[++i]);
+			else
+				files.push_back(arg);
+		}
+	}
+	catch (const std::exception&)
+	{
+		PrintUsage(argv[0]);
+		return 2;
+	}
+	if (files.size() != 2 || !(0.5 < confidence && confidence < 1) || threshold < 0)
+	{
+		PrintUsage(argv[0]);
+		return 2;
+	}
+
+	LoadedBenchReport baseline, candidate;
+	try
+	{
+		baseline = ReadBenchReport(files[0]);
+		candidate = ReadBenchReport(files[1]);
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << "\n";
+		return 2;
+	}
+
+	if (baseline.benchmark != candidate.benchmark)
+		std::cerr << "warning: comparing different benchmarks (" << baseline.benchmark << " vs " << candidate.benchmark << ")\n";
+	if (baseline.host.fingerprint != candidate.host.fingerprint)
+	{
+		std::cerr << "warning: host fingerprints differ, results may not be comparable\n"
+			<< "  baseline:  " << baseline.host.cpu << " | " << baseline.host.os << " | " << baseline.host.compiler << " | " << baseline.host.tuning << "\n"
+			<< "  candidate: " << candidate.host.cpu << " | " << candidate.host.os << " | " << candidate.host.compiler << " | " << candidate.host.tuning << "\n";
+	}
+
+	std::printf("%-40s %-10s %12s %12s %9s %21s  %s\n", "key", "metric", "baseline", "candidate", "change", "CI of change", "verdict");
+	size_t regressions = 0, improvements = 0, compared = 0;
+	for (const BenchRecord& base : baseline.records)
+	{
+		const std::vector<BenchRecord>::const_iterator cand = std::find_if(candidate.records.begin(), candidate.records.end(),
+			[&](const BenchRecord& r) { return r.key == base.key && r.metric == base.metric; });
+		if (cand == candidate.records.end())
+			continue;
+		++compared;
+
+		const Stats b = ComputeStats(base.samples);
+		const Stats c = ComputeStats(cand->samples);
+		if (b.n == 0 || c.n == 0 || b.mean == 0)
+			continue;
+
+		const double diff = c.mean - b.mean;
+		const double change = diff / b.mean;
+		Verdict verdict = Verdict::Insufficient;
+		double ciLow = 0, ciHigh = 0;
+		if (b.n >= 2 && c.n >= 2)
+		{
+			// Welch-Satterthwaite
+			const double vb = b.variance / b.n, vc = c.variance / c.n;
+			const double se = std::sqrt(vb + vc);
+			const double df = se == 0 ? 1e9 : (vb + vc) * (vb + vc) / (vb * vb / (b.n - 1) + vc * vc / (c.n - 1));
+			const double halfWidth = StudentTQuantile(1 - (1 - confidence) / 2, std::max(df, 1.0)) * se;
+			ciLow = (diff - halfWidth) / b.mean;
+			ciHigh = (diff + halfWidth) / b.mean;
+
+			// express in "better is positive" terms
+			const double betterLow = base.bHigherIsBetter ? ciLow : -ciHigh;
+			const double betterHigh = base.bHigherIsBetter ? ciHigh : -ciLow;
+			if (betterHigh < 0 && -betterHigh > threshold)
+				verdict = Verdict::Regression;
+			else if (betterLow > 0 && betterLow > threshold)
+				verdict = Verdict::Improvement;
+			else
+				verdict = Verdict::Noise;
+		}
+		regressions += verdict == Verdict::Regression;
+		improvements += verdict == Verdict::Improvement;
+
+		char ci[48] = "";
+		if (verdict != Verdict::Insufficient)
+			std::snprintf(ci, sizeof(ci), "[%+.1f%%, %+.1f%%]", ciLow * 100, ciHigh * 100);
+		std::printf("%-40s %-10s %12.4g %12.4g %+8.1f%% %21s  %s\n", base.key.c_str(), base.metric.c_str(), b.mean, c.mean, change * 100, ci, VerdictName(verdict));
+	}
+
+	std::printf("\n%zu compared, %zu regression(s), %zu improvement(s) at %.0f%% confidence, threshold %.1f%%\n",
+		compared, regressions, improvements, confidence * 100, threshold * 100);
+	return regressions == 0 ? 0 : 1;
+}
@@ -0,0 +1,392 @@
+// Micro-benchmarks for the UTF-8 classification primitives in isolation.
+//
+// Build (from this directory):	g++ -O2 -std=c++20 bench_primitives.cpp -o bench_primitives
+// Usage:	bench_primitives [--min-time 0.2] [--repeat 1] [--json results.json]
+//
+// Each fixed-width primitive is called on an array of 4-byte slots, every slot holding an instance the primitive accepts
+// with probability p (1, 0.9, 0.5, 0), so branch predictability is controlled: p=0.5 is the worst case for the predictor.
+// UTF8CheckErrors() is run over concatenated invalid sequences, either of a single error class or of all classes mixed.
+// Cycles come from the cycles hardware event when available, from the time stamp counter otherwise ("tsc" column);
+// branch-miss rates need the hardware events and are printed as n/a without them.
+// --repeat N measures every row N times, --json writes all repetitions as samples for bench_compare (see bench_report.h).
+
+// the primitives live in detail:: of the translation unit, pull it in directly instead of linking
+#include "../detcharset.cpp"
+#include "bench_common.h"
+#include "bench_report.h"
+#include "perf_counters.h"
+
+#include <cstdio>
+#include <functional>
+#include <iostream>
+
+using namespace text_charset_detection;
+using namespace text_charset_detection::bench;
+
+namespace
+{
+	constexpr size_t SLOT_SIZE = detail::UTF8_MAX_CHAR_SIZE;
+	constexpr size_t SLOT_COUNT = 16384;								// 64 KB of slots, stays in L2 so memory does not dominate
+
+	typedef void (*slot_generator_t)(std::mt19937_64& rng, byte_t* slot);
+
+	// random scalar value in [first, last] skipping surrogates, encoded into slot
+	void EncodeRandomCodePoint(std::mt19937_64& rng, byte_t* slot, uint32_t first, uint32_t last)
+	{
+		uint32_t codePoint;
+		do
+		{
+			codePoint = first + static_cast<uint32_t>(rng() % (last - first + 1));
+		} while (0xD800 <= codePoint && codePoint <= 0xDFFF);
+		std::vector<byte_t> encoded;
+		AppendUTF8(encoded, codePoint);
+		std::copy(encoded.begin(), encoded.end(), slot);
+	}
+
+	byte_t RandomContinuationByte(std::mt19937_64& rng)
+	{
+		return static_cast<byte_t>(0x80 + rng() % 0x40);
+	}
+
+	void ValidASCII7(std::mt19937_64& rng, byte_t* slot)
+	{
+		slot[0] = static_cast<byte_t>(RandomPrintableASCII(rng));
+	}
+
+	void InvalidASCII7(std::mt19937_64& rng, byte_t* slot)
+	{
+		// control chars and every byte with the high bit set
+		static const byte_t controls[] = { 0x00, 0x01, 0x08, 0x0B, 0x1B, 0x7F };
+		slot[0] = rng() % 2 ? controls[rng() % sizeof(controls)] : static_cast<byte_t>(0x80 + rng() % 0x80);
+	}
+
+	void Valid2Bytes(std::mt19937_64& rng, byte_t* slot)
+	{
+		EncodeRandomCodePoint(rng, slot, 0x80, 0x7FF);
+	}
+
+	void Invalid2Bytes(std::mt19937_64& rng, byte_t* slot)
+	{
+		// overlong leading byte, or valid leading byte followed by a non-continuation byte
+		slot[0] = rng() % 2 ? static_cast<byte_t>(0xC0 + rng() % 2) : static_cast<byte_t>(0xC2 + rng() % 30);
+		slot[1] = slot[0] < 0xC2 ? RandomContinuationByte(rng) : static_cast<byte_t>(rng() % 0x80);
+	}
+
+	void Valid3Bytes(std::mt19937_64& rng, byte_t* slot)
+	{
+		EncodeRandomCodePoint(rng, slot, 0x800, 0xFFFF);
+	}
+
+	void Invalid3Bytes(std::mt19937_64& rng, byte_t* slot)
+	{
+		switch (rng() % 3)
+		{
+		case 0:				// overlong
+			slot[0] = 0xE0;
+			slot[1] = static_cast<byte_t>(0x80 + rng() % 0x20);
+			break;
+		case 1:				// surrogate half
+			slot[0] = 0xED;
+			slot[1] = static_cast<byte_t>(0xA0 + rng() % 0x20);
+			break;
+		default:			// truncated sequence
+			slot[0] = static_cast<byte_t>(0xE1 + rng() % 12);
+			slot[1] = RandomContinuationByte(rng);
+			slot[2] = static_cast<byte_t>(rng() % 0x80);
+			return;
+		}
+		slot[2] = RandomContinuationByte(rng);
+	}
+
+	void Valid4Bytes(std::mt19937_64& rng, byte_t* slot)
+	{
+		EncodeRandomCodePoint(rng, slot, 0x10000, 0x10FFFF);
+	}
+
+	void Invalid4Bytes(std::mt19937_64& rng, byte_t* slot)
+	{
+		switch (rng() % 3)
+		{
+		case 0:				// overlong
+			slot[0] = 0xF0;
+			slot[1] = static_cast<byte_t>(0x80 + rng() % 0x10);
+			break;
+		case 1:				// above U+10FFFF
+			slot[0] = static_cast<byte_t>(0xF4 + rng() % 4);
+			slot[1] = static_cast<byte_t>(0x90 + rng() % 0x30);
+			break;
+		default:			// truncated sequence
+			slot[0] = static_cast<byte_t>(0xF1 + rng() % 3);
+			slot[1] = RandomContinuationByte(rng);
+			slot[2] = static_cast<byte_t>(rng() % 0x80);
+			slot[3] = RandomContinuationByte(rng);
+			return;
+		}
+		slot[2] = RandomContinuationByte(rng);
+		slot[3] = RandomContinuationByte(rng);
+	}
+
+	void ValidLeadingByte(std::mt19937_64& rng, byte_t* slot)
+	{
+		// 1, 2, 3, 4-byte leading bytes with equal probability
+		static const byte_t firsts[] = { 0x00, 0xC0, 0xE0, 0xF0 };
+		static const byte_t counts[] = { 0x80, 0x20, 0x10, 0x08 };
+		const size_t cls = rng() % 4;
+		slot[0] = static_cast<byte_t>(firsts[cls] + rng() % counts[cls]);
+	}
+
+	void InvalidLeadingByte(std::mt19937_64& rng, byte_t* slot)
+	{
+		// continuation bytes, 5/6-byte leading bytes, 0xFE/0xFF
+		slot[0] = rng() % 2 ? RandomContinuationByte(rng) : static_cast<byte_t>(0xF8 + rng() % 8);
+	}
+
+	struct Primitive
+	{
+		const char* name;
+		size_t bytesPerCall;						// bytes the primitive inspects when it accepts
+		slot_generator_t valid;
+		slot_generator_t invalid;
+		size_t (*pass)(const byte_t* slots);		// calls the primitive on every slot, returns the number of accepted slots
+	};
+
+	template <bool (*fn)(const detail::utf8_checking_unit_t*)>
+	size_t PredicatePass(const byte_t* slots)
+	{
+		size_t accepted = 0;
+		for (size_t idx = 0; idx < SLOT_COUNT; ++idx)
+		{
+			const bool bAccepted = fn(slots + idx * SLOT_SIZE);
+			DoNotOptimize(bAccepted);
+			accepted += bAccepted;
+		}
+		return accepted;
+	}
+
+	size_t LeadingBytePass(const byte_t* slots)
+	{
+		size_t accepted = 0;
+		for (size_t idx = 0; idx < SLOT_COUNT; ++idx)
+		{
+			bool bValid = false;
+			size_t utf8sequenceLength = 0;
+			detail::UTF8IsValidLeadingByte(slots + idx * SLOT_SIZE, bValid, utf8sequenceLength);
+			DoNotOptimize(utf8sequenceLength);
+			accepted += bValid;
+		}
+		return accepted;
+	}
+
+	const Primitive PRIMITIVES[] = {
+		{ "UTF8CharASCII7", 1, &ValidASCII7, &InvalidASCII7, &PredicatePass<detail::UTF8CharASCII7> },
+		{ "UTF8CharValid2Bytes", 2, &Valid2Bytes, &Invalid2Bytes, &PredicatePass<detail::UTF8CharValid2Bytes> },
+		{ "UTF8CharValid3Bytes", 3, &Valid3Bytes, &Invalid3Bytes, &PredicatePass<detail::UTF8CharValid3Bytes> },
+		{ "UTF8CharValid4Bytes", 4, &Valid4Bytes, &Invalid4Bytes, &PredicatePass<detail::UTF8CharValid4Bytes> },
+		{ "UTF8IsValidLeadingByte", 1, &ValidLeadingByte, &InvalidLeadingByte, &LeadingBytePass },
+	};
+
+	struct Distribution
+	{
+		const char* name;
+		double validProbability;
+	};
+
+	const Distribution DISTRIBUTIONS[] = {
+		{ "valid", 1.0 },
+		{ "90%-valid", 0.9 },
+		{ "50%-valid", 0.5 },
+		{ "invalid", 0.0 },
+	};
+
+	// error sequences fed to UTF8CheckErrors(), each one is consumed by whole calls (no valid bytes left in between)
+	struct ErrorClass
+	{
+		const char* name;
+		std::vector<byte_t> bytes;
+	};
+
+	const std::vector<ErrorClass> ERROR_CLASSES = {
+		{ "invalid-leading", { 0x80 } },
+		{ "too-long", { 0xF8, 0x88, 0x80, 0x80, 0x80 } },
+		{ "missing-continuation", { 0xC3, 0xC0, 0xAF } },
+		{ "control-char", { 0x01 } },
+		{ "overlong-2", { 0xC0, 0xAF } },
+		{ "overlong-3", { 0xE0, 0x80, 0xAF } },
+		{ "surrogate-half", { 0xED, 0xA0, 0x80 } },
+		{ "overlong-4", { 0xF0, 0x80, 0x80, 0xAF } },
+		{ "above-10FFFF-F4", { 0xF4, 0x90, 0x80, 0x80 } },
+		{ "above-10FFFF", { 0xF5, 0x80, 0x80, 0x80 } },
+	};
+
+	struct Measurement
+	{
+		double nsPerCall = 0;
+		double cyclesPerByte = 0;
+		const char* cycleSource = "n/a";
+		bool bBranchStats = false;
+		double branchMissRate = 0;
+		double branchMissesPerCall = 0;
+	};
+
+	// repeats pass() until minTimeSeconds elapsed, counting the whole run
+	Measurement Measure(const std::function<void()>& pass, size_t callsPerPass, size_t bytesPerPass, double minTimeSeconds)
+	{
+		PerfCounters counters{ PerfEvent::Cycles, PerfEvent::BranchInstructions, PerfEvent::BranchMisses };
+
+		pass();			// warm up caches and predictor tables
+
+		size_t passes = 0;
+		counters.Start();
+		const uint64_t tscStart = ReadTimestampCounter();
+		const bench_clock_t::time_point start = bench_clock_t::now();
+		do
+		{
+			pass();
+			++passes;
+		} while (SecondsSince(start) < minTimeSeconds);
+		const double seconds = SecondsSince(start);
+		const uint64_t tscTicks = ReadTimestampCounter() - tscStart;
+		counters.Stop();
+
+		const double calls = static_cast<double>(passes) * callsPerPass;
+		const double bytes = static_cast<double>(passes) * bytesPerPass;
+		Measurement m;
+		m.nsPerCall = seconds * 1e9 / calls;
+		if (counters.Has(PerfEvent::Cycles))
+		{
+			m.cyclesPerByte = counters.Value(PerfEvent::Cycles) / bytes;
+			m.cycleSource = "perf";
+		}
+		else if (TIMESTAMP_COUNTER_AVAILABLE)
+		{
+			m.cyclesPerByte = tscTicks / bytes;
+			m.cycleSource = "tsc";
+		}
+		if (counters.Has(PerfEvent::BranchInstructions) && counters.Has(PerfEvent::BranchMisses))
+		{
+			const uint64_t branches = counters.Value(PerfEvent::BranchInstructions);
+			m.bBranchStats = true;
+			m.branchMissRate = branches == 0 ? 0.0 : static_cast<double>(counters.Value(PerfEvent::BranchMisses)) / branches;
+			m.branchMissesPerCall = counters.Value(PerfEvent::BranchMisses) / calls;
+		}
+		return m;
+	}
+
+	void ReportRow(BenchReport& report, const char* primitive, const char* distribution, const Measurement& m)
+	{
+		const std::string key = std::string(primitive) + "/" + distribution;
+		report.AddSample(key, "ns/call", false, m.nsPerCall);
+		if (m.bBranchStats)
+			report.AddSample(key, "br-miss/call", false, m.branchMissesPerCall);
+
+		char missRate[32] = "n/a", missesPerCall[32] = "n/a", cyclesPerByte[32] = "n/a";
+		if (m.bBranchStats)
+		{
+			std::snprintf(missRate, sizeof(missRate), "%.2f%%", m.branchMissRate * 100.0);
+			std::snprintf(missesPerCall, sizeof(missesPerCall), "%.4f", m.branchMissesPerCall);
+		}
+		if (std::string(m.cycleSource) != "n/a")
+			std::snprintf(cyclesPerByte, sizeof(cyclesPerByte), "%.3f", m.cyclesPerByte);
+		std::printf("%-24s %-22s %10.3f %12s %5s %10s %13s\n", primitive, distribution, m.nsPerCall, cyclesPerByte, m.cycleSource, missRate, missesPerCall);
+		std::fflush(stdout);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	double minTimeSeconds = 0.2;
+	size_t repeat = 1;
+	std::string jsonPath;
+	for (int i = 1; i < argc; i += 2)
+	{
+		const std::string arg = argv[i];
+		if (i + 1 < argc && arg == "--min-time")
+			minTimeSeconds = std::atof(argv[i + 1]);
+		else if (i + 1 < argc && arg == "--repeat")
+			repeat = std::strtoull(argv[i + 1], nullptr, 10);
+		else if (i + 1 < argc && arg == "--json")
+			jsonPath = argv[i + 1];
+		else
+			repeat = 0;
+	}
+	if (repeat == 0)
+	{
+		std::cerr << "usage: " << argv[0] << " [--min-time SECONDS] [--repeat N] [--json PATH]\n";
+		return 2;
+	}
+
+	BenchReport report("bench_primitives");
+
+	std::printf("%-24s %-22s %10s %12s %5s %10s %13s\n", "primitive", "distribution", "ns/call", "cycles/byte", "src", "br-miss%", "br-miss/call");
+
+	std::vector<byte_t> slots(SLOT_COUNT * SLOT_SIZE);
+	for (const Primitive& primitive : PRIMITIVES)
+	{
+		for (const Distribution& distribution : DISTRIBUTIONS)
+		{
+			std::mt19937_64 rng(0x5EED);
+			std::bernoulli_distribution isValid(distribution.validProbability);
+			for (size_t idx = 0; idx < SLOT_COUNT; ++idx)
+			{
+				byte_t* slot = &slots[idx * SLOT_SIZE];
+				std::fill(slot, slot + SLOT_SIZE, byte_t(' '));
+				(isValid(rng) ? primitive.valid : primitive.invalid)(rng, slot);
+			}
+
+			for (size_t rep = 0; rep < repeat; ++rep)
+			{
+				const Measurement m = Measure([&]() { DoNotOptimize(primitive.pass(slots.data())); }, SLOT_COUNT, SLOT_COUNT * primitive.bytesPerCall, minTimeSeconds);
+				ReportRow(report, primitive.name, distribution.name, m);
+			}
+		}
+	}
+
+	// UTF8CheckErrors(): one buffer per error class plus one with all classes mixed in random order
+	std::vector<ErrorClass> errorBuffers;
+	std::mt19937_64 rng(0x5EED);
+	ErrorClass mixed{ "mixed", {} };
+	for (size_t idx = 0; idx < SLOT_COUNT; ++idx)
+	{
+		const std::vector<byte_t>& bytes = ERROR_CLASSES[rng() % ERROR_CLASSES.size()].bytes;
+		mixed.bytes.insert(mixed.bytes.end(), bytes.begin(), bytes.end());
+	}
+	for (const ErrorClass& errorClass : ERROR_CLASSES)
+	{
+		ErrorClass buffer{ errorClass.name, {} };
+		while (buffer.bytes.size() < mixed.bytes.size())
+			buffer.bytes.insert(buffer.bytes.end(), errorClass.bytes.begin(), errorClass.bytes.end());
+		errorBuffers.push_back(std::move(buffer));
+	}
+	errorBuffers.push_back(std::move(mixed));
+
+	for (const ErrorClass& buffer : errorBuffers)
+	{
+		const detail::utf8_checking_unit_t* bufferStart = buffer.bytes.data();
+		const detail::utf8_checking_unit_t* bufferEnd = bufferStart + buffer.bytes.size();
+
+		size_t callsPerPass = 0;
+		std::string reason;
+		for (const detail::utf8_checking_unit_t* ucharPtr = bufferStart; ucharPtr < bufferEnd; ++callsPerPass)
+			detail::UTF8CheckErrors(ucharPtr, bufferStart, bufferEnd, reason);
+
+		for (size_t rep = 0; rep < repeat; ++rep)
+		{
+			const Measurement m = Measure([&]()
+				{
+					reason.clear();
+					for (const detail::utf8_checking_unit_t* ucharPtr = bufferStart; ucharPtr < bufferEnd;)
+						detail::UTF8CheckErrors(ucharPtr, bufferStart, bufferEnd, reason);
+					DoNotOptimize(reason.size());
+				}, callsPerPass, buffer.bytes.size(), minTimeSeconds);
+			ReportRow(report, "UTF8CheckErrors", buffer.name, m);
+		}
+	}
+
+	std::string error;
+	if (!jsonPath.empty() && !report.Write(jsonPath, error))
+	{
+		std::cerr << error << "\n";
+		return 1;
+	}
+	return 0;
+}
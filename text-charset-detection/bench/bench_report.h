@@ -0,0 +1,447 @@
+#pragma once
+
+// Machine-readable benchmark results: every benchmark can write its measurements as JSON next to the table it prints,
+// bench_compare reads two such files back and tests for regressions. Format:
+// {
+//   "schema": "text_charset_detection-bench/1", "benchmark": "bench_validation", "timestamp": "2026-01-01T00:00:00Z",
+//   "host": { "fingerprint": "...", "cpu": "...", "logical_cpus": 8, "os": "...", "compiler": "...", "tuning": "..." },
+//   "results": [ { "key": "ascii/1M/scalar/tiny", "metric": "GB/s", "higher_is_better": true, "samples": [ 0.51, 0.52 ] }, ... ]
+// }
+// one sample per --repeat round, so bench_compare can estimate the noise of every key
+
+#include "../detcharset.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/utsname.h>
+#endif
+
+namespace text_charset_detection
+{
+	namespace bench {
+		constexpr const char* BENCH_REPORT_SCHEMA = "text_charset_detection-bench/1";
+
+		// ---- JSON writing ----
+
+		inline std::string JsonEscape(const std::string& text)
+		{
+			std::string out;
+			out.reserve(text.size() + 2);
+			for (const char c : text)
+			{
+				switch (c)
+				{
+				case '"':	out += "\\\""; break;
+				case '\\':	out += "\\\\"; break;
+				case '\n':	out += "\\n"; break;
+				case '\r':	out += "\\r"; break;
+				case '\t':	out += "\\t"; break;
+				default:
+					if (static_cast<unsigned char>(c) < 0x20)
+					{
+						char buf[8];
+						std::snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned>(static_cast<unsigned char>(c)));
+						out += buf;
+					}
+					else
+					{
+						out += c;
+					}
+				}
+			}
+			return out;
+		}
+
+		inline std::string JsonNumber(double value)
+		{
+			if (!std::isfinite(value))
+				return "null";
+			char buf[32];
+			std::snprintf(buf, sizeof(buf), "%.9g", value);
+			return buf;
+		}
+
+		// ---- JSON reading (just enough for the files written here) ----
+
+		struct JsonValue
+		{
+			enum class Type { Null, Bool, Number, String, Array, Object };
+			Type type = Type::Null;
+			bool boolean = false;
+			double number = 0;
+			std::string string;
+			std::vector<JsonValue> array;
+			std::map<std::string, JsonValue> object;
+
+			// member lookup, returns a null value if this is not an object or the member is missing
+			const JsonValue& operator[](const std::string& name) const
+			{
+				static const JsonValue nullValue;
+				if (type != Type::Object)
+					return nullValue;
+				const std::map<std::string, JsonValue>::const_iterator it = object.find(name);
+				return it == object.end() ? nullValue : it->second;
+			}
+		};
+
+		// throws std::runtime_error on malformed input
+		class JsonParser
+		{
+		public:
+			explicit JsonParser(const std::string& text) : text_(text) {}
+
+			JsonValue Parse()
+			{
+				JsonValue value = ParseValue();
+				SkipWhitespace();
+				if (pos_ != text_.size())
+					Fail("trailing characters");
+				return value;
+			}
+
+		private:
+			[[noreturn]] void Fail(const char* what) const
+			{
+				throw std::runtime_error(std::string("JSON parse error at offset ") + std::to_string(pos_) + ": " + what);
+			}
+
+			void SkipWhitespace()
+			{
+				while (pos_ < text_.size() && (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' || text_[pos_] == '\r'))
+					++pos_;
+			}
+
+			bool Consume(const char* literal)
+			{
+				const size_t len = std::char_traits<char>::length(literal);
+				if (text_.compare(pos_, len, literal) != 0)
+					return false;
+				pos_ += len;
+				return true;
+			}
+
+			JsonValue ParseValue()
+			{
+				SkipWhitespace();
+				if (pos_ >= text_.size())
+					Fail("unexpected end");
+				JsonValue value;
+				const char c = text_[pos_];
+				if (c == '{')
+				{
+					value.type = JsonValue::Type::Object;
+					++pos_;
+					SkipWhitespace();
+					if (Consume("}"))
+						return value;
+					do
+					{
+						SkipWhitespace();
+						const std::string name = ParseString();
+						SkipWhitespace();
+						if (!Consume(":"))
+							Fail("expected ':'");
+						value.object[name] = ParseValue();
+						SkipWhitespace();
+					} while (Consume(","));
+					if (!Consume("}"))
+						Fail("expected '}'");
+				}
+				else if (c == '[')
+				{
+					value.type = JsonValue::Type::Array;
+					++pos_;
+					SkipWhitespace();
+					if (Consume("]"))
+						return value;
+					do
+					{
+						value.array.push_back(ParseValue());
+						SkipWhitespace();
+					} while (Consume(","));
+					if (!Consume("]"))
+						Fail("expected ']'");
+				}
+				else if (c == '"')
+				{
+					value.type = JsonValue::Type::String;
+					value.string = ParseString();
+				}
+				else if (Consume("true"))
+				{
+					value.type = JsonValue::Type::Bool;
+					value.boolean = true;
+				}
+				else if (Consume("false"))
+				{
+					value.type = JsonValue::Type::Bool;
+				}
+				else if (Consume("null"))
+				{
+				}
+				else
+				{
+					const char* start = text_.c_str() + pos_;
+					char* end = nullptr;
+					value.type = JsonValue::Type::Number;
+					value.number = std::strtod(start, &end);
+					if (end == start)
+						Fail("unexpected character");
+					pos_ += static_cast<size_t>(end - start);
+				}
+				return value;
+			}
+
+			std::string ParseString()
+			{
+				if (!Consume("\""))
+					Fail("expected string");
+				std::string out;
+				while (pos_ < text_.size() && text_[pos_] != '"')
+				{
+					char c = text_[pos_++];
+					if (c == '\\')
+					{
+						if (pos_ >= text_.size())
+							Fail("unterminated escape");
+						c = text_[pos_++];
+						switch (c)
+						{
+						case 'n':	out += '\n'; break;
+						case 'r':	out += '\r'; break;
+						case 't':	out += '\t'; break;
+						case 'b':	out += '\b'; break;
+						case 'f':	out += '\f'; break;
+						case 'u':
+						{
+							if (pos_ + 4 > text_.size())
+								Fail("bad \\u escape");
+							const unsigned long codeUnit = std::stoul(text_.substr(pos_, 4), nullptr, 16);
+							pos_ += 4;
+							out += codeUnit < 0x80 ? static_cast<char>(codeUnit) : '?';		// only control chars are escaped by JsonEscape()
+							break;
+						}
+						default:	out += c; break;
+						}
+					}
+					else
+					{
+						out += c;
+					}
+				}
+				if (!Consume("\""))
+					Fail("unterminated string");
+				return out;
+			}
+
+			const std::string& text_;
+			size_t pos_ = 0;
+		};
+
+		// ---- host fingerprint ----
+
+		struct HostInfo
+		{
+			std::string cpu;
+			unsigned logicalCpus = 0;
+			std::string os;
+			std::string compiler;
+			std::string tuning;				// active TuningProfile, results are only comparable under the same thresholds
+			std::string fingerprint;		// hash of all of the above
+		};
+
+		inline uint64_t Fnv1a(const std::string& text, uint64_t hash = 0xCBF29CE484222325ull)
+		{
+			for (const char c : text)
+			{
+				hash ^= static_cast<unsigned char>(c);
+				hash *= 0x100000001B3ull;
+			}
+			return hash;
+		}
+
+		inline HostInfo GetHostInfo()
+		{
+			HostInfo host;
+
+			std::ifstream cpuinfo("/proc/cpuinfo");
+			std::string line;
+			while (std::getline(cpuinfo, line))
+			{
+				if (line.compare(0, 10, "model name") == 0 || line.compare(0, 9, "Processor") == 0)
+				{
+					const size_t colon = line.find(':');
+					if (colon != std::string::npos)
+						host.cpu = line.substr(line.find_first_not_of(" \t", colon + 1));
+					break;
+				}
+			}
+			if (host.cpu.empty())
+				host.cpu = "unknown";
+			host.logicalCpus = std::thread::hardware_concurrency();
+
+#if defined(__unix__) || defined(__APPLE__)
+			struct utsname uts;
+			if (uname(&uts) == 0)
+				host.os = std::string(uts.sysname) + " " + uts.release + " " + uts.machine;
+#elif defined(_WIN32)
+			host.os = "Windows";
+#endif
+			if (host.os.empty())
+				host.os = "unknown";
+
+#if defined(__clang__)
+			host.compiler = "clang " __clang_version__;
+#elif defined(__GNUC__)
+			host.compiler = "gcc " __VERSION__;
+#elif defined(_MSC_VER)
+			host.compiler = "msvc " + std::to_string(_MSC_FULL_VER);
+#else
+			host.compiler = "unknown";
+#endif
+#if defined(NDEBUG)
+			host.compiler += " NDEBUG";
+#endif
+
+			const TuningProfile tuning = GetTuningProfile();
+			host.tuning = "sample_size=" + std::to_string(tuning.sampleSize) + " tiny_mode_size_limit=" + std::to_string(tuning.tinyModeSizeLimit);
+
+			char buf[17];
+			std::snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(
+				Fnv1a(host.tuning, Fnv1a(host.compiler, Fnv1a(host.os, Fnv1a(host.cpu + "/" + std::to_string(host.logicalCpus)))))));
+			host.fingerprint = buf;
+			return host;
+		}
+
+		// ---- report ----
+
+		struct BenchRecord
+		{
+			std::string key;					// identifies the measured configuration, e.g. "latin/1M/scalar/tiny"
+			std::string metric;					// unit of the samples, e.g. "GB/s"
+			bool bHigherIsBetter = true;
+			std::vector<double> samples;
+		};
+
+		class BenchReport
+		{
+		public:
+			explicit BenchReport(std::string benchmark) : benchmark_(std::move(benchmark)) {}
+
+			// appends one sample to the record (key, metric), creating it on first use
+			void AddSample(const std::string& key, const std::string& metric, bool bHigherIsBetter, double value)
+			{
+				const std::string id = key + '\n' + metric;
+				std::map<std::string, size_t>::const_iterator it = index_.find(id);
+				if (it == index_.end())
+				{
+					it = index_.emplace(id, records_.size()).first;
+					records_.push_back({ key, metric, bHigherIsBetter, {} });
+				}
+				records_[it->second].samples.push_back(value);
+			}
+
+			bool Write(const std::string& path, std::string& error) const
+			{
+				const HostInfo host = GetHostInfo();
+				char timestamp[32];
+				const std::time_t now = std::time(nullptr);
+				std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+
+				std::ofstream ofs(path, std::ios::trunc);
+				ofs << "{\n"
+					<< "  \"schema\": \"" << BENCH_REPORT_SCHEMA << "\",\n"
+					<< "  \"benchmark\": \"" << JsonEscape(benchmark_) << "\",\n"
+					<< "  \"timestamp\": \"" << timestamp << "\",\n"
+					<< "  \"host\": {\n"
+					<< "    \"fingerprint\": \"" << host.fingerprint << "\",\n"
+					<< "    \"cpu\": \"" << JsonEscape(host.cpu) << "\",\n"
+					<< "    \"logical_cpus\": " << host.logicalCpus << ",\n"
+					<< "    \"os\": \"" << JsonEscape(host.os) << "\",\n"
+					<< "    \"compiler\": \"" << JsonEscape(host.compiler) << "\",\n"
+					<< "    \"tuning\": \"" << JsonEscape(host.tuning) << "\"\n"
+					<< "  },\n"
+					<< "  \"results\": [";
+				for (size_t idx = 0; idx < records_.size(); ++idx)
+				{
+					const BenchRecord& record = records_[idx];
+					ofs << (idx == 0 ? "\n" : ",\n")
+						<< "    { \"key\": \"" << JsonEscape(record.key) << "\", \"metric\": \"" << JsonEscape(record.metric)
+						<< "\", \"higher_is_better\": " << (record.bHigherIsBetter ? "true" : "false") << ", \"samples\": [";
+					for (size_t s = 0; s < record.samples.size(); ++s)
+						ofs << (s == 0 ? " " : ", ") << JsonNumber(record.samples[s]);
+					ofs << " ] }";
+				}
+				ofs << "\n  ]\n}\n";
+				ofs.close();
+				if (!ofs)
+				{
+					error = "cannot write " + path;
+					return false;
+				}
+				return true;
+			}
+
+		private:
+			std::string benchmark_;
+			std::vector<BenchRecord> records_;
+			std::map<std::string, size_t> index_;
+		};
+
+		struct LoadedBenchReport
+		{
+			std::string benchmark;
+			std::string timestamp;
+			HostInfo host;
+			std::vector<BenchRecord> records;
+		};
+
+		// throws std::runtime_error if the file cannot be read or is not a report
+		inline LoadedBenchReport ReadBenchReport(const std::string& path)
+		{
+			std::ifstream ifs(path);
+			if (!ifs)
+				throw std::runtime_error("cannot open " + path);
+			std::ostringstream content;
+			content << ifs.rdbuf();
+			const std::string text = content.str();
+			const JsonValue root = JsonParser(text).Parse();
+			if (root["schema"].string != BENCH_REPORT_SCHEMA)
+				throw std::runtime_error(path + ": not a " + BENCH_REPORT_SCHEMA + " file");
+
+			LoadedBenchReport report;
+			report.benchmark = root["benchmark"].string;
+			report.timestamp = root["timestamp"].string;
+			const JsonValue& host = root["host"];
+			report.host.fingerprint = host["fingerprint"].string;
+			report.host.cpu = host["cpu"].string;
+			report.host.logicalCpus = static_cast<unsigned>(host["logical_cpus"].number);
+			report.host.os = host["os"].string;
+			report.host.compiler = host["compiler"].string;
+			report.host.tuning = host["tuning"].string;
+			for (const JsonValue& result : root["results"].array)
+			{
+				BenchRecord record{ result["key"].string, result["metric"].string, result["higher_is_better"].boolean, {} };
+				for (const JsonValue& sample : result["samples"].array)
+					if (sample.type == JsonValue::Type::Number)
+						record.samples.push_back(sample.number);
+				report.records.push_back(std::move(record));
+			}
+			return report;
+		}
+
+	} // namespace text_charset_detection::bench
+} // namespace text_charset_detection
@@ -0,0 +1,319 @@
+// Per-file detection latency over many small files, split into open, read and validate phases.
+//
+// Build (from this directory):	g++ -O2 -std=c++20 bench_small_files.cpp -o bench_small_files
+// Usage:	bench_small_files [--dir PATH] [--files 20000] [--max-file-size 4K] [--keep] [--repeat 1] [--json results.json]
+//
+// Creates the files (sizes uniform in 1...max-file-size, mixed corpora) in a fresh directory, then runs every I/O backend
+// over all of them in shuffled order and prints p50/p99/p999/max latency per phase:
+//	ifstream	std::ifstream + ReadSampleToBuffer() (seek to end, seek back, allocate, read), what CheckStreamForUTF8NoBOM() does
+//	posix		open() + fstat() + read() into a buffer sized by the file size
+//	mmap		open() + fstat() + mmap(), "read" covers the mapping only, page faults are paid in validate
+// Validation is CheckBufferForUTF8NoBOM() for every backend. The page cache is warm (the files were just written),
+// drop it externally (echo 1 > /proc/sys/vm/drop_caches) before a run to measure cold storage.
+// --repeat N runs all backends N times over the same files, --json writes the percentiles of every round as samples
+// for bench_compare (see bench_report.h).
+
+// ReadSampleToBuffer() lives in detail:: of the translation unit, pull it in directly instead of linking
+#include "../detcharset.cpp"
+#include "bench_common.h"
+#include "bench_report.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define TEXT_CHARSET_DETECTION_BENCH_HAVE_POSIX 1
+#endif
+
+using namespace text_charset_detection;
+using namespace text_charset_detection::bench;
+
+namespace
+{
+	struct PhaseTimes
+	{
+		double open = 0;
+		double read = 0;
+		double validate = 0;
+		double total = 0;		// includes close/unmap/free, so it can exceed the sum of the phases
+	};
+
+	typedef bool (*backend_fn_t)(const std::string& path, PhaseTimes& times, bool& bUTF8);
+
+	double Elapsed(bench_clock_t::time_point from, bench_clock_t::time_point to)
+	{
+		return std::chrono::duration<double>(to - from).count();
+	}
+
+	bool IfstreamBackend(const std::string& path, PhaseTimes& times, bool& bUTF8)
+	{
+		const bench_clock_t::time_point t0 = bench_clock_t::now();
+		std::ifstream ifs(path, std::ios::binary);
+		if (!ifs)
+			return false;
+		const bench_clock_t::time_point t1 = bench_clock_t::now();
+		size_t allocBufferSize = 0, readCount = 0;
+		detail::MemoryReservation reservation;		// no budget is set here, always granted
+		std::unique_ptr<detail::utf8_checking_unit_t[]> sample = detail::ReadSampleToBuffer(ifs, allocBufferSize, readCount, reservation);
+		const bench_clock_t::time_point t2 = bench_clock_t::now();
+		std::string reason;
+		bUTF8 = CheckBufferForUTF8NoBOM(sample.get(), readCount, reason);
+		const bench_clock_t::time_point t3 = bench_clock_t::now();
+		sample.reset();
+		ifs.close();
+		const bench_clock_t::time_point t4 = bench_clock_t::now();
+
+		times = { Elapsed(t0, t1), Elapsed(t1, t2), Elapsed(t2, t3), Elapsed(t0, t4) };
+		return true;
+	}
+
+#if defined(TEXT_CHARSET_DETECTION_BENCH_HAVE_POSIX)
+	bool PosixReadBackend(const std::string& path, PhaseTimes& times, bool& bUTF8)
+	{
+		const bench_clock_t::time_point t0 = bench_clock_t::now();
+		const int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		const bench_clock_t::time_point t1 = bench_clock_t::now();
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+		{
+			close(fd);
+			return false;
+		}
+		const size_t fileSize = static_cast<size_t>(st.st_size);
+		const size_t sampleSize = GetTuningProfile().sampleSize;
+		const size_t allocBufferSize = sampleSize == 0 || sampleSize > fileSize ? fileSize : sampleSize;
+		std::unique_ptr<unsigned char[]> sample(new unsigned char[allocBufferSize]);
+		size_t readCount = 0;
+		while (readCount < allocBufferSize)
+		{
+			const ssize_t got = read(fd, sample.get() + readCount, allocBufferSize - readCount);
+			if (got <= 0)
+				break;
+			readCount += static_cast<size_t>(got);
+		}
+		const bench_clock_t::time_point t2 = bench_clock_t::now();
+		std::string reason;
+		bUTF8 = CheckBufferForUTF8NoBOM(sample.get(), readCount, reason);
+		const bench_clock_t::time_point t3 = bench_clock_t::now();
+		sample.reset();
+		close(fd);
+		const bench_clock_t::time_point t4 = bench_clock_t::now();
+
+		times = { Elapsed(t0, t1), Elapsed(t1, t2), Elapsed(t2, t3), Elapsed(t0, t4) };
+		return true;
+	}
+
+	bool MmapBackend(const std::string& path, PhaseTimes& times, bool& bUTF8)
+	{
+		const bench_clock_t::time_point t0 = bench_clock_t::now();
+		const int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		const bench_clock_t::time_point t1 = bench_clock_t::now();
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+		{
+			close(fd);
+			return false;
+		}
+		const size_t fileSize = static_cast<size_t>(st.st_size);
+		const size_t sampleSize = GetTuningProfile().sampleSize;
+		const size_t mapSize = sampleSize == 0 || sampleSize > fileSize ? fileSize : sampleSize;
+		void* mapping = nullptr;
+		if (mapSize > 0)
+		{
+			mapping = mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapping == MAP_FAILED)
+			{
+				close(fd);
+				return false;
+			}
+		}
+		const bench_clock_t::time_point t2 = bench_clock_t::now();
+		std::string reason;
+		bUTF8 = CheckBufferForUTF8NoBOM(static_cast<const unsigned char*>(mapping), mapSize, reason);
+		const bench_clock_t::time_point t3 = bench_clock_t::now();
+		if (mapping != nullptr)
+			munmap(mapping, mapSize);
+		close(fd);
+		const bench_clock_t::time_point t4 = bench_clock_t::now();
+
+		times = { Elapsed(t0, t1), Elapsed(t1, t2), Elapsed(t2, t3), Elapsed(t0, t4) };
+		return true;
+	}
+#endif
+
+	struct Backend
+	{
+		const char* name;
+		backend_fn_t run;
+	};
+
+	const Backend BACKENDS[] = {
+		{ "ifstream", &IfstreamBackend },
+#if defined(TEXT_CHARSET_DETECTION_BENCH_HAVE_POSIX)
+		{ "posix", &PosixReadBackend },
+		{ "mmap", &MmapBackend },
+#endif
+	};
+
+	// nearest-rank percentile of an already sorted sample
+	double Percentile(const std::vector<double>& sorted, double p)
+	{
+		if (sorted.empty())
+			return 0;
+		const size_t rank = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+		return sorted[std::min(rank, sorted.size() - 1)];
+	}
+
+	void ReportPhase(BenchReport& report, const char* backend, const char* phase, std::vector<double>& seconds)
+	{
+		std::sort(seconds.begin(), seconds.end());
+		const std::string key = std::string(backend) + "/" + phase;
+		report.AddSample(key, "p50-us", false, Percentile(seconds, 0.50) * 1e6);
+		report.AddSample(key, "p99-us", false, Percentile(seconds, 0.99) * 1e6);
+		report.AddSample(key, "p999-us", false, Percentile(seconds, 0.999) * 1e6);
+		double sum = 0;
+		for (double s : seconds)
+			sum += s;
+		std::printf("%-9s %-9s %10.2f %10.2f %10.2f %10.2f %10.2f\n", backend, phase,
+			seconds.empty() ? 0.0 : sum / seconds.size() * 1e6,
+			Percentile(seconds, 0.50) * 1e6, Percentile(seconds, 0.99) * 1e6, Percentile(seconds, 0.999) * 1e6,
+			seconds.empty() ? 0.0 : seconds.back() * 1e6);
+	}
+
+	void PrintUsage(const char* argv0)
+	{
+		std::cerr << "usage: " << argv0 << " [--dir PATH] [--files N] [--max-file-size N] [--keep] [--repeat N] [--json PATH]\n";
+	}
+}
+
+int main(int argc, char** argv)
+{
+	namespace fs = std::filesystem;
+
+	fs::path dir;
+	size_t fileCount = 20000;
+	size_t maxFileSize = 4096;
+	bool bKeep = false;
+	size_t repeat = 1;
+	std::string jsonPath;
+	try
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string arg = argv[i];
+			if (arg == "--keep")
+				bKeep = true;
+			else if (i + 1 < argc && arg == "--dir")
+				dir = argv[++i];
+			else if (i + 1 < argc && arg == "--files")
+				fileCount = std::stoull(argv[++i]);
+			else if (i + 1 < argc && arg == "--max-file-size")
+				maxFileSize = ParseSize(argv[++i]);
+			else if (i + 1 < argc && arg == "--repeat")
+				repeat = std::stoull(argv[++i]);
+			else if (i + 1 < argc && arg == "--json")
+				jsonPath = argv[++i];
+			else
+			{
+				PrintUsage(argv[0]);
+				return 2;
+			}
+		}
+	}
+	catch (const std::exception&)
+	{
+		PrintUsage(argv[0]);
+		return 2;
+	}
+	if (fileCount == 0 || maxFileSize == 0 || repeat == 0)
+	{
+		PrintUsage(argv[0]);
+		return 2;
+	}
+
+	if (dir.empty())
+		dir = fs::temp_directory_path() / ("detcharset-small-files-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+	std::error_code ec;
+	fs::create_directories(dir, ec);
+	if (ec)
+	{
+		std::cerr << "cannot create " << dir << ": " << ec.message() << "\n";
+		return 1;
+	}
+
+	// text corpora only: binary files are dominated by the error report, not by I/O
+	static const CorpusKind kinds[] = { CorpusKind::ASCII, CorpusKind::Latin, CorpusKind::CJK, CorpusKind::Emoji, CorpusKind::ErrorDense };
+	std::mt19937_64 rng(0x5EED);
+	std::vector<std::string> paths;
+	paths.reserve(fileCount);
+	for (size_t idx = 0; idx < fileCount; ++idx)
+	{
+		const size_t size = 1 + rng() % maxFileSize;
+		const std::vector<byte_t> content = GenerateCorpus(kinds[idx % std::size(kinds)], size, idx);
+		const fs::path path = dir / ("f" + std::to_string(idx) + ".txt");
+		std::ofstream ofs(path, std::ios::binary);
+		ofs.write(reinterpret_cast<const char*>(content.data()), content.size());
+		if (!ofs)
+		{
+			std::cerr << "cannot write " << path << "\n";
+			return 1;
+		}
+		paths.push_back(path.string());
+	}
+	std::printf("%zu files, 1...%zu bytes, in %s\n\n", fileCount, maxFileSize, dir.string().c_str());
+
+	std::printf("%-9s %-9s %10s %10s %10s %10s %10s   (microseconds)\n", "backend", "phase", "mean", "p50", "p99", "p999", "max");
+	BenchReport report("bench_small_files");
+	for (size_t rep = 0; rep < repeat; ++rep)
+	for (const Backend& backend : BACKENDS)
+	{
+		std::shuffle(paths.begin(), paths.end(), rng);
+		std::vector<double> open, read, validate, total;
+		open.reserve(fileCount);
+		read.reserve(fileCount);
+		validate.reserve(fileCount);
+		total.reserve(fileCount);
+		size_t utf8Files = 0;
+		for (const std::string& path : paths)
+		{
+			PhaseTimes times;
+			bool bUTF8 = false;
+			if (!backend.run(path, times, bUTF8))
+			{
+				std::cerr << backend.name << ": cannot process " << path << "\n";
+				return 1;
+			}
+			open.push_back(times.open);
+			read.push_back(times.read);
+			validate.push_back(times.validate);
+			total.push_back(times.total);
+			utf8Files += bUTF8;
+		}
+		ReportPhase(report, backend.name, "open", open);
+		ReportPhase(report, backend.name, "read", read);
+		ReportPhase(report, backend.name, "validate", validate);
+		ReportPhase(report, backend.name, "total", total);
+		DoNotOptimize(utf8Files);
+	}
+
+	if (!bKeep)
+		fs::remove_all(dir, ec);
+
+	std::string error;
+	if (!jsonPath.empty() && !report.Write(jsonPath, error))
+	{
+		std::cerr << error << "\n";
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,241 @@
+// End-to-end throughput of the UTF-8 validation engines over synthetic corpora.
+//
+// Build (from this directory):	g++ -O2 -std=c++20 bench_validation.cpp -o bench_validation
+// Usage:	bench_validation [--min-size 64] [--max-size 1G] [--corpus ascii|latin|cjk|emoji|binary|error-dense] [--min-time 0.25]
+//							[--repeat 1] [--json results.json]
+//
+// Every engine is run on both paths of CheckStreamForUTF8NoBOM(): tiny (interleaved buffer-end checks over the whole buffer)
+// and non-tiny (last UTF8_MAX_CHAR_SIZE bytes cut, no buffer-end checks), regardless of UTF8_TINY_MODE_SIZE_LIMIT,
+// so the crossover can be read off directly.
+// Hardware counters (perf_event_open) are summed over all iterations and reported per byte, next to IPC;
+// columns of events the host does not expose are printed as n/a.
+// --repeat N measures every row N times (interleaved with the other engines); --json writes all repetitions as samples
+// for bench_compare, see bench_report.h.
+
+// the engines live in detail:: of the translation unit, pull it in directly instead of linking
+#include "../detcharset.cpp"
+#include "bench_common.h"
+#include "bench_report.h"
+#include "perf_counters.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+using namespace text_charset_detection;
+using namespace text_charset_detection::bench;
+
+namespace
+{
+	typedef void (*engine_fn_t)(const detail::utf8_checking_unit_t* bufferStart, size_t size, bool& bValidUTF8, bool& b7bitASCIIOnly, std::string& reason);
+
+	struct Engine
+	{
+		const char* name;
+		const char* path;
+		engine_fn_t run;
+	};
+
+	void ScalarTiny(const detail::utf8_checking_unit_t* bufferStart, size_t size, bool& bValidUTF8, bool& b7bitASCIIOnly, std::string& reason)
+	{
+		size_t firstErrorOffset;
+		detail::CheckStreamForUTF8NoBOMInternal<true>(bufferStart, bufferStart + size, bValidUTF8, b7bitASCIIOnly, firstErrorOffset, reason);
+	}
+
+	void ScalarNonTiny(const detail::utf8_checking_unit_t* bufferStart, size_t size, bool& bValidUTF8, bool& b7bitASCIIOnly, std::string& reason)
+	{
+		size_t firstErrorOffset;
+		detail::CheckStreamForUTF8NoBOMInternal<false>(bufferStart, bufferStart + size - detail::UTF8_MAX_CHAR_SIZE, bValidUTF8, b7bitASCIIOnly, firstErrorOffset, reason);
+	}
+
+	const Engine ENGINES[] = {
+		{ "scalar", "tiny", &ScalarTiny },
+		{ "scalar", "non-tiny", &ScalarNonTiny },
+	};
+
+	// invalid corpora make the reason string grow by ~100 bytes per error (UTF8_DETAILED_ERROR_LIST), cap them so it stays in memory
+	size_t MaxCorpusSize(CorpusKind kind)
+	{
+		switch (kind)
+		{
+		case CorpusKind::Binary:		return size_t(4) << 20;
+		case CorpusKind::ErrorDense:	return size_t(64) << 20;
+		default:						return ~size_t(0);
+		}
+	}
+
+	struct Options
+	{
+		size_t minSize = 64;
+		size_t maxSize = size_t(1) << 30;
+		double minTimeSeconds = 0.25;
+		size_t repeat = 1;
+		std::string jsonPath;
+		std::vector<CorpusKind> corpora{ std::begin(ALL_CORPUS_KINDS), std::end(ALL_CORPUS_KINDS) };
+	};
+
+	void PrintUsage(const char* argv0)
+	{
+		std::cerr << "usage: " << argv0 << " [--min-size N] [--max-size N] [--corpus NAME]... [--min-time SECONDS] [--repeat N] [--json PATH]\n"
+			"  sizes accept K/M/G suffixes, corpus names: ascii latin cjk emoji binary error-dense\n";
+	}
+
+	bool ParseOptions(int argc, char** argv, Options& options)
+	{
+		bool bCorpusGiven = false;
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string arg = argv[i];
+			if (i + 1 >= argc)
+				return false;
+			const std::string value = argv[++i];
+			if (arg == "--min-size")
+				options.minSize = ParseSize(value);
+			else if (arg == "--max-size")
+				options.maxSize = ParseSize(value);
+			else if (arg == "--min-time")
+				options.minTimeSeconds = std::stod(value);
+			else if (arg == "--repeat")
+				options.repeat = std::stoull(value);
+			else if (arg == "--json")
+				options.jsonPath = value;
+			else if (arg == "--corpus")
+			{
+				if (!bCorpusGiven)
+					options.corpora.clear();
+				bCorpusGiven = true;
+				bool bFound = false;
+				for (CorpusKind kind : ALL_CORPUS_KINDS)
+				{
+					if (value == CorpusKindName(kind))
+					{
+						options.corpora.push_back(kind);
+						bFound = true;
+					}
+				}
+				if (!bFound)
+					return false;
+			}
+			else
+				return false;
+		}
+		return options.minSize >= detail::UTF8_MAX_CHAR_SIZE && options.minSize <= options.maxSize && options.repeat > 0;
+	}
+
+	struct EngineResult
+	{
+		size_t iterations = 0;
+		double bestSeconds = 1e300;			// fastest iteration, wall clock
+		bool bValidUTF8 = false;
+		// hardware counters summed over all iterations, 0 when not available
+		uint64_t cycles = 0, instructions = 0, branchMisses = 0, l1dMisses = 0, llcMisses = 0;
+		bool bHasIPC = false, bHasBranchMisses = false, bHasL1DMisses = false, bHasLLCMisses = false;
+	};
+
+	// runs engine on corpus until minTimeSeconds elapsed (at least once)
+	EngineResult TimeEngine(const Engine& engine, const std::vector<byte_t>& corpus, double minTimeSeconds)
+	{
+		PerfCounters counters{ PerfEvent::Cycles, PerfEvent::Instructions, PerfEvent::BranchMisses, PerfEvent::L1DReadMisses, PerfEvent::LLCMisses };
+		EngineResult result;
+		result.bHasIPC = counters.Has(PerfEvent::Cycles) && counters.Has(PerfEvent::Instructions);
+		result.bHasBranchMisses = counters.Has(PerfEvent::BranchMisses);
+		result.bHasL1DMisses = counters.Has(PerfEvent::L1DReadMisses);
+		result.bHasLLCMisses = counters.Has(PerfEvent::LLCMisses);
+
+		std::string reason;
+		const bench_clock_t::time_point benchStart = bench_clock_t::now();
+		do
+		{
+			reason.clear();
+			bool b7bitASCIIOnly = true;
+			counters.Start();
+			const bench_clock_t::time_point start = bench_clock_t::now();
+			engine.run(corpus.data(), corpus.size(), result.bValidUTF8, b7bitASCIIOnly, reason);
+			const double elapsed = SecondsSince(start);
+			counters.Stop();
+			DoNotOptimize(result.bValidUTF8);
+			DoNotOptimize(b7bitASCIIOnly);
+			DoNotOptimize(reason.size());
+
+			if (elapsed < result.bestSeconds)
+				result.bestSeconds = elapsed;
+			result.cycles += counters.Value(PerfEvent::Cycles);
+			result.instructions += counters.Value(PerfEvent::Instructions);
+			result.branchMisses += counters.Value(PerfEvent::BranchMisses);
+			result.l1dMisses += counters.Value(PerfEvent::L1DReadMisses);
+			result.llcMisses += counters.Value(PerfEvent::LLCMisses);
+			++result.iterations;
+		} while (SecondsSince(benchStart) < minTimeSeconds);
+		return result;
+	}
+
+	// formats value as fixed point, or "n/a" if the underlying counter is not available
+	std::string CounterColumn(bool bAvailable, double value, int precision)
+	{
+		if (!bAvailable)
+			return "n/a";
+		char buf[32];
+		std::snprintf(buf, sizeof(buf), "%.*f", precision, value);
+		return buf;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	try
+	{
+		if (!ParseOptions(argc, argv, options))
+		{
+			PrintUsage(argv[0]);
+			return 2;
+		}
+	}
+	catch (const std::exception&)
+	{
+		PrintUsage(argv[0]);
+		return 2;
+	}
+
+	BenchReport report("bench_validation");
+	std::printf("%-12s %8s %-8s %-9s %8s %10s %10s %6s %6s %10s %10s %10s\n",
+		"corpus", "size", "engine", "path", "iters", "GB/s", "ns/byte", "valid", "IPC", "br-miss/B", "L1D-miss/B", "LLC-miss/B");
+	for (CorpusKind kind : options.corpora)
+	{
+		for (size_t size = options.minSize; size <= options.maxSize; size *= 4)
+		{
+			if (size > MaxCorpusSize(kind))
+				break;
+
+			const std::vector<byte_t> corpus = GenerateCorpus(kind, size);
+			for (size_t rep = 0; rep < options.repeat; ++rep)
+			for (const Engine& engine : ENGINES)
+			{
+				const EngineResult r = TimeEngine(engine, corpus, options.minTimeSeconds);
+				const double totalBytes = static_cast<double>(size) * r.iterations;
+				const std::string key = std::string(CorpusKindName(kind)) + "/" + FormatSize(size) + "/" + engine.name + "/" + engine.path;
+				report.AddSample(key, "GB/s", true, size / r.bestSeconds / 1e9);
+				if (r.bHasIPC)
+					report.AddSample(key, "IPC", true, r.cycles == 0 ? 0.0 : static_cast<double>(r.instructions) / r.cycles);
+				if (r.bHasBranchMisses)
+					report.AddSample(key, "br-miss/B", false, r.branchMisses / totalBytes);
+				std::printf("%-12s %8s %-8s %-9s %8zu %10.3f %10.3f %6s %6s %10s %10s %10s\n",
+					CorpusKindName(kind), FormatSize(size).c_str(), engine.name, engine.path, r.iterations,
+					size / r.bestSeconds / 1e9, r.bestSeconds * 1e9 / size, r.bValidUTF8 ? "yes" : "no",
+					CounterColumn(r.bHasIPC, r.cycles == 0 ? 0.0 : static_cast<double>(r.instructions) / r.cycles, 2).c_str(),
+					CounterColumn(r.bHasBranchMisses, r.branchMisses / totalBytes, 4).c_str(),
+					CounterColumn(r.bHasL1DMisses, r.l1dMisses / totalBytes, 4).c_str(),
+					CounterColumn(r.bHasLLCMisses, r.llcMisses / totalBytes, 5).c_str());
+				std::fflush(stdout);
+			}
+		}
+	}
+
+	std::string error;
+	if (!options.jsonPath.empty() && !report.Write(options.jsonPath, error))
+	{
+		std::cerr << error << "\n";
+		return 1;
+	}
+	return 0;
+}
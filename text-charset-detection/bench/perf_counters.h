@@ -0,0 +1,204 @@
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+#if defined(__linux__)
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define TEXT_CHARSET_DETECTION_BENCH_HAVE_TSC 1
+#endif
+
+namespace text_charset_detection
+{
+	namespace bench {
+		// hardware events the benchmarks can ask for, availability depends on the host (VMs and containers often expose none)
+		enum class PerfEvent
+		{
+			Cycles,
+			Instructions,
+			BranchInstructions,
+			BranchMisses,
+			L1DReadMisses,
+			LLCMisses,
+		};
+
+		inline const char* PerfEventName(PerfEvent event)
+		{
+			switch (event)
+			{
+			case PerfEvent::Cycles:					return "cycles";
+			case PerfEvent::Instructions:			return "instructions";
+			case PerfEvent::BranchInstructions:		return "branches";
+			case PerfEvent::BranchMisses:			return "branch-misses";
+			case PerfEvent::L1DReadMisses:			return "L1-dcache-load-misses";
+			case PerfEvent::LLCMisses:				return "LLC-misses";
+			}
+			return "?";
+		}
+
+		// time stamp counter ticks, used as a cycle estimate when the cycles event cannot be opened
+		// (constant rate on current x86 CPUs, so it counts reference cycles, not core cycles)
+		inline uint64_t ReadTimestampCounter()
+		{
+#if defined(TEXT_CHARSET_DETECTION_BENCH_HAVE_TSC)
+			return __rdtsc();
+#else
+			return 0;
+#endif
+		}
+
+		constexpr bool TIMESTAMP_COUNTER_AVAILABLE =
+#if defined(TEXT_CHARSET_DETECTION_BENCH_HAVE_TSC)
+			true;
+#else
+			false;
+#endif
+
+		// user-space-only counters for the calling thread, opened via perf_event_open(2) on Linux, unavailable elsewhere
+		// events that cannot be opened are silently dropped, check Has() before using Value()
+		// usage: Start(), <measured code>, Stop(), Value(event); Start() resets the values
+		class PerfCounters
+		{
+		public:
+			explicit PerfCounters(std::initializer_list<PerfEvent> events)
+			{
+#if defined(__linux__)
+				for (PerfEvent event : events)
+				{
+					perf_event_attr attr;
+					std::memset(&attr, 0, sizeof(attr));
+					attr.size = sizeof(attr);
+					attr.disabled = 1;
+					attr.exclude_kernel = 1;
+					attr.exclude_hv = 1;
+					attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+					ConfigureEvent(event, attr);
+
+					// each event gets its own fd instead of a group: a group fails as a whole if the PMU cannot schedule all of them
+					const long fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+					if (fd >= 0)
+						counters_.push_back({ event, static_cast<int>(fd), 0 });
+				}
+#else
+				(void)events;
+#endif
+			}
+
+			~PerfCounters()
+			{
+#if defined(__linux__)
+				for (const Counter& counter : counters_)
+					close(counter.fd);
+#endif
+			}
+
+			PerfCounters(const PerfCounters&) = delete;
+			PerfCounters& operator=(const PerfCounters&) = delete;
+
+			bool Has(PerfEvent event) const
+			{
+				for (const Counter& counter : counters_)
+					if (counter.event == event)
+						return true;
+				return false;
+			}
+
+			bool Available() const
+			{
+				return !counters_.empty();
+			}
+
+			void Start()
+			{
+#if defined(__linux__)
+				for (const Counter& counter : counters_)
+				{
+					ioctl(counter.fd, PERF_EVENT_IOC_RESET, 0);
+					ioctl(counter.fd, PERF_EVENT_IOC_ENABLE, 0);
+				}
+#endif
+			}
+
+			void Stop()
+			{
+#if defined(__linux__)
+				for (Counter& counter : counters_)
+				{
+					ioctl(counter.fd, PERF_EVENT_IOC_DISABLE, 0);
+					// { value, time enabled, time running }: with more events than hardware counters the kernel multiplexes them,
+					// so the raw value is scaled up to the whole enabled period
+					uint64_t readBuf[3] = { 0, 0, 0 };
+					if (read(counter.fd, readBuf, sizeof(readBuf)) != sizeof(readBuf) || readBuf[2] == 0)
+						counter.value = 0;
+					else if (readBuf[2] < readBuf[1])
+						counter.value = static_cast<uint64_t>(static_cast<double>(readBuf[0]) * readBuf[1] / readBuf[2]);
+					else
+						counter.value = readBuf[0];
+				}
+#endif
+			}
+
+			// value measured between the last Start()/Stop() pair, 0 if the event is not available
+			uint64_t Value(PerfEvent event) const
+			{
+				for (const Counter& counter : counters_)
+					if (counter.event == event)
+						return counter.value;
+				return 0;
+			}
+
+		private:
+			struct Counter
+			{
+				PerfEvent event;
+				int fd;
+				uint64_t value;
+			};
+
+#if defined(__linux__)
+			static void ConfigureEvent(PerfEvent event, perf_event_attr& attr)
+			{
+				attr.type = PERF_TYPE_HARDWARE;
+				switch (event)
+				{
+				case PerfEvent::Cycles:
+					attr.config = PERF_COUNT_HW_CPU_CYCLES;
+					break;
+				case PerfEvent::Instructions:
+					attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+					break;
+				case PerfEvent::BranchInstructions:
+					attr.config = PERF_COUNT_HW_BRANCH_INSTRUCTIONS;
+					break;
+				case PerfEvent::BranchMisses:
+					attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+					break;
+				case PerfEvent::L1DReadMisses:
+					attr.type = PERF_TYPE_HW_CACHE;
+					attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+					break;
+				case PerfEvent::LLCMisses:
+					attr.config = PERF_COUNT_HW_CACHE_MISSES;		// generic last level cache miss event, loads and stores
+					break;
+				}
+			}
+#endif
+
+			std::vector<Counter> counters_;
+		};
+
+	} // namespace text_charset_detection::bench
+} // namespace text_charset_detection
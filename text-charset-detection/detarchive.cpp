@@ -0,0 +1,780 @@
+#include "detarchive.h"
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(TEXT_CHARSET_DETECTION_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+namespace text_charset_detection
+{
+	namespace detail {
+		constexpr size_t TAR_BLOCK_SIZE = 512;								// tar headers and padded member contents come in blocks of this size
+		constexpr size_t ARCHIVE_SKIP_CHUNK_SIZE = 65536;					// content past the sample is read and dropped in chunks of this size (streams may not seek)
+		constexpr size_t ARCHIVE_READ_CHUNK_SIZE = 16384;					// sample content is read and fed to the detector in chunks of this size
+		constexpr uint64_t TAR_MAX_EXTENDED_HEADER_SIZE = 1 << 20;			// larger pax / GNU long name headers are taken as damage, not buffered
+		constexpr size_t INFLATE_INPUT_CHUNK_SIZE = 16384;					// compressed bytes read at a time, inflating stops as soon as the sample is complete
+
+		// tar header layout (POSIX ustar), offset and size of the fields used
+		constexpr size_t TAR_NAME = 0, TAR_NAME_SIZE = 100;
+		constexpr size_t TAR_SIZE = 124, TAR_SIZE_SIZE = 12;
+		constexpr size_t TAR_CHECKSUM = 148, TAR_CHECKSUM_SIZE = 8;
+		constexpr size_t TAR_TYPE = 156;
+		constexpr size_t TAR_MAGIC = 257;
+		constexpr size_t TAR_PREFIX = 345, TAR_PREFIX_SIZE = 155;
+
+		// zip records (APPNOTE.TXT), signatures and fixed sizes
+		constexpr uint32_t ZIP_LOCAL_HEADER_SIGNATURE = 0x04034b50;
+		constexpr uint32_t ZIP_CENTRAL_HEADER_SIGNATURE = 0x02014b50;
+		constexpr uint32_t ZIP_END_OF_CENTRAL_DIRECTORY_SIGNATURE = 0x06054b50;
+		constexpr uint32_t ZIP64_END_OF_CENTRAL_DIRECTORY_SIGNATURE = 0x06064b50;
+		constexpr uint32_t ZIP64_LOCATOR_SIGNATURE = 0x07064b50;
+		constexpr size_t ZIP_LOCAL_HEADER_SIZE = 30;
+		constexpr size_t ZIP_CENTRAL_HEADER_SIZE = 46;
+		constexpr size_t ZIP_END_OF_CENTRAL_DIRECTORY_SIZE = 22;
+		constexpr size_t ZIP64_END_OF_CENTRAL_DIRECTORY_SIZE = 56;
+		constexpr size_t ZIP64_LOCATOR_SIZE = 20;
+		constexpr size_t ZIP_MAX_COMMENT_SIZE = 65535;
+		constexpr uint16_t ZIP64_EXTRA_FIELD_ID = 0x0001;
+		constexpr uint16_t ZIP_METHOD_STORED = 0;
+		constexpr uint16_t ZIP_METHOD_DEFLATED = 8;
+		constexpr uint16_t ZIP_FLAG_ENCRYPTED = 0x0001;
+		constexpr int ZIP_DEFLATE_WINDOW_BITS = 15;						// negated for zlib: raw deflate, no zlib header
+		constexpr int GZIP_WINDOW_BITS = 16 + 15;						// zlib: gzip header and trailer, 32 KiB window
+		constexpr size_t GZIP_OUTPUT_CHUNK_SIZE = 16384;				// GzipIstream inflates this much at a time
+
+		inline bool ReadExactly(std::istream& is, unsigned char* buffer, size_t size)
+		{
+			is.read(reinterpret_cast<char*>(buffer), static_cast<std::streamsize>(size));
+			return static_cast<size_t>(is.gcount()) == size;
+		}
+
+		inline bool SkipExactly(std::istream& is, uint64_t size)
+		{
+			while (size > 0)
+			{
+				const size_t chunk = static_cast<size_t>(std::min<uint64_t>(size, ARCHIVE_SKIP_CHUNK_SIZE));
+				is.ignore(static_cast<std::streamsize>(chunk));
+				if (static_cast<size_t>(is.gcount()) != chunk)
+					return false;
+				size -= chunk;
+			}
+			return true;
+		}
+
+		// reads size bytes of member content: the sample is detected as it streams by, the rest is dropped; the claimed size
+		// only bounds the reads, memory is bounded by the sample size
+		inline bool DetectStreamedContent(std::istream& is, uint64_t size, DetectionResult& detection)
+		{
+			StreamingCharsetDetector detector(size);
+			unsigned char chunk[ARCHIVE_READ_CHUNK_SIZE];
+			uint64_t remaining = size, fed = 0;
+			while (remaining > 0 && !detector.Done())
+			{
+				const size_t chunkSize = static_cast<size_t>(std::min<uint64_t>(remaining, sizeof(chunk)));
+				if (!ReadExactly(is, chunk, chunkSize))
+					return false;
+				remaining -= chunkSize;
+				fed += detector.Feed(chunk, chunkSize);
+			}
+			if (!SkipExactly(is, remaining))
+				return false;
+			detection = detector.Finish(fed == size);
+			return true;
+		}
+
+		inline uint64_t TarPadding(uint64_t contentSize)
+		{
+			return (TAR_BLOCK_SIZE - contentSize % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+		}
+
+		inline std::string TarString(const unsigned char* field, size_t size)
+		{
+			const unsigned char* const end = std::find(field, field + size, '\0');
+			return std::string(reinterpret_cast<const char*>(field), end - field);
+		}
+
+		// octal digits (leading spaces, terminated by space or NUL), or GNU base-256 when the high bit of the first byte is set
+		inline bool ParseTarNumber(const unsigned char* field, size_t size, uint64_t& value)
+		{
+			value = 0;
+			if (field[0] & 0x80)
+			{
+				if (field[0] != 0x80)
+					return false;								// negative or more than 64 bits
+				for (size_t idx = 1; idx < size; ++idx)
+				{
+					if (value >> 56)
+						return false;
+					value = value << 8 | field[idx];
+				}
+				return true;
+			}
+			size_t idx = 0;
+			while (idx < size && field[idx] == ' ')
+				++idx;
+			bool bDigits = false;
+			for (; idx < size && field[idx] >= '0' && field[idx] <= '7'; ++idx)
+			{
+				if (value >> 61)
+					return false;
+				value = value << 3 | (field[idx] - '0');
+				bDigits = true;
+			}
+			return bDigits && (idx == size || field[idx] == ' ' || field[idx] == '\0');
+		}
+
+		// the checksum field counts as spaces; some old tars summed signed chars
+		inline bool TarChecksumValid(const unsigned char* header)
+		{
+			uint64_t stored;
+			if (!ParseTarNumber(header + TAR_CHECKSUM, TAR_CHECKSUM_SIZE, stored))
+				return false;
+			uint64_t unsignedSum = 0;
+			int64_t signedSum = 0;
+			for (size_t idx = 0; idx < TAR_BLOCK_SIZE; ++idx)
+			{
+				const unsigned char byte = idx >= TAR_CHECKSUM && idx < TAR_CHECKSUM + TAR_CHECKSUM_SIZE ? ' ' : header[idx];
+				unsignedSum += byte;
+				signedSum += static_cast<signed char>(byte);
+			}
+			return stored == unsignedSum || static_cast<int64_t>(stored) == signedSum;
+		}
+
+		// pax records "<length> <key>=<value>\n", of the keys only path and size matter here
+		inline bool ParsePaxRecords(const std::string& records, std::string& path, uint64_t& size, bool& bSize)
+		{
+			size_t pos = 0;
+			while (pos < records.size())
+			{
+				size_t length = 0, digitsEnd = pos;
+				for (; digitsEnd < records.size() && records[digitsEnd] >= '0' && records[digitsEnd] <= '9'; ++digitsEnd)
+					length = length * 10 + (records[digitsEnd] - '0');
+				if (digitsEnd == pos || digitsEnd >= records.size() || records[digitsEnd] != ' ' || length <= digitsEnd + 1 - pos || length > records.size() - pos || records[pos + length - 1] != '\n')
+					return false;
+				const size_t eq = records.find('=', digitsEnd + 1);
+				if (eq == std::string::npos || eq >= pos + length)
+					return false;
+				const std::string key = records.substr(digitsEnd + 1, eq - digitsEnd - 1);
+				const std::string value = records.substr(eq + 1, pos + length - 1 - (eq + 1));
+				if (key == "path")
+					path = value;
+				else if (key == "size")
+				{
+					const unsigned char* const digits = reinterpret_cast<const unsigned char*>(value.data());
+					size = 0;
+					for (size_t idx = 0; idx < value.size(); ++idx)
+					{
+						if (digits[idx] < '0' || digits[idx] > '9' || size > (UINT64_MAX - 9) / 10)
+							return false;
+						size = size * 10 + (digits[idx] - '0');
+					}
+					bSize = !value.empty();
+				}
+				pos += length;
+			}
+			return true;
+		}
+
+		inline uint64_t ZipLoad(const unsigned char* pos, size_t size)
+		{
+			uint64_t value = 0;
+			for (size_t idx = 0; idx < size; ++idx)
+				value |= static_cast<uint64_t>(pos[idx]) << (8 * idx);
+			return value;
+		}
+
+		inline bool ReadAt(std::istream& is, uint64_t offset, unsigned char* buffer, size_t size)
+		{
+			is.clear();
+			is.seekg(static_cast<std::streamoff>(offset));
+			return is && ReadExactly(is, buffer, size);
+		}
+
+		// reads compressed data from is (at most compressedSize bytes) and feeds the inflated content to detector until it is
+		// done or the stream ends; windowBits as for zlib's inflateInit2(); bContentEnded: all of the content was fed
+		// content inflating past size is damage (the detector was sized by it), nothing past size is fed
+		inline bool InflateToDetector(std::istream& is, uint64_t compressedSize, uint64_t size, int windowBits, StreamingCharsetDetector& detector, bool& bContentEnded, std::string& reason)
+		{
+			bContentEnded = false;
+#if defined(TEXT_CHARSET_DETECTION_HAVE_ZLIB)
+			z_stream stream = {};
+			if (inflateInit2(&stream, windowBits) != Z_OK)
+			{
+				reason += "cannot initialise zlib\n";
+				return false;
+			}
+			unsigned char input[INFLATE_INPUT_CHUNK_SIZE];
+			unsigned char output[ARCHIVE_READ_CHUNK_SIZE];
+			int status = Z_OK;
+			bool bAllFed = true;
+			while (!detector.Done() && status != Z_STREAM_END)
+			{
+				if (stream.avail_in == 0)
+				{
+					const size_t chunk = static_cast<size_t>(std::min<uint64_t>(compressedSize, sizeof(input)));
+					is.read(reinterpret_cast<char*>(input), static_cast<std::streamsize>(chunk));
+					stream.next_in = input;
+					stream.avail_in = static_cast<uInt>(is.gcount());
+					compressedSize -= stream.avail_in;
+					if (stream.avail_in == 0)
+						break;									// truncated: detect what came out so far
+				}
+				stream.next_out = output;
+				stream.avail_out = sizeof(output);
+				status = inflate(&stream, Z_NO_FLUSH);
+				if (status != Z_OK && status != Z_STREAM_END)
+				{
+					reason += std::string("corrupt deflate data: ") + (stream.msg != nullptr ? stream.msg : "zlib error " + std::to_string(status)) + "\n";
+					inflateEnd(&stream);
+					return false;
+				}
+				const size_t produced = sizeof(output) - stream.avail_out;
+				if (produced > size)
+				{
+					reason += "content inflates past its size in the directory\n";
+					inflateEnd(&stream);
+					return false;
+				}
+				size -= produced;
+				bAllFed = detector.Feed(output, produced) == produced;
+			}
+			bContentEnded = status == Z_STREAM_END && bAllFed;
+			inflateEnd(&stream);
+			return true;
+#else
+			(void)is; (void)compressedSize; (void)size; (void)windowBits; (void)detector;
+			reason += "deflated content, built without zlib\n";
+			return false;
+#endif
+		}
+
+		struct ZipEntry
+		{
+			std::string name;
+			uint16_t flags;
+			uint16_t method;
+			uint64_t compressedSize;
+			uint64_t size;
+			uint64_t localHeaderOffset;
+		};
+
+		// locates the (zip64) end of central directory record and parses the central directory
+		inline bool ReadZipCentralDirectory(std::istream& is, std::vector<ZipEntry>& entries, std::string& reason)
+		{
+			is.seekg(0, std::ios::end);
+			const uint64_t fileSize = static_cast<uint64_t>(is.tellg());
+			const size_t tailSize = static_cast<size_t>(std::min<uint64_t>(fileSize, ZIP_END_OF_CENTRAL_DIRECTORY_SIZE + ZIP_MAX_COMMENT_SIZE));
+			std::vector<unsigned char> tail(tailSize);
+			if (tailSize < ZIP_END_OF_CENTRAL_DIRECTORY_SIZE || !ReadAt(is, fileSize - tailSize, tail.data(), tailSize))
+			{
+				reason += "not a zip archive (too short)\n";
+				return false;
+			}
+			// the last signature whose comment ends the file, data after the comment is tolerated as a fallback
+			size_t eocd = SIZE_MAX, fallback = SIZE_MAX;
+			for (size_t pos = tailSize - ZIP_END_OF_CENTRAL_DIRECTORY_SIZE + 1; pos-- > 0 && eocd == SIZE_MAX;)
+				if (ZipLoad(tail.data() + pos, 4) == ZIP_END_OF_CENTRAL_DIRECTORY_SIGNATURE)
+				{
+					const size_t recordEnd = pos + ZIP_END_OF_CENTRAL_DIRECTORY_SIZE + ZipLoad(tail.data() + pos + 20, 2);
+					if (recordEnd == tailSize)
+						eocd = pos;
+					else if (recordEnd < tailSize && fallback == SIZE_MAX)
+						fallback = pos;
+				}
+			if (eocd == SIZE_MAX)
+				eocd = fallback;
+			if (eocd == SIZE_MAX)
+			{
+				reason += "not a zip archive (no end of central directory record)\n";
+				return false;
+			}
+
+			const unsigned char* const record = tail.data() + eocd;
+			const uint64_t eocdOffset = fileSize - tailSize + eocd;
+			uint64_t disk = ZipLoad(record + 4, 2), directoryDisk = ZipLoad(record + 6, 2);
+			uint64_t entryCount = ZipLoad(record + 10, 2);
+			uint64_t directorySize = ZipLoad(record + 12, 4), directoryOffset = ZipLoad(record + 16, 4);
+			if (entryCount == 0xFFFF || directorySize == 0xFFFFFFFF || directoryOffset == 0xFFFFFFFF)
+			{
+				unsigned char locator[ZIP64_LOCATOR_SIZE], record64[ZIP64_END_OF_CENTRAL_DIRECTORY_SIZE];
+				if (eocdOffset < ZIP64_LOCATOR_SIZE || !ReadAt(is, eocdOffset - ZIP64_LOCATOR_SIZE, locator, sizeof(locator)) || ZipLoad(locator, 4) != ZIP64_LOCATOR_SIGNATURE
+					|| !ReadAt(is, ZipLoad(locator + 8, 8), record64, sizeof(record64)) || ZipLoad(record64, 4) != ZIP64_END_OF_CENTRAL_DIRECTORY_SIGNATURE)
+				{
+					reason += "damaged zip archive (zip64 end of central directory not found)\n";
+					return false;
+				}
+				disk = ZipLoad(record64 + 16, 4);
+				directoryDisk = ZipLoad(record64 + 20, 4);
+				entryCount = ZipLoad(record64 + 32, 8);
+				directorySize = ZipLoad(record64 + 40, 8);
+				directoryOffset = ZipLoad(record64 + 48, 8);
+			}
+			if (disk != 0 || directoryDisk != 0)
+			{
+				reason += "multi-volume zip archives are not supported\n";
+				return false;
+			}
+			if (directoryOffset > fileSize || directorySize > fileSize - directoryOffset || entryCount > directorySize / ZIP_CENTRAL_HEADER_SIZE)
+			{
+				reason += "damaged zip archive (central directory out of the file)\n";
+				return false;
+			}
+
+			std::vector<unsigned char> directory(static_cast<size_t>(directorySize));
+			if (!ReadAt(is, directoryOffset, directory.data(), directory.size()))
+			{
+				reason += "cannot read the zip central directory\n";
+				return false;
+			}
+			entries.clear();
+			entries.reserve(static_cast<size_t>(entryCount));
+			size_t pos = 0;
+			for (uint64_t idx = 0; idx < entryCount; ++idx)
+			{
+				const unsigned char* const header = directory.data() + pos;
+				if (directory.size() - pos < ZIP_CENTRAL_HEADER_SIZE || ZipLoad(header, 4) != ZIP_CENTRAL_HEADER_SIGNATURE)
+				{
+					reason += "damaged zip central directory at entry " + std::to_string(idx) + "\n";
+					return false;
+				}
+				const size_t nameSize = ZipLoad(header + 28, 2), extraSize = ZipLoad(header + 30, 2), commentSize = ZipLoad(header + 32, 2);
+				if (directory.size() - pos - ZIP_CENTRAL_HEADER_SIZE < nameSize + extraSize + commentSize)
+				{
+					reason += "damaged zip central directory at entry " + std::to_string(idx) + "\n";
+					return false;
+				}
+				ZipEntry entry;
+				entry.name.assign(reinterpret_cast<const char*>(header + ZIP_CENTRAL_HEADER_SIZE), nameSize);
+				entry.flags = static_cast<uint16_t>(ZipLoad(header + 8, 2));
+				entry.method = static_cast<uint16_t>(ZipLoad(header + 10, 2));
+				entry.compressedSize = ZipLoad(header + 20, 4);
+				entry.size = ZipLoad(header + 24, 4);
+				entry.localHeaderOffset = ZipLoad(header + 42, 4);
+				// zip64 extra field: 8-byte values of the saturated fields, in this order
+				for (const unsigned char* extra = header + ZIP_CENTRAL_HEADER_SIZE + nameSize, *const extraEnd = extra + extraSize; extraEnd - extra >= 4;)
+				{
+					const size_t fieldSize = ZipLoad(extra + 2, 2);
+					if (ZipLoad(extra, 2) == ZIP64_EXTRA_FIELD_ID)
+					{
+						const unsigned char* value = extra + 4;
+						const unsigned char* const valueEnd = value + std::min<size_t>(fieldSize, extraEnd - value);
+						for (uint64_t* field : { &entry.size, &entry.compressedSize, &entry.localHeaderOffset })
+							if (*field == 0xFFFFFFFF && valueEnd - value >= 8)
+							{
+								*field = ZipLoad(value, 8);
+								value += 8;
+							}
+					}
+					extra += 4 + fieldSize;
+				}
+				pos += ZIP_CENTRAL_HEADER_SIZE + nameSize + extraSize + commentSize;
+				if (entry.name.empty() || entry.name.back() != '/')
+					entries.push_back(std::move(entry));
+			}
+			return true;
+		}
+
+		// positioned read of one member's sample: local header, then stored bytes or as much inflated content as needed
+		inline void DetectZipMember(std::istream& is, const ZipEntry& entry, ArchiveMemberResult& member)
+		{
+			member.name = entry.name;
+			member.size = entry.size;
+			std::string& reason = member.detection.reason;
+			if (entry.flags & ZIP_FLAG_ENCRYPTED)
+			{
+				member.bContentRead = false;
+				reason += "encrypted member\n";
+				return;
+			}
+			if (entry.method != ZIP_METHOD_STORED && entry.method != ZIP_METHOD_DEFLATED)
+			{
+				member.bContentRead = false;
+				reason += "unsupported compression method " + std::to_string(entry.method) + "\n";
+				return;
+			}
+			unsigned char localHeader[ZIP_LOCAL_HEADER_SIZE];
+			if (!ReadAt(is, entry.localHeaderOffset, localHeader, sizeof(localHeader)) || ZipLoad(localHeader, 4) != ZIP_LOCAL_HEADER_SIGNATURE)
+			{
+				member.bContentRead = false;
+				reason += "damaged local header\n";
+				return;
+			}
+			const uint64_t dataOffset = entry.localHeaderOffset + ZIP_LOCAL_HEADER_SIZE + ZipLoad(localHeader + 26, 2) + ZipLoad(localHeader + 28, 2);
+
+			// the sizes in the directory are untrusted, they only bound the reads and hint the sample buffer size
+			StreamingCharsetDetector detector(entry.size);
+			std::string readReason;
+			bool bRead, bContentEnded = false;
+			is.clear();
+			is.seekg(static_cast<std::streamoff>(dataOffset));
+			if (entry.method == ZIP_METHOD_STORED)
+			{
+				unsigned char chunk[ARCHIVE_READ_CHUNK_SIZE];
+				uint64_t remaining = entry.size, fed = 0;
+				bRead = static_cast<bool>(is);
+				while (bRead && remaining > 0 && !detector.Done())
+				{
+					const size_t chunkSize = static_cast<size_t>(std::min<uint64_t>(remaining, sizeof(chunk)));
+					bRead = ReadExactly(is, chunk, chunkSize);
+					remaining -= chunkSize;
+					fed += detector.Feed(chunk, chunkSize);
+				}
+				if (!bRead)
+					readReason += "truncated member\n";
+				bContentEnded = fed == entry.size;
+			}
+			else
+				bRead = is && InflateToDetector(is, entry.compressedSize, entry.size, -ZIP_DEFLATE_WINDOW_BITS, detector, bContentEnded, readReason);
+			if (!bRead)
+			{
+				member.bContentRead = false;
+				reason += readReason;
+				return;
+			}
+			member.detection = detector.Finish(bContentEnded);
+		}
+
+		class GzipStreambuf : public std::streambuf
+		{
+		public:
+			explicit GzipStreambuf(std::istream& source) : source(source)
+			{
+#if defined(TEXT_CHARSET_DETECTION_HAVE_ZLIB)
+				if (inflateInit2(&stream, GZIP_WINDOW_BITS) == Z_OK)
+					bInitialised = true;
+				else
+					Fail("cannot initialise zlib");
+#else
+				Fail("gzip input, built without zlib");
+#endif
+			}
+
+			~GzipStreambuf()
+			{
+#if defined(TEXT_CHARSET_DETECTION_HAVE_ZLIB)
+				if (bInitialised)
+					inflateEnd(&stream);
+#endif
+			}
+
+			std::string error;
+
+		protected:
+			int_type underflow() override
+			{
+				if (gptr() < egptr())
+					return traits_type::to_int_type(*gptr());
+#if defined(TEXT_CHARSET_DETECTION_HAVE_ZLIB)
+				while (!bEnd)
+				{
+					if (stream.avail_in == 0)
+					{
+						source.read(reinterpret_cast<char*>(input), sizeof(input));
+						stream.next_in = input;
+						stream.avail_in = static_cast<uInt>(source.gcount());
+						if (stream.avail_in == 0)
+						{
+							if (!bMemberEnd)
+								Fail("truncated gzip data");
+							bEnd = true;
+							break;
+						}
+					}
+					if (bMemberEnd)
+					{
+						// another member follows (concatenated .gz files, log rotation appends)
+						inflateReset(&stream);
+						bMemberEnd = false;
+						bMemberStart = true;
+					}
+					stream.next_out = reinterpret_cast<Bytef*>(output);
+					stream.avail_out = sizeof(output);
+					const int status = inflate(&stream, Z_NO_FLUSH);
+					const size_t produced = sizeof(output) - stream.avail_out;
+					if (status == Z_STREAM_END)
+						bMemberEnd = true;
+					else if (status == Z_DATA_ERROR && bMemberStart && produced == 0 && bAnyMemberEnded)
+						bEnd = true;						// not a member header: trailing garbage after the last member
+					else if (status != Z_OK && status != Z_BUF_ERROR)
+					{
+						Fail(std::string("corrupt gzip data: ") + (stream.msg != nullptr ? stream.msg : "zlib error " + std::to_string(status)));
+						break;
+					}
+					bAnyMemberEnded |= bMemberEnd;
+					if (produced > 0)
+					{
+						bMemberStart = false;
+						setg(output, output, output + produced);
+						return traits_type::to_int_type(*gptr());
+					}
+				}
+#endif
+				return traits_type::eof();
+			}
+
+		private:
+			void Fail(const std::string& what)
+			{
+				error = what;
+				bEnd = true;
+			}
+
+			std::istream& source;
+			bool bEnd = false;
+#if defined(TEXT_CHARSET_DETECTION_HAVE_ZLIB)
+			z_stream stream = {};
+			bool bInitialised = false;
+			bool bMemberEnd = false;				// inflate() reached a member trailer
+			bool bMemberStart = true;				// nothing inflated from the current member yet
+			bool bAnyMemberEnded = false;
+			unsigned char input[INFLATE_INPUT_CHUNK_SIZE];
+#endif
+			char output[GZIP_OUTPUT_CHUNK_SIZE];
+		};
+	} // namespace text_charset_detection::detail
+
+	TEXT_CHARSET_DETECTION_INLINE bool DetectTarMembersCharset(std::istream& is, const archive_member_handler_t& onMember, std::string& reason)
+	{
+		unsigned char header[detail::TAR_BLOCK_SIZE];
+		uint64_t archiveOffset = 0;
+		// set by pax 'x' and GNU 'L' headers, apply to the next member only
+		std::string nextPath;
+		uint64_t nextSize = 0;
+		bool bNextSize = false;
+		while (true)
+		{
+			is.read(reinterpret_cast<char*>(header), sizeof(header));
+			const size_t readCount = static_cast<size_t>(is.gcount());
+			if (readCount == 0)
+				return true;									// end without the two zero blocks, written by some tools
+			if (readCount != sizeof(header))
+			{
+				reason += "truncated tar header at offset " + std::to_string(archiveOffset) + "\n";
+				return false;
+			}
+			if (std::all_of(header, header + sizeof(header), [](unsigned char byte) { return byte == 0; }))
+				return true;									// end-of-archive marker, anything after it is padding
+			if (!detail::TarChecksumValid(header))
+			{
+				reason += "tar header checksum mismatch at offset " + std::to_string(archiveOffset) + " (not a tar archive, or damaged)\n";
+				return false;
+			}
+			const uint64_t headerOffset = archiveOffset;
+			archiveOffset += sizeof(header);
+
+			uint64_t size;
+			if (!detail::ParseTarNumber(header + detail::TAR_SIZE, detail::TAR_SIZE_SIZE, size))
+			{
+				reason += "invalid member size in tar header at offset " + std::to_string(headerOffset) + "\n";
+				return false;
+			}
+			const char type = static_cast<char>(header[detail::TAR_TYPE]);
+			uint64_t padding = detail::TarPadding(size);
+
+			if (type == 'x' || type == 'L')
+			{
+				if (size > detail::TAR_MAX_EXTENDED_HEADER_SIZE)
+				{
+					reason += "oversized extended header at offset " + std::to_string(headerOffset) + "\n";
+					return false;
+				}
+				std::string content(static_cast<size_t>(size), '\0');
+				if (!detail::ReadExactly(is, reinterpret_cast<unsigned char*>(content.data()), content.size()) || !detail::SkipExactly(is, padding))
+				{
+					reason += "truncated extended header at offset " + std::to_string(headerOffset) + "\n";
+					return false;
+				}
+				archiveOffset += size + padding;
+				if (type == 'L')
+					nextPath = content.substr(0, content.find('\0'));
+				else if (!detail::ParsePaxRecords(content, nextPath, nextSize, bNextSize))
+				{
+					reason += "malformed pax header at offset " + std::to_string(headerOffset) + "\n";
+					return false;
+				}
+				continue;
+			}
+
+			if (bNextSize)
+			{
+				size = nextSize;
+				padding = detail::TarPadding(size);
+			}
+			std::string name = detail::TarString(header + detail::TAR_NAME, detail::TAR_NAME_SIZE);
+			// the prefix field only has that meaning in POSIX ustar, GNU tar keeps other data there
+			if (std::memcmp(header + detail::TAR_MAGIC, "ustar\0", 6) == 0 && header[detail::TAR_PREFIX] != '\0')
+				name = detail::TarString(header + detail::TAR_PREFIX, detail::TAR_PREFIX_SIZE) + "/" + name;
+			if (!nextPath.empty())
+				name = nextPath;
+			nextPath.clear();
+			bNextSize = false;
+
+			// regular files ('7' contiguous ones too), old tars mark directories only by a trailing '/'
+			const bool bRegularFile = (type == '0' || type == '\0' || type == '7') && !(type == '\0' && !name.empty() && name.back() == '/');
+			if (!bRegularFile)
+			{
+				if (!detail::SkipExactly(is, size + padding))
+				{
+					reason += "truncated tar member " + name + "\n";
+					return false;
+				}
+				archiveOffset += size + padding;
+				continue;
+			}
+
+			ArchiveMemberResult member;
+			member.name = name;
+			member.size = size;
+			if (!detail::DetectStreamedContent(is, size, member.detection) || !detail::SkipExactly(is, padding))
+			{
+				reason += "truncated tar member " + name + "\n";
+				return false;
+			}
+			archiveOffset += size + padding;
+			onMember(member);
+		}
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE bool DetectZipMembersCharset(const std::string& path, const archive_member_handler_t& onMember, std::string& reason, size_t threadCount)
+	{
+		std::vector<detail::ZipEntry> entries;
+		{
+			std::ifstream ifs(path, std::ios::binary);
+			if (!ifs)
+			{
+				reason += "cannot open " + path + "\n";
+				return false;
+			}
+			if (!detail::ReadZipCentralDirectory(ifs, entries, reason))
+				return false;
+		}
+
+		// every thread has its own stream and takes the next member, the handler is serialised
+		if (threadCount == 0)
+			threadCount = std::max(1u, std::thread::hardware_concurrency());
+		threadCount = std::min(threadCount, entries.size());
+		size_t nextEntry = 0;
+		bool bFailed = false;
+		std::exception_ptr handlerException;
+		std::mutex mutex;
+		const auto worker = [&]()
+		{
+			std::ifstream ifs(path, std::ios::binary);
+			while (true)
+			{
+				size_t idx;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					if (nextEntry == entries.size() || bFailed)
+						return;
+					idx = nextEntry++;
+				}
+				ArchiveMemberResult member;
+				if (ifs)
+				{
+					// a member that cannot be detected is reported unread, the other members are not affected
+					try
+					{
+						detail::DetectZipMember(ifs, entries[idx], member);
+					}
+					catch (const std::exception& e)
+					{
+						member.bContentRead = false;
+						member.detection.reason += std::string("detection failed: ") + e.what() + "\n";
+					}
+					catch (...)
+					{
+						member.bContentRead = false;
+						member.detection.reason += "detection failed\n";
+					}
+				}
+				else
+				{
+					member.name = entries[idx].name;
+					member.size = entries[idx].size;
+					member.bContentRead = false;
+					member.detection.reason += "cannot open " + path + "\n";
+				}
+				std::lock_guard<std::mutex> lock(mutex);
+				if (bFailed)
+					return;
+				try
+				{
+					onMember(member);
+				}
+				catch (...)
+				{
+					handlerException = std::current_exception();
+					bFailed = true;
+				}
+			}
+		};
+		std::vector<std::thread> threads;
+		for (size_t idx = 1; idx < threadCount; ++idx)
+			threads.emplace_back(worker);
+		worker();
+		for (std::thread& thread : threads)
+			thread.join();
+		if (handlerException)
+			std::rethrow_exception(handlerException);
+		return true;
+	}
+
+
+	TEXT_CHARSET_DETECTION_INLINE GzipIstream::GzipIstream(std::istream& source) : std::istream(nullptr), buffer(std::make_unique<detail::GzipStreambuf>(source))
+	{
+		rdbuf(buffer.get());
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE GzipIstream::~GzipIstream() = default;
+
+	TEXT_CHARSET_DETECTION_INLINE const std::string& GzipIstream::Error() const
+	{
+		return buffer->error;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE bool DetectGzipCharset(std::istream& is, DetectionResult& result, std::string& reason)
+	{
+		// the inflated chunks go to the detector as they come, memory stays bounded however much the content inflates to
+		GzipIstream gzis(is);
+		StreamingCharsetDetector detector;
+		unsigned char chunk[detail::ARCHIVE_READ_CHUNK_SIZE];
+		size_t chunkSize, taken;
+		do
+		{
+			gzis.read(reinterpret_cast<char*>(chunk), sizeof(chunk));
+			chunkSize = static_cast<size_t>(gzis.gcount());
+			taken = detector.Feed(chunk, chunkSize);
+		} while (!detector.Done() && chunkSize == sizeof(chunk));
+		if (!gzis.Error().empty())
+		{
+			reason += gzis.Error() + "\n";
+			return false;
+		}
+		// the content ended with a short read, or right after a sample that filled the last chunk (damage past the sample
+		// is not reported, as it was not needed)
+		const bool bContentEnded = taken == chunkSize && (chunkSize < sizeof(chunk) || (gzis.peek() == std::istream::traits_type::eof() && gzis.Error().empty()));
+		result = detector.Finish(bContentEnded);
+		return true;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE bool DetectTarGzMembersCharset(std::istream& is, const archive_member_handler_t& onMember, std::string& reason)
+	{
+		GzipIstream gzis(is);
+		const bool bIntact = DetectTarMembersCharset(gzis, onMember, reason);
+		if (!gzis.Error().empty())
+		{
+			// the tar reader only saw the stream end early, the cause is the compression layer
+			reason += gzis.Error() + "\n";
+			return false;
+		}
+		return bIntact;
+	}
+
+}
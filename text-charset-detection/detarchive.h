@@ -0,0 +1,63 @@
+#pragma once
+
+// charset detection of the members of archives, streaming: every member's content is detected as it flows by, nothing is
+// extracted to disk; header-only mode (TEXT_CHARSET_DETECTION_HEADER_ONLY) as in detcharset.h
+// deflated content is only read with zlib: define TEXT_CHARSET_DETECTION_HAVE_ZLIB and link zlib (CMake does both if it
+// finds zlib, see TEXT_CHARSET_DETECTION_WITH_ZLIB), such members are reported unread and gzip input fails otherwise
+
+#include "detcharset.h"
+
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <string>
+
+namespace text_charset_detection
+{
+
+	struct ArchiveMemberResult
+	{
+		std::string name;								// path inside the archive
+		uint64_t size = 0;								// content size
+		bool bContentRead = true;						// false: compression method or encryption not supported, damaged or undetectable member, detection.reason tells which
+		DetectionResult detection;						// DetectBufferCharset() of the first GetTuningProfile().sampleSize bytes of the content
+	};
+	typedef std::function<void(const ArchiveMemberResult&)> archive_member_handler_t;
+
+	// tar (ustar, pax extended headers, GNU long names) read front to back from the current position of is, so it works on
+	// pipes as well; onMember is called for every regular file, other member types are skipped; false on a damaged or
+	// truncated archive (details in reason), the members before the damage have been reported
+	bool DetectTarMembersCharset(std::istream& is, const archive_member_handler_t& onMember, std::string& reason);
+	// zip (zip64 too) through its central directory: only the directory and the first bytes of each member are read, with
+	// positioned reads of threadCount threads (0: hardware concurrency) working on different members; stored and deflated
+	// members are detected, directories skipped; onMember is called for one member at a time, from any of the threads, in
+	// completion order; false if the central directory cannot be read
+	bool DetectZipMembersCharset(const std::string& path, const archive_member_handler_t& onMember, std::string& reason, size_t threadCount = 0);
+
+	namespace detail { class GzipStreambuf; }
+	// decompressing source adapter: the gzip data of source (concatenated members too, trailing garbage ignored like gzip
+	// does) is inflated on demand, chunk by chunk, so a reader that stops early only costs the decompression it consumed;
+	// reads end at the end of the content or at damage, Error() tells them apart
+	class GzipIstream : public std::istream
+	{
+	public:
+		explicit GzipIstream(std::istream& source);
+		~GzipIstream();
+		const std::string& Error() const;				// empty unless the data is damaged or not gzip (or zlib is not built in)
+	private:
+		std::unique_ptr<detail::GzipStreambuf> buffer;
+	};
+	// DetectBufferCharset() of the first GetTuningProfile().sampleSize bytes of the decompressed content, streamed through a
+	// StreamingCharsetDetector: no temp file, memory bounded by the sample size (sample size 0 too), decompression stops at
+	// most a chunk (16 KiB) past the sample; result.sampleSize below the profile's sample size means the whole content was seen
+	// false (details in reason) if the data is damaged or not gzip
+	bool DetectGzipCharset(std::istream& is, DetectionResult& result, std::string& reason);
+	// DetectTarMembersCharset() of a gzip compressed tar (.tar.gz, .tgz), decompressed while streaming
+	bool DetectTarGzMembersCharset(std::istream& is, const archive_member_handler_t& onMember, std::string& reason);
+
+}
+
+#if defined(TEXT_CHARSET_DETECTION_HEADER_ONLY)
+#include "detarchive.cpp"
+#endif
@@ -3,6 +3,28 @@
 #include <bitset>
 #include <cassert>
 #include <stdexcept>
+#include <atomic>
+#include <cstdlib>
+#include <sstream>
+#include <chrono>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <bit>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define TEXT_CHARSET_DETECTION_HAVE_TSC 1
+#endif
 
 namespace text_charset_detection
 {
@@ -12,9 +34,171 @@ namespace text_charset_detection
 		constexpr size_t UTF8_TINY_MODE_SIZE_LIMIT = 5000;					// non-tiny mode means checking sample buffer for 0...N-4 bytes, omiting interleaved buffer-end checks, speeds up by around 10%, according to my measures
 		constexpr bool UTF8_SUBCLASSIFY_TOO_LONG_SEQUENCES = true;			// should it distinguish between different >4 byte (invalid) UTF-8 sequences by size (next checked position for valid UTF-8 char depends on this)
 		constexpr bool UTF8_DETAILED_ERROR_LIST = true;						// should it not stop early if evidence for non-UTF-8 found (true: detailed report for all UTF-8 errors found, much slower)
+		constexpr bool UTF8_SHADOW_VALIDATION = true;						// should SetShadowValidation() be able to turn on differential checking against the reference engine (false: compiled out)
+		constexpr bool DETECTION_METRICS = true;							// should detections be counted for GetDetectionMetrics() (false: compiled out, metrics stay 0)
+		constexpr size_t CHUNK_SPLIT_NEWLINE_SEARCH = 65536;				// how far SplitUTF8Chunks() looks for a newline after an even split point before settling for a char boundary
+		constexpr size_t CHUNK_SPLIT_POINTS_PER_THREAD = 16;				// SplitUTF8Chunks() searches in parallel only with at least this many split points per thread
+		constexpr bool MARKUP_DECLARATION_PRESCAN = true;					// should DetectCharset() let encoding declarations of markup decide when the first bytes agree (false: declarations are not looked for)
+		constexpr size_t MARKUP_PRESCAN_SIZE = 1024;						// how many bytes PrescanEncodingDeclaration() looks at, as the WHATWG prescan
+		constexpr size_t MEMORY_BUDGET_STREAM_BLOCK_SIZE = 65536;			// buffer of a sample validated block by block when it does not fit in the memory budget, the smallest budget allowed
+		constexpr size_t ASYNC_QUEUE_DEPTH_PER_THREAD = 4;					// default queue bound of AsyncDetector, in jobs per worker thread
+		constexpr size_t UTF8_INDEX_READ_BLOCK_SIZE = 1 << 20;				// BuildUTF8OffsetIndex() reads and validates the file in blocks of this size
+		constexpr char UTF8_INDEX_MAGIC[8] = { 'D', 'C', 'S', 'I', 'D', 'X', '0', '1' };	// first bytes of an index sidecar, the last two are the format version
+		constexpr size_t UTF8_INDEX_HEADER_SIZE = sizeof(UTF8_INDEX_MAGIC) + 6 * sizeof(uint64_t);
+
+		constexpr const char* TUNING_PROFILE_ENV_VAR = "DETCHARSET_TUNING_PROFILE";	// path of a tuning profile (see LoadTuningProfile()) applied on first use, overriding the two size constants above
 
 		typedef unsigned char utf8_checking_unit_t;
 
+		constexpr UTF8ErrorClass NO_UTF8_ERROR_CLASS = UTF8ErrorClass::Count;		// returned by the error classifiers when there is nothing to classify
+
+		// runtime values of UTF8_NO_BOM_TEXT_SAMPLE_SIZE and UTF8_TINY_MODE_SIZE_LIMIT, read once per detection
+		struct TuningState
+		{
+			std::atomic<size_t> sampleSize{ UTF8_NO_BOM_TEXT_SAMPLE_SIZE };
+			std::atomic<size_t> tinyModeSizeLimit{ UTF8_TINY_MODE_SIZE_LIMIT };
+		};
+
+		// first call applies the profile named by TUNING_PROFILE_ENV_VAR (if any, errors leave the defaults in place)
+		inline TuningState& Tuning()
+		{
+			static TuningState state;
+			static const bool bEnvProfileApplied = []()
+			{
+				const char* path = std::getenv(TUNING_PROFILE_ENV_VAR);
+				TuningProfile profile;
+				std::string reason;
+				if (path != nullptr && *path != '\0' && LoadTuningProfile(path, profile, reason))
+				{
+					state.sampleSize.store(profile.sampleSize, std::memory_order_relaxed);
+					state.tinyModeSizeLimit.store(profile.tinyModeSizeLimit < UTF8_MAX_CHAR_SIZE ? UTF8_MAX_CHAR_SIZE : profile.tinyModeSizeLimit, std::memory_order_relaxed);
+					return true;
+				}
+				return false;
+			}();
+			(void)bEnvProfileApplied;
+			return state;
+		}
+
+		// layout of the counters of one metrics slot
+		constexpr size_t METRIC_BYTES_VALIDATED = 0;
+		constexpr size_t METRIC_FILES_PROCESSED = 1;
+		constexpr size_t METRIC_VERDICT_FIRST = 2;
+		constexpr size_t METRIC_UTF8_ERROR_FIRST = METRIC_VERDICT_FIRST + static_cast<size_t>(DetectionVerdict::Count);
+		constexpr size_t METRIC_PHASE_NANOSECONDS_FIRST = METRIC_UTF8_ERROR_FIRST + static_cast<size_t>(UTF8ErrorClass::Count);
+		constexpr size_t METRIC_COUNT = METRIC_PHASE_NANOSECONDS_FIRST + static_cast<size_t>(DetectionPhase::Count);
+
+		// counters of one thread: written by the owner only (plain load + store, no locked instructions), read by anyone
+		struct MetricsSlot
+		{
+			std::atomic<uint64_t> counters[METRIC_COUNT] = {};
+		};
+
+		// slots are handed out to threads on their first detection and given back on thread exit for the next new thread,
+		// so the mutex is only taken at thread start/exit and on read; the counts of exited threads stay in their slots
+		struct MetricsRegistry
+		{
+			std::mutex mutex;
+			std::deque<MetricsSlot> slots;
+			std::vector<MetricsSlot*> freeSlots;
+		};
+
+		// never destroyed, threads may exit after static destruction has started
+		inline MetricsRegistry& Metrics()
+		{
+			static MetricsRegistry* const registry = new MetricsRegistry;
+			return *registry;
+		}
+
+		struct ThreadMetricsSlot
+		{
+			MetricsSlot* slot;
+
+			ThreadMetricsSlot()
+			{
+				MetricsRegistry& registry = Metrics();
+				std::lock_guard<std::mutex> lock(registry.mutex);
+				if (registry.freeSlots.empty())
+					slot = &registry.slots.emplace_back();
+				else
+				{
+					slot = registry.freeSlots.back();
+					registry.freeSlots.pop_back();
+				}
+			}
+			~ThreadMetricsSlot()
+			{
+				MetricsRegistry& registry = Metrics();
+				std::lock_guard<std::mutex> lock(registry.mutex);
+				registry.freeSlots.push_back(slot);
+			}
+		};
+
+		inline ThreadMetricsSlot& ThisThreadMetrics()
+		{
+			thread_local ThreadMetricsSlot threadSlot;
+			return threadSlot;
+		}
+
+		inline void AddMetric(size_t index, uint64_t value)
+		{
+			if (!DETECTION_METRICS)
+				return;
+			std::atomic<uint64_t>& counter = ThisThreadMetrics().slot->counters[index];
+			counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+		}
+
+		// errorCounts: per UTF8ErrorClass, as gathered by CheckStreamForUTF8NoBOMInternal() over one verdict
+		inline void CountUTF8Errors(const uint64_t* errorCounts)
+		{
+			for (size_t idx = 0; idx < static_cast<size_t>(UTF8ErrorClass::Count); ++idx)
+				if (errorCounts[idx] != 0)
+					AddMetric(METRIC_UTF8_ERROR_FIRST + idx, errorCounts[idx]);
+		}
+
+		inline void CountVerdict(DetectionVerdict verdict)
+		{
+			AddMetric(METRIC_VERDICT_FIRST + static_cast<size_t>(verdict), 1);
+		}
+
+		// adds the lifetime of the object to the time spent in phase
+		class PhaseMetricsTimer
+		{
+		public:
+			explicit PhaseMetricsTimer(DetectionPhase phase) : phase(phase), start(DETECTION_METRICS ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point()) {}
+			~PhaseMetricsTimer()
+			{
+				if (DETECTION_METRICS)
+					AddMetric(METRIC_PHASE_NANOSECONDS_FIRST + static_cast<size_t>(phase), std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+			}
+			PhaseMetricsTimer(const PhaseMetricsTimer&) = delete;
+			PhaseMetricsTimer& operator=(const PhaseMetricsTimer&) = delete;
+		private:
+			const DetectionPhase phase;
+			const std::chrono::steady_clock::time_point start;
+		};
+
+		// timestamps of PhaseTimings: time stamp counter where available (a few ns to read), steady_clock nanoseconds otherwise
+		// compiles to 0 without bEnabled, so untimed instantiations carry no timing code at all
+		template <bool bEnabled>
+		inline uint64_t PhaseTimestamp()
+		{
+			if constexpr (!bEnabled)
+				return 0;
+#if defined(TEXT_CHARSET_DETECTION_HAVE_TSC)
+			return __rdtsc();
+#else
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+		}
+
+		template <bool bEnabled>
+		inline void AddPhaseTicks(PhaseTimings& timings, DetectionPhase phase, uint64_t start)
+		{
+			if constexpr (bEnabled)
+				timings.ticks[static_cast<size_t>(phase)] += PhaseTimestamp<true>() - start;
+		}
+
 		inline std::string UcharToBinStr(utf8_checking_unit_t uchar)
 		{
 			return std::bitset<sizeof(utf8_checking_unit_t) * 8>(uchar).to_string();
@@ -277,10 +461,11 @@ namespace text_charset_detection
 		}
 
 		// Combines UTF8IsValidLeadingByte() and UTF8InvalidNrOfContinuationBytes() together to rule out primary UTF-8 error scenarios:
-		// invalid leading byte or invalid number of continuation bytes after leading byte
-		inline bool UTF8InvalidLeadingOrContinuation(const utf8_checking_unit_t *& ucharPtr, const utf8_checking_unit_t * charBufStartPtr, const utf8_checking_unit_t * charBufEndPtr, std::string& reason)
+		// invalid leading byte or invalid number of continuation bytes after leading byte; returns the class of the error found,
+		// NO_UTF8_ERROR_CLASS if none
+		inline UTF8ErrorClass UTF8InvalidLeadingOrContinuation(const utf8_checking_unit_t *& ucharPtr, const utf8_checking_unit_t * charBufStartPtr, const utf8_checking_unit_t * charBufEndPtr, std::string& reason, size_t positionBase = 0)
 		{
-			const std::string position = std::to_string(ucharPtr - charBufStartPtr);
+			const std::string position = std::to_string(positionBase + (ucharPtr - charBufStartPtr));
 
 			bool bLeadingByteValid = false;
 			size_t utf8sequenceLength = -1000;
@@ -301,7 +486,7 @@ namespace text_charset_detection
 				}
 				reason += "Invalid leading byte found at " + position + " (assumed length=" + std::to_string(utf8sequenceLength) + "): " + UcharSeqToBinStr(ucharPtr, bytesToRead) + suffix + "\n";
 				ucharPtr += bytesToRead;
-				return true;
+				return UTF8ErrorClass::InvalidLeadingByte;
 			}
 			bool bTruncated = false, bMisMatch = false;
 			const utf8_checking_unit_t* ucharPtrUpdate = nullptr;
@@ -310,15 +495,15 @@ namespace text_charset_detection
 			{
 				reason += "Invalid nr of continuation bytes after leading byte [possible truncation] at " + position + ": " + UcharSeqToBinStr(ucharPtr, charBufEndPtr - ucharPtr) + "<end-of-buffer>\n";
 				ucharPtr = ucharPtrUpdate;
-				return true;
+				return UTF8ErrorClass::TruncatedSequence;
 			}
 			if (bMisMatch)
 			{
 				reason += "Invalid nr of continuation bytes after leading byte [unexpected non-continuation byte] at " + position + ": " + UcharSeqToBinStr(ucharPtr, utf8sequenceLength) + "\n";
 				ucharPtr = ucharPtrUpdate;
-				return true;
+				return UTF8ErrorClass::MissingContinuation;
 			}
-			return false;
+			return NO_UTF8_ERROR_CLASS;
 		}
 
 		// charBufEndPtr: should point to the first invalid position after the buffer (in consistance with usual C++ for loops)
@@ -394,97 +579,122 @@ namespace text_charset_detection
 		}
 
 		// charBufEndPtr: should point to the first invalid position after the buffer (in consistance with usual C++ for loops)
-		inline void UTF8CheckErrors(const utf8_checking_unit_t *& ucharPtr, const utf8_checking_unit_t * charBufStartPtr, const utf8_checking_unit_t * charBufEndPtr, std::string& reason)
+		// positionBase: added to the positions in reason, for buffers that are a part of something larger
+		// returns the class of the error described, NO_UTF8_ERROR_CLASS if ucharPtr is at the end (counting is left to the caller)
+		inline UTF8ErrorClass UTF8CheckErrors(const utf8_checking_unit_t *& ucharPtr, const utf8_checking_unit_t * charBufStartPtr, const utf8_checking_unit_t * charBufEndPtr, std::string& reason, size_t positionBase = 0)
 		{
 			if (ucharPtr > charBufEndPtr - 1)
 			{
 				// No room for checking 1-byte --> no evidence, exit & leave bValidXXXX untouched
-				return;
+				return NO_UTF8_ERROR_CLASS;
 			}
 
-			const std::string position = std::to_string(ucharPtr - charBufStartPtr);
+			const std::string position = std::to_string(positionBase + (ucharPtr - charBufStartPtr));
 
-			if (UTF8InvalidLeadingOrContinuation(ucharPtr, charBufStartPtr, charBufEndPtr, reason))
+			const UTF8ErrorClass leadingOrContinuationError = UTF8InvalidLeadingOrContinuation(ucharPtr, charBufStartPtr, charBufEndPtr, reason, positionBase);
+			if (leadingOrContinuationError != NO_UTF8_ERROR_CLASS)
 			{
-				return;
+				return leadingOrContinuationError;
 			}
 
 			if (UTF8InvalidControlChar(ucharPtr))
 			{
 				reason += "Invalid 1 byte sequence: control char found at " + position + ": " + UcharSeqToBinStr(ucharPtr, 1) + "\n";
 				ucharPtr += 1;
-				return;
+				return UTF8ErrorClass::ControlChar;
 			}
 
 			if (ucharPtr > charBufEndPtr - 2)
 			{
 				reason += "Unknown UTF-8 error: checked all 1-byte possibilities, reached end of buffer at position " + position + ": " + UcharSeqToBinStr(ucharPtr, charBufEndPtr - ucharPtr) + "<end-of-buffer>\n";
 				ucharPtr = charBufEndPtr;
-				return;
+				return UTF8ErrorClass::Unknown;
 			}
 			if (UTF8Invalid2BytesOverlong(ucharPtr))
 			{
 				reason += "Invalid 2-byte overlong found at " + position + ": " + UcharSeqToBinStr(ucharPtr, 2) + "\n";
 				ucharPtr += 2;
-				return;
+				return UTF8ErrorClass::Overlong2Bytes;
 			}
 
 			if (ucharPtr > charBufEndPtr - 3)
 			{
 				reason += "Unknown UTF-8 error: checked all 1,2-byte possibilities, reached end of buffer at position " + position + ": " + UcharSeqToBinStr(ucharPtr, charBufEndPtr - ucharPtr) + "<end-of-buffer>\n";
 				ucharPtr = charBufEndPtr;
-				return;
+				return UTF8ErrorClass::Unknown;
 			}
 			if (UTF8Invalid3BytesOverlong(ucharPtr))
 			{
 				reason += "Invalid 3-byte overlong found at " + position + ": " + UcharSeqToBinStr(ucharPtr, 3) + "\n";
 				ucharPtr += 3;
-				return;
+				return UTF8ErrorClass::Overlong3Bytes;
 			}
 			if (UTF8Invalid3BytesSurrogateHalf(ucharPtr))
 			{
 				reason += "Invalid UTF-16 surrogate half found at " + position + ": " + UcharSeqToBinStr(ucharPtr, 3) + "\n";
 				ucharPtr += 3;
-				return;
+				return UTF8ErrorClass::SurrogateHalf;
 			}
 
 			if (ucharPtr > charBufEndPtr - 4)
 			{
 				reason += "Unknown UTF-8 error: checked all 1,2,3-byte possibilities, reached end of buffer at position " + position + ": " + UcharSeqToBinStr(ucharPtr, charBufEndPtr - ucharPtr) + "<end-of-buffer>\n";
 				ucharPtr = charBufEndPtr;
-				return;
+				return UTF8ErrorClass::Unknown;
 			}
 
 			if (UTF8Invalid4BytesOverlong(ucharPtr))
 			{
 				reason += "Invalid 4-byte overlong found at " + position + ": " + UcharSeqToBinStr(ucharPtr, 4) + "\n";
 				ucharPtr += 4;
-				return;
+				return UTF8ErrorClass::Overlong4Bytes;
 			}
 			unsigned int dummy;
 			if (UTF8InvalidCodePoint4BytesF4(ucharPtr, dummy))
 			{
 				reason += "Invalid code point specified by 4-byte encoding (F4) at " + position + ": " + UcharSeqToBinStr(ucharPtr, 4) + "\n";
 				ucharPtr += 4;
-				return;
+				return UTF8ErrorClass::InvalidCodePointF4;
 			}
 			if (UTF8InvalidCodePoint4BytesNonF4(ucharPtr))
 			{
 				reason += "Invalid code point specified by 4-byte encoding (non-F4) at " + position + ": " + UcharSeqToBinStr(ucharPtr, 4) + "\n";
 				ucharPtr += 4;
-				return;
+				return UTF8ErrorClass::InvalidCodePointNonF4;
 			}
 
 			size_t safeBufDumpSize = 16 < charBufEndPtr - ucharPtr ? 16 : charBufEndPtr - ucharPtr;
 			reason += "Unknown UTF-8 error: checked all known UTF-8 error classes, none of them matched at " + position + " (assumed length=1): " + UcharSeqToBinStr(ucharPtr, safeBufDumpSize) + "\n";
 			ucharPtr += 1;
+			return UTF8ErrorClass::Unknown;
 		}
 
-		template <bool bBufferEndCheck>
-		inline void CheckStreamForUTF8NoBOMInternal(utf8_checking_unit_t const * const bufferStart, utf8_checking_unit_t const * const stopPos, bool& bValidUTF8, bool& b7bitASCIIOnly, std::string& reason)
+		// UTF8CheckErrors() of the char at ucharPtr (found invalid by UTF8CharValidate()) as an UTF8ErrorScanner event, steps
+		// ucharPtr past it; positionBase: payload offset of charBufStartPtr; no metrics state is touched, the event carries the
+		// error class for a caller that counts
+		inline void DescribeUTF8Error(const utf8_checking_unit_t *& ucharPtr, const utf8_checking_unit_t * charBufStartPtr, const utf8_checking_unit_t * charBufEndPtr, size_t positionBase, UTF8ErrorEvent& event)
+		{
+			const utf8_checking_unit_t* const errorStart = ucharPtr;
+			event.description.clear();
+			const UTF8ErrorClass errorClass = UTF8CheckErrors(ucharPtr, charBufStartPtr, charBufEndPtr, event.description, positionBase);
+			event.errorClass = errorClass == NO_UTF8_ERROR_CLASS ? UTF8ErrorClass::Unknown : errorClass;
+			if (ucharPtr == errorStart)
+				++ucharPtr;
+			event.offset = positionBase + (errorStart - charBufStartPtr);
+			event.length = ucharPtr - errorStart;
+			if (!event.description.empty() && event.description.back() == '\n')
+				event.description.pop_back();
+		}
+
+		// firstErrorOffset: set to the position of the first char that is not valid UTF-8, UTF8_NO_ERROR_OFFSET if there is none
+		// errorFormattingTicks: PhaseTimestamp() ticks spent in UTF8CheckErrors() are added here if bTimeErrorFormatting
+		// errorCounts: if given, the errors found are counted here per UTF8ErrorClass (UTF8ErrorClass::Count entries)
+		template <bool bBufferEndCheck, bool bTimeErrorFormatting = false>
+		inline void CheckStreamForUTF8NoBOMInternal(utf8_checking_unit_t const * const bufferStart, utf8_checking_unit_t const * const stopPos, bool& bValidUTF8, bool& b7bitASCIIOnly, size_t& firstErrorOffset, std::string& reason, uint64_t* errorFormattingTicks = nullptr, uint64_t* errorCounts = nullptr)
 		{
 			bValidUTF8 = true;
 			b7bitASCIIOnly = true;
+			firstErrorOffset = UTF8_NO_ERROR_OFFSET;
 			utf8_checking_unit_t const * ucharPtr = bufferStart;
 
 			while (ucharPtr < stopPos)
@@ -493,34 +703,142 @@ namespace text_charset_detection
 				UTF8CharValidate<bBufferEndCheck>(ucharPtr, stopPos, bThisCharValid, bThisCharValid7bitASCII, reason);
 				bValidUTF8 &= bThisCharValid;
 				b7bitASCIIOnly &= bThisCharValid7bitASCII;
+				if (!bThisCharValid && firstErrorOffset == UTF8_NO_ERROR_OFFSET)
+					firstErrorOffset = ucharPtr - bufferStart;
 				if (!bValidUTF8 && !UTF8_DETAILED_ERROR_LIST)
 					break;
 				if (!bThisCharValid)
-					UTF8CheckErrors(ucharPtr, bufferStart, stopPos, reason);
+				{
+					const uint64_t start = PhaseTimestamp<bTimeErrorFormatting>();
+					const UTF8ErrorClass errorClass = UTF8CheckErrors(ucharPtr, bufferStart, stopPos, reason);
+					if constexpr (bTimeErrorFormatting)
+						*errorFormattingTicks += PhaseTimestamp<true>() - start;
+					if (errorCounts != nullptr && errorClass != NO_UTF8_ERROR_CLASS)
+						++errorCounts[static_cast<size_t>(errorClass)];
+				}
 			}
 		}
 
-		std::unique_ptr<utf8_checking_unit_t[]> ReadSampleToBuffer(std::ifstream& ifs, size_t& allocBufferSize, size_t& usableBufferSize)
+		// state of SetMemoryBudget(), limit is read without locking so that detections without a budget never touch the mutex
+		struct MemoryBudgetState
+		{
+			std::atomic<size_t> limit{ 0 };
+			MemoryBudgetMode mode = MemoryBudgetMode::Block;
+			std::mutex mutex;
+			std::condition_variable released;
+			size_t inUse = 0;
+			size_t peak = 0;
+			uint64_t waits = 0;
+			uint64_t streamedSamples = 0;
+		};
+
+		inline MemoryBudgetState& MemoryBudget()
+		{
+			static MemoryBudgetState state;
+			return state;
+		}
+
+		// memory taken from the budget, given back on destruction (to the budget it was taken from, even if that changed since)
+		class MemoryReservation
+		{
+		public:
+			MemoryReservation() = default;
+			~MemoryReservation() { Release(); }
+			MemoryReservation(const MemoryReservation&) = delete;
+			MemoryReservation& operator=(const MemoryReservation&) = delete;
+
+			// false (nothing reserved) if the caller should stream instead: only with bMayStream, when size is over the whole
+			// budget or over what is left of it in MemoryBudgetMode::Stream; waits for other reservations to go otherwise
+			bool Reserve(size_t size, bool bMayStream)
+			{
+				MemoryBudgetState& state = MemoryBudget();
+				if (state.limit.load(std::memory_order_relaxed) == 0)
+					return true;
+				std::unique_lock<std::mutex> lock(state.mutex);
+				const size_t limit = state.limit.load(std::memory_order_relaxed);
+				if (limit == 0)
+					return true;
+				if (bMayStream && (size > limit || (state.mode == MemoryBudgetMode::Stream && state.inUse + size > limit)))
+				{
+					++state.streamedSamples;
+					return false;
+				}
+				// with nothing reserved anything goes, so that a reservation over a lowered limit cannot wait forever
+				const auto bFits = [&state, size]()
+				{
+					const size_t currentLimit = state.limit.load(std::memory_order_relaxed);
+					return currentLimit == 0 || state.inUse == 0 || state.inUse + size <= currentLimit;
+				};
+				if (!bFits())
+				{
+					++state.waits;
+					state.released.wait(lock, bFits);
+					if (state.limit.load(std::memory_order_relaxed) == 0)
+						return true;
+				}
+				state.inUse += size;
+				state.peak = std::max(state.peak, state.inUse);
+				reserved = size;
+				return true;
+			}
+
+			// whether Reserve(size, false) would take size without waiting now; nothing is reserved, so it is only a hint
+			static bool HasRoom(size_t size)
+			{
+				MemoryBudgetState& state = MemoryBudget();
+				if (state.limit.load(std::memory_order_relaxed) == 0)
+					return true;
+				std::lock_guard<std::mutex> lock(state.mutex);
+				const size_t limit = state.limit.load(std::memory_order_relaxed);
+				return limit == 0 || state.inUse == 0 || state.inUse + size <= limit;
+			}
+
+			void Release()
+			{
+				if (reserved == 0)
+					return;
+				MemoryBudgetState& state = MemoryBudget();
+				{
+					std::lock_guard<std::mutex> lock(state.mutex);
+					state.inUse -= reserved;
+				}
+				reserved = 0;
+				state.released.notify_all();
+			}
+		private:
+			size_t reserved = 0;
+		};
+
+		// nullptr (allocBufferSize set, nothing more read) if the memory budget says the sample has to be streamed
+		// prefix: the first prefixSize bytes of the sample, already read from ifs (which is past them), they are not read again
+		inline std::unique_ptr<utf8_checking_unit_t[]> ReadSampleToBuffer(std::ifstream& ifs, size_t& allocBufferSize, size_t& usableBufferSize, MemoryReservation& reservation, const utf8_checking_unit_t* prefix = nullptr, size_t prefixSize = 0)
 		{
 			static_assert(sizeof(char) == 1, "This code assumes sizeof(char) == 1");
 			static_assert(sizeof(utf8_checking_unit_t) == sizeof(char), "This code assumes char and utf8_checking_unit_t have the same size");
 
 			// tell approximate stream size
-			const std::streampos savedStreamPos = ifs.tellg();
+			const std::streampos afterPrefixStreamPos = ifs.tellg();
+			const std::streampos savedStreamPos = afterPrefixStreamPos - static_cast<std::streamoff>(prefixSize);
 			ifs.seekg(0, std::ios::end);
-			const size_t bytesTillEndOfStream = ifs.tellg();
-			ifs.seekg(savedStreamPos);
+			const size_t bytesTillEndOfStream = static_cast<size_t>(ifs.tellg() - savedStreamPos);
+			ifs.seekg(afterPrefixStreamPos);
 
 			// determine buffer size to use
+			const size_t sampleSize = Tuning().sampleSize.load(std::memory_order_relaxed);
 			allocBufferSize =
-				UTF8_NO_BOM_TEXT_SAMPLE_SIZE == 0 || UTF8_NO_BOM_TEXT_SAMPLE_SIZE > bytesTillEndOfStream ?
+				sampleSize == 0 || sampleSize > bytesTillEndOfStream ?
 				bytesTillEndOfStream :
-				UTF8_NO_BOM_TEXT_SAMPLE_SIZE;
+				sampleSize;
+			if (!reservation.Reserve(allocBufferSize, true))
+				return nullptr;
 			std::unique_ptr<utf8_checking_unit_t[]> sampleTextBuffer = std::make_unique<utf8_checking_unit_t[]>(allocBufferSize);
 
 			// try read allocBufferSize bytes
-			ifs.read((char*)sampleTextBuffer.get(), allocBufferSize);
-			usableBufferSize = ifs.gcount();
+			const size_t fromPrefix = std::min(prefixSize, allocBufferSize);
+			if (fromPrefix > 0)
+				std::memcpy(sampleTextBuffer.get(), prefix, fromPrefix);
+			ifs.read((char*)sampleTextBuffer.get() + fromPrefix, allocBufferSize - fromPrefix);
+			usableBufferSize = fromPrefix + ifs.gcount();
 			if (usableBufferSize < allocBufferSize)
 			{
 				// If stream is in text mode, line ending conversions may have occurred during read(), possibly shrinking readble data.
@@ -532,128 +850,1601 @@ namespace text_charset_detection
 			ifs.seekg(savedStreamPos);
 			return std::move(sampleTextBuffer);
 		}
+
+		// state of SetShadowValidation(), the handler is only touched on mismatches, so a mutex is fine there
+		struct ShadowValidationState
+		{
+			std::atomic<uint32_t> sampleRatePPM{ 0 };					// shadowed calls per million
+			std::atomic<uint64_t> calls{ 0 };
+			std::atomic<uint64_t> shadowed{ 0 };
+			std::atomic<uint64_t> mismatches{ 0 };
+			std::atomic<uint64_t> shadowNanoseconds{ 0 };
+			std::mutex handlerMutex;
+			std::shared_ptr<const shadow_mismatch_handler_t> handler;
+		};
+
+		inline ShadowValidationState& ShadowValidation()
+		{
+			static ShadowValidationState state;
+			return state;
+		}
+
+		// decides whether this call is one of the shadowed ones: spreads sampleRatePPM calls evenly over every million calls
+		inline bool ShadowValidationSampled()
+		{
+			ShadowValidationState& state = ShadowValidation();
+			const uint64_t rate = state.sampleRatePPM.load(std::memory_order_relaxed);
+			if (rate == 0)
+				return false;
+			const uint64_t n = state.calls.fetch_add(1, std::memory_order_relaxed);
+			return (n + 1) * rate / 1000000 != n * rate / 1000000;
+		}
+
+		// reruns the buffer through the reference engine (tiny path, every byte bounds-checked) and compares it to the result
+		// of the engine that produced the verdict, restricted to the first coveredSize bytes the engine has looked at
+		inline void ShadowValidate(const char* engine, utf8_checking_unit_t const * const bufferStart, size_t size, size_t coveredSize, bool bEngineValidUTF8, size_t engineFirstErrorOffset)
+		{
+			ShadowValidationState& state = ShadowValidation();
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+			bool bReferenceValidUTF8 = true, bReference7bitASCIIOnly = true;
+			size_t referenceFirstErrorOffset = UTF8_NO_ERROR_OFFSET;
+			std::string referenceReason;
+			// no error counts: the reference engine's errors are not the caller's
+			CheckStreamForUTF8NoBOMInternal<true>(bufferStart, bufferStart + size, bReferenceValidUTF8, bReference7bitASCIIOnly, referenceFirstErrorOffset, referenceReason);
+
+			// errors the reference finds in the uncovered tail are expected, the engine never looked there
+			if (referenceFirstErrorOffset != UTF8_NO_ERROR_OFFSET && referenceFirstErrorOffset >= coveredSize)
+			{
+				referenceFirstErrorOffset = UTF8_NO_ERROR_OFFSET;
+				bReferenceValidUTF8 = true;
+			}
+
+			state.shadowed.fetch_add(1, std::memory_order_relaxed);
+			state.shadowNanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+
+			if (bReferenceValidUTF8 == bEngineValidUTF8 && referenceFirstErrorOffset == engineFirstErrorOffset)
+				return;
+
+			state.mismatches.fetch_add(1, std::memory_order_relaxed);
+			std::shared_ptr<const shadow_mismatch_handler_t> handler;
+			{
+				std::lock_guard<std::mutex> lock(state.handlerMutex);
+				handler = state.handler;
+			}
+			if (handler && *handler)
+			{
+				ShadowValidationMismatch mismatch;
+				mismatch.engine = engine;
+				mismatch.bEngineValidUTF8 = bEngineValidUTF8;
+				mismatch.engineFirstErrorOffset = engineFirstErrorOffset;
+				mismatch.bReferenceValidUTF8 = bReferenceValidUTF8;
+				mismatch.referenceFirstErrorOffset = referenceFirstErrorOffset;
+				mismatch.coveredSize = coveredSize;
+				mismatch.input.assign(bufferStart, bufferStart + size);
+				(*handler)(mismatch);
+			}
+		}
 		
 		constexpr int SIGNATURE_CHECK_RESULT_FAIL = 0;
 		constexpr int SIGNATURE_CHECK_RESULT_NOT_FOUND = 1;
 		constexpr int SIGNATURE_CHECK_RESULT_FOUND = 2;
-		template <size_t N>
-		int CheckStreamForSignature(std::ifstream& ifs, std::string& reason, const utf8_checking_unit_t(&signature)[N])
+		// first char at or after pos that is not UTF8CharASCII7(), end if there is none
+		// 8 bytes at a time: a word is looked at byte by byte only if it has a byte >= 0x7F or < 0x20 (TAB, CR, LF included)
+		inline const utf8_checking_unit_t* FindFirstNonASCII7(const utf8_checking_unit_t* pos, const utf8_checking_unit_t* const end)
 		{
-			static_assert(sizeof(char) == 1, "This code assumes sizeof(char) == 1");
-			static_assert(sizeof(utf8_checking_unit_t) == sizeof(char), "This code assumes char and utf8_checking_unit_t have the same size");
-			
-			if (ifs.fail())
+			constexpr uint64_t ONES = 0x0101010101010101ull;
+			constexpr uint64_t HIGH_BITS = 0x8080808080808080ull;
+			while (end - pos >= 8)
 			{
-				reason += "stream.fail()\n";
-				return SIGNATURE_CHECK_RESULT_FAIL;
+				uint64_t word;
+				std::memcpy(&word, pos, sizeof(word));
+				const uint64_t highBitSet = word & HIGH_BITS;
+				const uint64_t below0x20 = (word - ONES * 0x20) & ~word;
+				const uint64_t equal0x7F = ((word ^ (ONES * 0x7F)) - ONES) & ~(word ^ (ONES * 0x7F));
+				if ((highBitSet | ((below0x20 | equal0x7F) & HIGH_BITS)) != 0)
+				{
+					for (const utf8_checking_unit_t* const wordEnd = pos + 8; pos < wordEnd; ++pos)
+						if (!UTF8CharASCII7(pos))
+							return pos;
+				}
+				else
+					pos += 8;
 			}
-			if (ifs.eof())
+			while (pos < end && UTF8CharASCII7(pos))
+				++pos;
+			return pos;
+		}
+
+		// number of chars (non-continuation bytes) and of '\n' bytes in 8 bytes of text
+		inline void CountCharsAndNewlines(uint64_t word, unsigned& chars, unsigned& newlines)
+		{
+			constexpr uint64_t ONES = 0x0101010101010101ull;
+			constexpr uint64_t HIGH_BITS = 0x8080808080808080ull;
+			const uint64_t continuation = word & ~(word << 1) & HIGH_BITS;		// 10xxxxxx: bit 7 set, bit 6 (shifted up) clear
+			const uint64_t newlineBits = word ^ (ONES * '\n');
+			const uint64_t zeroBytes = ~(((newlineBits & ~HIGH_BITS) + ~HIGH_BITS) | newlineBits) & HIGH_BITS;
+			chars = 8 - std::popcount(continuation);
+			newlines = std::popcount(zeroBytes);
+		}
+
+		inline void AppendLittleEndian64(std::vector<unsigned char>& out, uint64_t value)
+		{
+			for (size_t idx = 0; idx < sizeof(value); ++idx)
+				out.push_back(static_cast<unsigned char>(value >> (8 * idx)));
+		}
+
+		inline uint64_t LoadLittleEndian64(const unsigned char* pos)
+		{
+			uint64_t value = 0;
+			for (size_t idx = 0; idx < sizeof(value); ++idx)
+				value |= static_cast<uint64_t>(pos[idx]) << (8 * idx);
+			return value;
+		}
+
+		// CheckBufferForUTF8NoBOM() with all verdict details, errorFormattingTicks as in CheckStreamForUTF8NoBOMInternal()
+		template <bool bTimeErrorFormatting = false>
+		void ValidateBufferUTF8NoBOM(const unsigned char* buffer, size_t size, bool& bValidUTF8, bool& b7bitASCIIOnly, size_t& firstErrorOffset, std::string& reason, uint64_t* errorFormattingTicks = nullptr)
+		{
+			static_assert(sizeof(utf8_checking_unit_t) == sizeof(unsigned char), "This code assumes unsigned char and utf8_checking_unit_t have the same size");
+
+			bValidUTF8 = true;
+			b7bitASCIIOnly = true;
+			firstErrorOffset = UTF8_NO_ERROR_OFFSET;
+			utf8_checking_unit_t const * const bufferStart = buffer;
+			AddMetric(METRIC_BYTES_VALIDATED, size);
+			PhaseMetricsTimer phaseTimer(DetectionPhase::Validation);
+			// errors are counted locally and go to the metrics with the verdict, the error path does not touch the thread's slot
+			uint64_t errorCounts[static_cast<size_t>(UTF8ErrorClass::Count)] = {};
+			uint64_t* const countedErrors = DETECTION_METRICS ? errorCounts : nullptr;
+
+
+			if (size >= Tuning().tinyModeSizeLimit.load(std::memory_order_relaxed)) [[likely]]
 			{
-				reason += "stream empty\n";
-				return SIGNATURE_CHECK_RESULT_FAIL;
+				// non-tiny mode, cut 4 bytes from the end, then go through text without pointer checking (this leaves the last 4 bytes out from checking, but faster)
+				const size_t coveredSize = size - UTF8_MAX_CHAR_SIZE;
+				CheckStreamForUTF8NoBOMInternal<false, bTimeErrorFormatting>(bufferStart, bufferStart + coveredSize, bValidUTF8, b7bitASCIIOnly, firstErrorOffset, reason, errorFormattingTicks, countedErrors);
+				if (UTF8_SHADOW_VALIDATION && ShadowValidationSampled())
+					ShadowValidate("scalar/non-tiny", bufferStart, size, coveredSize, bValidUTF8, firstErrorOffset);
+			}
+			else
+			{
+				// tiny mode is the reference engine itself, nothing to shadow
+				reason += "text is shorter than a predefined limit, checking entire buffer\n";
+				CheckStreamForUTF8NoBOMInternal<true, bTimeErrorFormatting>(bufferStart, bufferStart + size, bValidUTF8, b7bitASCIIOnly, firstErrorOffset, reason, errorFormattingTicks, countedErrors);
 			}
 
-			const std::streampos savedStreamPos = ifs.tellg();
+			if (b7bitASCIIOnly)
+				reason += "ASCII 7-bit text\n";
 
-			utf8_checking_unit_t readBuf[N];
+			if (bValidUTF8)
+				reason += "sample of input contains only valid UTF-8 characters\n";
 
-			ifs.read((char*)&readBuf[0], sizeof(readBuf));
+			CountVerdict(b7bitASCIIOnly ? DetectionVerdict::ASCII7 : bValidUTF8 ? DetectionVerdict::UTF8 : DetectionVerdict::NotUTF8);
+			if (DETECTION_METRICS && !bValidUTF8)
+				CountUTF8Errors(errorCounts);
+		}
 
-			if (ifs.gcount() < N)
+		// validation step of DetectCharset() and DetectBufferCharset(), size: sample size
+		template <bool bPhaseTimings>
+		void ValidateSampleForResult(const unsigned char* buffer, size_t size, DetectionResult& result)
+		{
+			const uint64_t start = PhaseTimestamp<bPhaseTimings>();
+			uint64_t errorFormattingTicks = 0;
+			bool b7bitASCIIOnly = true;
+			ValidateBufferUTF8NoBOM<bPhaseTimings>(buffer, size, result.bValidUTF8, b7bitASCIIOnly, result.firstErrorOffset, result.reason, &errorFormattingTicks);
+			AddPhaseTicks<bPhaseTimings>(result.timings, DetectionPhase::Validation, start + errorFormattingTicks);
+			if constexpr (bPhaseTimings)
+				result.timings.ticks[static_cast<size_t>(DetectionPhase::ErrorFormatting)] = errorFormattingTicks;
+
+			result.charset = b7bitASCIIOnly ? DetectedCharset::ASCII7 : result.bValidUTF8 ? DetectedCharset::UTF8 : DetectedCharset::Unknown;
+		}
+
+		// verdict of a sample validated block by block as it arrives (UTF8ErrorScanner carries chars split by block
+		// boundaries), the same verdict details and error descriptions as ValidateBufferUTF8NoBOM() gives a buffered one
+		// result is reset on construction and complete after Finish(); sampleSize counts the bytes fed
+		class StreamedSampleValidation
+		{
+		public:
+			explicit StreamedSampleValidation(DetectionResult& result) : result(result)
 			{
-				ifs.clear();
-				ifs.seekg(savedStreamPos);
-				return SIGNATURE_CHECK_RESULT_NOT_FOUND;
+				result.bValidUTF8 = true;
+				result.firstErrorOffset = UTF8_NO_ERROR_OFFSET;
+				result.sampleSize = 0;
 			}
 
-			for (size_t idx = 0; idx < sizeof(signature); ++idx)
+			// false once more input cannot change the verdict (at the first error, unless UTF8_DETAILED_ERROR_LIST)
+			bool Feed(const unsigned char* block, size_t size)
 			{
-				if (readBuf[idx] != signature[idx])
+				if (bStopped)
+					return false;
+				AddMetric(METRIC_BYTES_VALIDATED, size);
+				b7bitASCIIOnly = b7bitASCIIOnly && FindFirstNonASCII7(block, block + size) == block + size;
+				scanner.Feed(block, size);
+				TakeErrors(UTF8_NO_ERROR_OFFSET);
+				result.sampleSize += size;
+				return !bStopped;
+			}
+
+			// bInputEnded: the sample is all of the input, its last char is checked as its end; a char possibly cut off by the
+			// end of a sample that ends before the input is left out otherwise, as by the non-tiny engine
+			void Finish(bool bInputEnded)
+			{
+				if (!bStopped)
 				{
-					if (ifs.fail())
+					scanner.Finish();
+					TakeErrors(bInputEnded || result.sampleSize < UTF8_MAX_CHAR_SIZE ? UTF8_NO_ERROR_OFFSET : result.sampleSize - UTF8_MAX_CHAR_SIZE);
+				}
+				if (b7bitASCIIOnly)
+					result.reason += "ASCII 7-bit text\n";
+				if (result.bValidUTF8)
+					result.reason += "sample of input contains only valid UTF-8 characters\n";
+				CountVerdict(b7bitASCIIOnly ? DetectionVerdict::ASCII7 : result.bValidUTF8 ? DetectionVerdict::UTF8 : DetectionVerdict::NotUTF8);
+				if (DETECTION_METRICS && !result.bValidUTF8)
+					CountUTF8Errors(errorCounts);
+				result.charset = b7bitASCIIOnly ? DetectedCharset::ASCII7 : result.bValidUTF8 ? DetectedCharset::UTF8 : DetectedCharset::Unknown;
+			}
+
+		private:
+			// errors at or past uncheckedOffset are dropped
+			void TakeErrors(size_t uncheckedOffset)
+			{
+				while (!bStopped && scanner.NextError(event))
+				{
+					if (event.offset >= uncheckedOffset)
+						continue;
+					if (result.firstErrorOffset == UTF8_NO_ERROR_OFFSET)
+						result.firstErrorOffset = event.offset;
+					result.bValidUTF8 = false;
+					result.reason += event.description + "\n";
+					++errorCounts[static_cast<size_t>(event.errorClass)];
+					bStopped = !UTF8_DETAILED_ERROR_LIST;
+				}
+			}
+
+			DetectionResult& result;
+			UTF8ErrorScanner scanner;
+			UTF8ErrorEvent event;
+			bool b7bitASCIIOnly = true;
+			bool bStopped = false;
+			uint64_t errorCounts[static_cast<size_t>(UTF8ErrorClass::Count)] = {};
+		};
+
+		// read and validation steps of DetectCharset() for a sample ReadSampleToBuffer() refused to buffer: read block by
+		// block from the current position of ifs, which is restored
+		// prefix: as for ReadSampleToBuffer()
+		template <bool bPhaseTimings>
+		void StreamSampleForResult(std::ifstream& ifs, DetectionResult& result, const utf8_checking_unit_t* prefix = nullptr, size_t prefixSize = 0)
+		{
+			MemoryReservation blockReservation;
+			blockReservation.Reserve(MEMORY_BUDGET_STREAM_BLOCK_SIZE, false);
+			const std::unique_ptr<utf8_checking_unit_t[]> block = std::make_unique<utf8_checking_unit_t[]>(MEMORY_BUDGET_STREAM_BLOCK_SIZE);
+			const size_t sampleSize = Tuning().sampleSize.load(std::memory_order_relaxed);
+			const std::streampos savedStreamPos = ifs.tellg() - static_cast<std::streamoff>(prefixSize);
+			result.reason += "sample does not fit in the memory budget, validating it in blocks of " + std::to_string(MEMORY_BUDGET_STREAM_BLOCK_SIZE) + " bytes\n";
+			StreamedSampleValidation validation(result);
+			bool bEndOfFile = false;
+			bool bValidating = true;
+			while (bValidating && !bEndOfFile && (sampleSize == 0 || result.sampleSize < sampleSize))
+			{
+				const size_t wanted = sampleSize == 0 ? MEMORY_BUDGET_STREAM_BLOCK_SIZE : std::min(MEMORY_BUDGET_STREAM_BLOCK_SIZE, sampleSize - result.sampleSize);
+				uint64_t start = PhaseTimestamp<bPhaseTimings>();
+				size_t blockSize = std::min(prefixSize, wanted);
+				{
+					PhaseMetricsTimer phaseTimer(DetectionPhase::Read);
+					if (blockSize > 0)
 					{
-						ifs.clear();
+						std::memcpy(block.get(), prefix, blockSize);
+						prefix += blockSize;
+						prefixSize -= blockSize;
 					}
-					ifs.seekg(savedStreamPos);
-					return SIGNATURE_CHECK_RESULT_NOT_FOUND;
+					ifs.read(reinterpret_cast<char*>(block.get()) + blockSize, wanted - blockSize);
+					blockSize += static_cast<size_t>(ifs.gcount());
+					bEndOfFile = blockSize < wanted;
+					// a file that ends right at the end of the sample is whole as well
+					if (!bEndOfFile && sampleSize != 0 && result.sampleSize + blockSize == sampleSize)
+						bEndOfFile = ifs.peek() == std::ifstream::traits_type::eof();
+				}
+				AddPhaseTicks<bPhaseTimings>(result.timings, DetectionPhase::Read, start);
+
+				start = PhaseTimestamp<bPhaseTimings>();
+				{
+					PhaseMetricsTimer phaseTimer(DetectionPhase::Validation);
+					bValidating = validation.Feed(block.get(), blockSize);
+					if (bEndOfFile)
+						validation.Finish(true);
+				}
+				AddPhaseTicks<bPhaseTimings>(result.timings, DetectionPhase::Validation, start);
+			}
+			if (!bEndOfFile)
+			{
+				const uint64_t start = PhaseTimestamp<bPhaseTimings>();
+				{
+					PhaseMetricsTimer phaseTimer(DetectionPhase::Validation);
+					validation.Finish(false);
 				}
+				AddPhaseTicks<bPhaseTimings>(result.timings, DetectionPhase::Validation, start);
 			}
+			ifs.clear();
+			ifs.seekg(savedStreamPos);
+		}
 
-			// we consumed signature, so no rewind to savedStreamPos
-			return SIGNATURE_CHECK_RESULT_FOUND;
+		inline bool MarkupSpace(unsigned char c)
+		{
+			return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
 		}
 
-	} // namespace text_charset_detection::detail
-	
-	bool CheckStreamForUTF8NoBOM(std::ifstream& ifs, std::string& reason)
-	{
-		size_t allocBufferSize = -1;
-		size_t readCount = -1;
-		std::unique_ptr<detail::utf8_checking_unit_t[]> sampleTextBuffer = detail::ReadSampleToBuffer(ifs, allocBufferSize, readCount);
+		inline unsigned char ASCIILower(unsigned char c)
+		{
+			return c >= 'A' && c <= 'Z' ? static_cast<unsigned char>(c + ('a' - 'A')) : c;
+		}
 
-		bool bValidUTF8 = true;
-		bool b7bitASCIIOnly = true;
-		detail::utf8_checking_unit_t const * const bufferStart = sampleTextBuffer.get();
+		inline bool ASCIILetter(unsigned char c)
+		{
+			return (ASCIILower(c) >= 'a' && ASCIILower(c) <= 'z');
+		}
 
+		// ASCII case-insensitive match of a lowercase pattern at pos
+		inline bool MatchCaseless(const unsigned char* pos, const unsigned char* end, const char* lowercase)
+		{
+			for (; *lowercase != '\0'; ++pos, ++lowercase)
+				if (pos == end || ASCIILower(*pos) != static_cast<unsigned char>(*lowercase))
+					return false;
+			return true;
+		}
 
-		if (readCount >= detail::UTF8_TINY_MODE_SIZE_LIMIT) [[likely]]
+		// first occurrence of pattern in [pos, end), end if none
+		inline const unsigned char* FindBytes(const unsigned char* pos, const unsigned char* end, const char* pattern)
 		{
-			// non-tiny mode, cut 4 bytes from the end, then go through text without pointer checking (this leaves the last 4 bytes out from checking, but faster)
-			detail::CheckStreamForUTF8NoBOMInternal<false>(bufferStart, bufferStart + readCount - detail::UTF8_MAX_CHAR_SIZE, bValidUTF8, b7bitASCIIOnly, reason);
+			const size_t patternSize = std::strlen(pattern);
+			for (; static_cast<size_t>(end - pos) >= patternSize; ++pos)
+				if (std::memcmp(pos, pattern, patternSize) == 0)
+					return pos;
+			return end;
 		}
-		else
+
+		inline std::string EncodingLabel(const unsigned char* begin, const unsigned char* end)
 		{
-			reason += "text is shorter than a predefined limit, checking entire buffer\n";
-			detail::CheckStreamForUTF8NoBOMInternal<true>(bufferStart, bufferStart + readCount, bValidUTF8, b7bitASCIIOnly, reason);
+			while (begin < end && MarkupSpace(*begin))
+				++begin;
+			while (end > begin && MarkupSpace(end[-1]))
+				--end;
+			std::string label;
+			for (; begin < end; ++begin)
+				label += static_cast<char>(ASCIILower(*begin));
+			return label;
 		}
 
-		if (b7bitASCIIOnly)
-			reason += "ASCII 7-bit text\n";
+		// WHATWG "get an attribute" (names and values lowercased): false at the '>' of the tag, and at the end of the
+		// prescanned bytes (pos == end then, the tag is incomplete)
+		inline bool NextMarkupAttribute(const unsigned char*& pos, const unsigned char* end, std::string& name, std::string& value)
+		{
+			while (pos < end && (MarkupSpace(*pos) || *pos == '/'))
+				++pos;
+			if (pos == end || *pos == '>')
+				return false;
+			name.assign(1, static_cast<char>(ASCIILower(*pos++)));		// may be '=', as in the WHATWG algorithm
+			value.clear();
+			while (pos < end && !MarkupSpace(*pos) && *pos != '/' && *pos != '>' && *pos != '=')
+				name += static_cast<char>(ASCIILower(*pos++));
+			while (pos < end && MarkupSpace(*pos))
+				++pos;
+			if (pos == end || *pos != '=')
+				return true;
+			++pos;
+			while (pos < end && MarkupSpace(*pos))
+				++pos;
+			if (pos < end && (*pos == '"' || *pos == '\''))
+			{
+				const unsigned char quote = *pos++;
+				while (pos < end && *pos != quote)
+					value += static_cast<char>(ASCIILower(*pos++));
+				if (pos == end)
+					return false;
+				++pos;
+			}
+			else
+			{
+				while (pos < end && !MarkupSpace(*pos) && *pos != '>')
+					value += static_cast<char>(ASCIILower(*pos++));
+			}
+			return true;
+		}
 
-		if (bValidUTF8)
-			reason += "sample of input contains only valid UTF-8 characters\n";
+		// WHATWG "extracting a character encoding from a meta element": the charset= parameter of a Content-Type value
+		inline std::string CharsetOfContentType(const std::string& content)
+		{
+			const unsigned char* const contentStart = reinterpret_cast<const unsigned char*>(content.data());
+			const unsigned char* const contentEnd = contentStart + content.size();
+			for (const unsigned char* pos = FindBytes(contentStart, contentEnd, "charset"); pos < contentEnd; pos = FindBytes(pos, contentEnd, "charset"))
+			{
+				pos += 7;
+				while (pos < contentEnd && MarkupSpace(*pos))
+					++pos;
+				if (pos == contentEnd || *pos != '=')
+					continue;
+				++pos;
+				while (pos < contentEnd && MarkupSpace(*pos))
+					++pos;
+				if (pos < contentEnd && (*pos == '"' || *pos == '\''))
+				{
+					const unsigned char* const labelEnd = std::find(pos + 1, contentEnd, *pos);
+					return labelEnd == contentEnd ? std::string() : EncodingLabel(pos + 1, labelEnd);
+				}
+				const unsigned char* labelEnd = pos;
+				while (labelEnd < contentEnd && !MarkupSpace(*labelEnd) && *labelEnd != ';')
+					++labelEnd;
+				return EncodingLabel(pos, labelEnd);
+			}
+			return std::string();
+		}
 
-		if (b7bitASCIIOnly)
+		// labels of the WHATWG Encoding Standard
+		inline bool UTF8EncodingLabel(const std::string& label)
 		{
-			// it's technically UTF-8, but conversion is not necessary
+			for (const char* utf8Label : { "utf-8", "utf8", "unicode-1-1-utf-8", "unicode11utf8", "unicode20utf8", "x-unicode20utf8" })
+				if (label == utf8Label)
+					return true;
 			return false;
 		}
 
-		return bValidUTF8;
-	}
-
-	// prerequisite: stream has to be at 0 reading position
-	bool CheckStreamForUTF8BOM(std::ifstream& ifs, std::string& reason)
-	{
-		assert(static_cast<size_t>(ifs.tellg()) == 0);
-		// checks for UTF-8 representation of U+00FEFF (0xEF 0xBB 0xBF) at the beginning of the stream
-		constexpr detail::utf8_checking_unit_t UTF8BOM[] = { 0xEF, 0xBB, 0xBF };
-
-		const int checkResult = detail::CheckStreamForSignature(ifs, reason, UTF8BOM);
-		switch (checkResult)
+		inline bool UTF16EncodingLabel(const std::string& label)
 		{
-		case detail::SIGNATURE_CHECK_RESULT_FAIL:
-			return false;
-		case detail::SIGNATURE_CHECK_RESULT_NOT_FOUND:
-			reason += "No UTF-8 BOM found\n";
+			for (const char* utf16Label : { "utf-16", "utf-16le", "utf-16be", "unicode", "unicodefeff", "unicodefffe", "ucs-2", "csunicode", "iso-10646-ucs-2" })
+				if (label == utf16Label)
+					return true;
 			return false;
-		case detail::SIGNATURE_CHECK_RESULT_FOUND:
-			reason += "UTF-8 BOM found\n";
-			return true;
-		default:
-			throw std::logic_error("text_charset_detection::detail::SIGNATURE_CHECK_RESULT_xxxx out of bounds (a)");
 		}
-	}
 
-	// prerequisite: stream has to be at 0 reading position
-	bool CheckStreamForUTF16BOM(std::ifstream& ifs, std::string& reason, bool& bLittleEndian)
-	{
-		assert(static_cast<size_t>(ifs.tellg()) == 0);
-		// checks for UTF-8 representation of U+00FEFF (0xEF 0xBB 0xBF) at the beginning of the stream
-		constexpr detail::utf8_checking_unit_t UTF16LE_BOM[] = { 0xFF, 0xFE };
-		constexpr detail::utf8_checking_unit_t UTF16BE_BOM[] = { 0xFE, 0xFF };
+		// BOM probe step of DetectBufferCharset(), true if a BOM decided
+		template <bool bPhaseTimings>
+		bool DecideByBOM(const unsigned char* buffer, size_t size, DetectionResult& result)
+		{
+			constexpr unsigned char UTF8BOM[] = { 0xEF, 0xBB, 0xBF };
+			constexpr unsigned char UTF16LE_BOM[] = { 0xFF, 0xFE };
+			constexpr unsigned char UTF16BE_BOM[] = { 0xFE, 0xFF };
 
-		const int checkResultLE = detail::CheckStreamForSignature(ifs, reason, UTF16LE_BOM);
+			const uint64_t start = PhaseTimestamp<bPhaseTimings>();
+			{
+				PhaseMetricsTimer phaseTimer(DetectionPhase::BOMProbe);
+				if (size >= sizeof(UTF8BOM) && std::memcmp(buffer, UTF8BOM, sizeof(UTF8BOM)) == 0)
+				{
+					result.reason += "UTF-8 BOM found\n";
+					result.charset = DetectedCharset::UTF8BOM;
+				}
+				else if (size >= sizeof(UTF16LE_BOM) && std::memcmp(buffer, UTF16LE_BOM, sizeof(UTF16LE_BOM)) == 0)
+				{
+					result.reason += "UTF-16 LE BOM found\n";
+					result.charset = DetectedCharset::UTF16LE;
+				}
+				else if (size >= sizeof(UTF16BE_BOM) && std::memcmp(buffer, UTF16BE_BOM, sizeof(UTF16BE_BOM)) == 0)
+				{
+					result.reason += "UTF-16 BE BOM found\n";
+					result.charset = DetectedCharset::UTF16BE;
+				}
+				else
+					result.reason += "No UTF-8 BOM found\nNo UTF-16 BOM found\n";
+			}
+			AddPhaseTicks<bPhaseTimings>(result.timings, DetectionPhase::BOMProbe, start);
+			return result.charset != DetectedCharset::Unknown;
+		}
+
+		// declaration step of DetectCharset() and DetectBufferCharset(): prefix is the start of the input (all of it if
+		// bWholeInput), true if a declaration decided (result filled in like ValidateSampleForResult() does, over the prefix)
+		// a UTF-16 label cannot be right about ASCII-compatible bytes, WHATWG reads it as UTF-8, here it just decides nothing
+		template <bool bPhaseTimings>
+		bool DecideByEncodingDeclaration(const unsigned char* prefix, size_t size, bool bWholeInput, DetectionResult& result)
+		{
+			if constexpr (!MARKUP_DECLARATION_PRESCAN)
+				return false;
+			result.declaration = PrescanEncodingDeclaration(prefix, size);
+			if (result.declaration.source == EncodingDeclarationSource::None)
+				return false;
+
+			// the last char of a partial prefix may be cut off, only whole chars are checked
+			const size_t checkedSize = bWholeInput || size == 0 || prefix[size - 1] < 0x80 ? size : UTF8TruncationSize(prefix, size, size - 1);
+			const bool bPrefixValid = ValidUTF8PrefixSize(prefix, checkedSize) == checkedSize;
+			const bool bUTF8Label = UTF8EncodingLabel(result.declaration.label);
+			const std::string description = "encoding " + result.declaration.label + " declared by " + EncodingDeclarationSourceName(result.declaration.source)
+				+ " at offset " + std::to_string(result.declaration.offset);
+			if ((bUTF8Label && bPrefixValid) || (!bUTF8Label && !UTF16EncodingLabel(result.declaration.label) && !bPrefixValid))
+			{
+				result.reason += description + ", consistent with the first " + std::to_string(checkedSize) + " bytes, rest of the sample not validated\n";
+				result.sampleSize = checkedSize;
+				ValidateSampleForResult<bPhaseTimings>(prefix, checkedSize, result);
+				if (bUTF8Label)
+					result.charset = DetectedCharset::UTF8;		// plain ASCII so far, but declared UTF-8
+				return true;
+			}
+			result.reason += description + ", not confirmed by the first " + std::to_string(checkedSize) + " bytes, validating the sample\n";
+			return false;
+		}
+
+		template <size_t N>
+		int CheckStreamForSignature(std::ifstream& ifs, std::string& reason, const utf8_checking_unit_t(&signature)[N])
+		{
+			static_assert(sizeof(char) == 1, "This code assumes sizeof(char) == 1");
+			static_assert(sizeof(utf8_checking_unit_t) == sizeof(char), "This code assumes char and utf8_checking_unit_t have the same size");
+			
+			if (ifs.fail())
+			{
+				reason += "stream.fail()\n";
+				return SIGNATURE_CHECK_RESULT_FAIL;
+			}
+			if (ifs.eof())
+			{
+				reason += "stream empty\n";
+				return SIGNATURE_CHECK_RESULT_FAIL;
+			}
+
+			const std::streampos savedStreamPos = ifs.tellg();
+
+			utf8_checking_unit_t readBuf[N];
+
+			ifs.read((char*)&readBuf[0], sizeof(readBuf));
+
+			if (ifs.gcount() < N)
+			{
+				ifs.clear();
+				ifs.seekg(savedStreamPos);
+				return SIGNATURE_CHECK_RESULT_NOT_FOUND;
+			}
+
+			for (size_t idx = 0; idx < sizeof(signature); ++idx)
+			{
+				if (readBuf[idx] != signature[idx])
+				{
+					if (ifs.fail())
+					{
+						ifs.clear();
+					}
+					ifs.seekg(savedStreamPos);
+					return SIGNATURE_CHECK_RESULT_NOT_FOUND;
+				}
+			}
+
+			// we consumed signature, so no rewind to savedStreamPos
+			return SIGNATURE_CHECK_RESULT_FOUND;
+		}
+
+		struct StreamingDetectorState
+		{
+			size_t sampleSize = 0;										// of the profile when the detector was made, 0: all of the input
+			size_t bufferLimit = 0;										// the sample is buffered up to this size, validated as it streams in past it
+			MemoryReservation reservation;
+			std::vector<unsigned char> buffer;
+			std::unique_ptr<StreamedSampleValidation> validation;		// set once the sample outgrew the buffer
+			DetectionResult result;
+			size_t fed = 0;
+			bool bDecided = false;										// by a BOM or a declaration at the start of the buffer
+			bool bDone = false;
+		};
+
+		struct AsyncDetectorState
+		{
+			std::mutex mutex;
+			std::condition_variable jobQueued;
+			std::condition_variable jobTaken;
+			std::deque<std::function<void()>> jobs;
+			size_t maxQueueDepth = 0;
+			bool bStopping = false;
+			std::vector<std::thread> workers;
+
+			void Work()
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				for (;;)
+				{
+					jobQueued.wait(lock, [this] { return bStopping || !jobs.empty(); });
+					if (jobs.empty())
+						return;											// stopping, and everything queued is done
+					std::function<void()> job = std::move(jobs.front());
+					jobs.pop_front();
+					lock.unlock();
+					jobTaken.notify_one();
+					job();
+					lock.lock();
+				}
+			}
+
+			// false if the queue is full and !bWait
+			bool Enqueue(std::function<void()>&& job, bool bWait)
+			{
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					if (bWait)
+						jobTaken.wait(lock, [this] { return jobs.size() < maxQueueDepth; });
+					else if (jobs.size() >= maxQueueDepth)
+						return false;
+					jobs.push_back(std::move(job));
+				}
+				jobQueued.notify_one();
+				return true;
+			}
+		};
+
+		// a job of AsyncDetector: detection, then the handler (the future's promise is behind a handler too)
+		template <typename detect_t>
+		std::function<void()> AsyncDetectionJob(detect_t&& detect, AsyncDetector::detection_handler_t&& onDone)
+		{
+			return [detect = std::move(detect), onDone = std::move(onDone)]() mutable
+			{
+				DetectionResult result;
+				bool bDetected;
+				try
+				{
+					bDetected = detect(result);
+				}
+				catch (const std::exception& e)
+				{
+					result = DetectionResult();
+					result.reason = std::string("detection failed: ") + e.what() + "\n";
+					bDetected = false;
+				}
+				catch (...)
+				{
+					// nothing may escape a worker thread, it would terminate the process
+					result = DetectionResult();
+					result.reason = "detection failed: unknown exception\n";
+					bDetected = false;
+				}
+				onDone(bDetected, result);
+			};
+		}
+
+		inline AsyncDetector::detection_handler_t AsyncPromiseHandler(std::shared_ptr<std::promise<DetectionResult>> promise)
+		{
+			return [promise](bool bDetected, const DetectionResult& result)
+			{
+				if (bDetected)
+					promise->set_value(result);
+				else
+					promise->set_exception(std::make_exception_ptr(std::runtime_error(result.reason)));
+			};
+		}
+
+		inline auto AsyncPathDetection(const std::string& path)
+		{
+			return [path](DetectionResult& result)
+			{
+				std::ifstream ifs(path, std::ios::binary);
+				if (!ifs.is_open())
+				{
+					result.reason = "cannot open " + path + "\n";
+					return false;
+				}
+				result = DetectCharset(ifs);
+				return true;
+			};
+		}
+
+		// data is reserved once a worker runs the job, not while it is queued: a worker waiting for memory held by queued
+		// jobs, which only the workers can run, would wait forever; a buffer already in memory cannot be streamed, it waits
+		// for the budget in either mode
+		inline auto AsyncBufferDetection(std::vector<unsigned char>&& data)
+		{
+			return [data = std::move(data)](DetectionResult& result)
+			{
+				MemoryReservation reservation;
+				reservation.Reserve(data.size(), false);
+				result = DetectBufferCharset(data.data(), data.size());
+				return true;
+			};
+		}
+
+	} // namespace text_charset_detection::detail
+	
+	TEXT_CHARSET_DETECTION_INLINE bool CheckBufferForUTF8NoBOM(const unsigned char* buffer, size_t size, std::string& reason)
+	{
+		bool bValidUTF8, b7bitASCIIOnly;
+		size_t firstErrorOffset;
+		detail::ValidateBufferUTF8NoBOM(buffer, size, bValidUTF8, b7bitASCIIOnly, firstErrorOffset, reason);
+
+		// 7-bit ASCII is technically UTF-8, but conversion is not necessary
+		return bValidUTF8 && !b7bitASCIIOnly;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE size_t ValidUTF8PrefixSize(const unsigned char* buffer, size_t size)
+	{
+		const detail::utf8_checking_unit_t* ucharPtr = buffer;
+		const detail::utf8_checking_unit_t* const bufferEnd = buffer + size;
+		std::string unusedReason;		// only written on the invalid char, where we stop
+		for (;;)
+		{
+			// 7-bit ASCII runs word by word, everything else char by char
+			ucharPtr = detail::FindFirstNonASCII7(ucharPtr, bufferEnd);
+			if (ucharPtr == bufferEnd)
+				return size;
+			const detail::utf8_checking_unit_t* const charStart = ucharPtr;
+			bool bThisCharValid, bThisCharValid7bitASCII;
+			detail::UTF8CharValidate<true>(ucharPtr, bufferEnd, bThisCharValid, bThisCharValid7bitASCII, unusedReason);
+			if (!bThisCharValid)
+				return charStart - buffer;
+		}
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE bool IsValidUTF8(const unsigned char* buffer, size_t size)
+	{
+		return ValidUTF8PrefixSize(buffer, size) == size;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE size_t UTF8TruncationSize(const unsigned char* buffer, size_t size, size_t maxSize)
+	{
+		if (maxSize >= size)
+			return size;
+		// buffer[maxSize] is the first byte cut off, step back over the continuation bytes of the char it belongs to
+		size_t truncationSize = maxSize;
+		while (truncationSize > 0 && maxSize - truncationSize < detail::UTF8_MAX_CHAR_SIZE - 1 && detail::UTF8IsContinuationByte(buffer + truncationSize))
+			--truncationSize;
+		return truncationSize;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE bool UTF8StreamValidator::Feed(const unsigned char* segment, size_t size)
+	{
+		static_assert(MAX_CARRY_SIZE == detail::UTF8_MAX_CHAR_SIZE - 1, "a carried char has to be completable by the next UTF8_MAX_CHAR_SIZE bytes");
+		if (firstErrorOffset != UTF8_NO_ERROR_OFFSET)
+			return false;
+
+		const detail::utf8_checking_unit_t* ucharPtr = segment;
+		const detail::utf8_checking_unit_t* const segmentEnd = segment + size;
+		const size_t segmentOffset = bytesFed;
+		bytesFed += size;
+
+		// chars starting in the carry: validated on the carry followed by the first bytes of this segment
+		if (carrySize > 0)
+		{
+			detail::utf8_checking_unit_t joined[MAX_CARRY_SIZE + detail::UTF8_MAX_CHAR_SIZE];
+			const size_t taken = size < detail::UTF8_MAX_CHAR_SIZE ? size : detail::UTF8_MAX_CHAR_SIZE;
+			std::memcpy(joined, carry, carrySize);
+			std::memcpy(joined + carrySize, segment, taken);
+			const detail::utf8_checking_unit_t* joinedPtr = joined;
+			const detail::utf8_checking_unit_t* const carryEnd = joined + carrySize;
+			const detail::utf8_checking_unit_t* const joinedEnd = carryEnd + taken;
+			while (joinedPtr < carryEnd && joinedEnd - joinedPtr >= static_cast<ptrdiff_t>(detail::UTF8_MAX_CHAR_SIZE))
+			{
+				bool bThisCharValid = false, bThisCharValid7bitASCII = false;
+				std::string unusedReason;
+				const detail::utf8_checking_unit_t* const charStart = joinedPtr;
+				detail::UTF8CharValidate<false>(joinedPtr, joinedEnd, bThisCharValid, bThisCharValid7bitASCII, unusedReason);
+				if (!bThisCharValid)
+				{
+					firstErrorOffset = segmentOffset - carrySize + (charStart - joined);
+					return false;
+				}
+			}
+			if (joinedPtr < carryEnd)
+			{
+				// still not enough bytes to decide, this whole segment went into the carry
+				carrySize = joinedEnd - joinedPtr;
+				std::memcpy(carry, joinedPtr, carrySize);
+				return true;
+			}
+			ucharPtr += joinedPtr - carryEnd;
+			carrySize = 0;
+		}
+
+		// bulk of the segment: a whole char fits in the remaining bytes, no end checks needed
+		while (segmentEnd - ucharPtr >= static_cast<ptrdiff_t>(detail::UTF8_MAX_CHAR_SIZE))
+		{
+			bool bThisCharValid = false, bThisCharValid7bitASCII = false;
+			std::string unusedReason;
+			const detail::utf8_checking_unit_t* const charStart = ucharPtr;
+			detail::UTF8CharValidate<false>(ucharPtr, segmentEnd, bThisCharValid, bThisCharValid7bitASCII, unusedReason);
+			if (!bThisCharValid)
+			{
+				firstErrorOffset = segmentOffset + (charStart - segment);
+				return false;
+			}
+		}
+		// the last chars may complete in the next segment
+		if (ucharPtr < segmentEnd)
+		{
+			carrySize = segmentEnd - ucharPtr;
+			std::memcpy(carry, ucharPtr, carrySize);
+		}
+		return true;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE bool UTF8StreamValidator::Finish()
+	{
+		if (firstErrorOffset != UTF8_NO_ERROR_OFFSET)
+			return false;
+		const detail::utf8_checking_unit_t* ucharPtr = carry;
+		const detail::utf8_checking_unit_t* const carryEnd = carry + carrySize;
+		while (ucharPtr < carryEnd)
+		{
+			bool bThisCharValid = false, bThisCharValid7bitASCII = false;
+			std::string unusedReason;
+			const detail::utf8_checking_unit_t* const charStart = ucharPtr;
+			detail::UTF8CharValidate<true>(ucharPtr, carryEnd, bThisCharValid, bThisCharValid7bitASCII, unusedReason);
+			if (!bThisCharValid)
+			{
+				firstErrorOffset = bytesFed - carrySize + (charStart - carry);
+				return false;
+			}
+		}
+		carrySize = 0;
+		return true;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE size_t UTF8StreamValidator::FirstErrorOffset() const
+	{
+		return firstErrorOffset;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE size_t UTF8StreamValidator::BytesFed() const
+	{
+		return bytesFed;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE void UTF8StreamValidator::Reset()
+	{
+		carrySize = 0;
+		bytesFed = 0;
+		firstErrorOffset = UTF8_NO_ERROR_OFFSET;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE bool IsValidUTF8(std::span<const std::span<const unsigned char>> segments, size_t* firstErrorOffset)
+	{
+		UTF8StreamValidator validator;
+		bool bValid = true;
+		for (const std::span<const unsigned char>& segment : segments)
+			if (!(bValid = validator.Feed(segment.data(), segment.size())))
+				break;
+		if (bValid)
+			bValid = validator.Finish();
+		if (firstErrorOffset != nullptr)
+			*firstErrorOffset = validator.FirstErrorOffset();
+		return bValid;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE void UTF8ErrorScanner::Feed(const unsigned char* chunk, size_t size)
+	{
+		static_assert(LOOKAHEAD_SIZE >= 6, "UTF8CheckErrors() looks at up to 6 bytes of an invalid leading byte's sequence");
+		if (chunkPos != chunkEnd || carryErrorsReported < carryErrors.size())
+			throw std::logic_error("text_charset_detection::UTF8ErrorScanner::Feed(): errors of the previous chunk not taken yet, NextError() has not returned false");
+		carryErrors.clear();
+		carryErrorsReported = 0;
+		const size_t chunkOffset = bytesFed;
+		bytesFed += size;
+		chunkStart = chunk;
+		chunkPos = chunk;
+		chunkEnd = chunk + size;
+		if (carrySize == 0)
+			return;
+
+		// chars starting in the carry: scanned on the carry followed by the first bytes of this chunk
+		detail::utf8_checking_unit_t joined[2 * LOOKAHEAD_SIZE];
+		const size_t taken = std::min(size, LOOKAHEAD_SIZE);
+		std::memcpy(joined, carry, carrySize);
+		std::memcpy(joined + carrySize, chunk, taken);
+		const size_t joinedOffset = chunkOffset - carrySize;
+		const detail::utf8_checking_unit_t* joinedPtr = joined;
+		const detail::utf8_checking_unit_t* const carryEnd = joined + carrySize;
+		const detail::utf8_checking_unit_t* const joinedEnd = carryEnd + taken;
+		while (joinedPtr < carryEnd && joinedEnd - joinedPtr >= static_cast<ptrdiff_t>(LOOKAHEAD_SIZE))
+		{
+			bool bThisCharValid = false, bThisCharValid7bitASCII = false;
+			std::string unusedReason;
+			const detail::utf8_checking_unit_t* const charStart = joinedPtr;
+			detail::UTF8CharValidate<false>(joinedPtr, joinedEnd, bThisCharValid, bThisCharValid7bitASCII, unusedReason);
+			if (!bThisCharValid)
+			{
+				joinedPtr = charStart;
+				carryErrors.emplace_back();
+				detail::DescribeUTF8Error(joinedPtr, joined, joinedEnd, joinedOffset, carryErrors.back());
+			}
+		}
+		if (joinedPtr < carryEnd)
+		{
+			// still not enough bytes to go on, this whole chunk went into the carry
+			carrySize = joinedEnd - joinedPtr;
+			std::memcpy(carry, joinedPtr, carrySize);
+			chunkPos = chunkEnd;
+			return;
+		}
+		chunkPos = chunk + (joinedPtr - carryEnd);
+		carrySize = 0;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE void UTF8ErrorScanner::Finish()
+	{
+		if (chunkPos != chunkEnd || carryErrorsReported < carryErrors.size())
+			throw std::logic_error("text_charset_detection::UTF8ErrorScanner::Finish(): errors of the last chunk not taken yet, NextError() has not returned false");
+		carryErrors.clear();
+		carryErrorsReported = 0;
+		const detail::utf8_checking_unit_t* ucharPtr = carry;
+		const detail::utf8_checking_unit_t* const carryEnd = carry + carrySize;
+		while (ucharPtr < carryEnd)
+		{
+			bool bThisCharValid = false, bThisCharValid7bitASCII = false;
+			std::string unusedReason;
+			const detail::utf8_checking_unit_t* const charStart = ucharPtr;
+			detail::UTF8CharValidate<true>(ucharPtr, carryEnd, bThisCharValid, bThisCharValid7bitASCII, unusedReason);
+			if (!bThisCharValid)
+			{
+				ucharPtr = charStart;
+				carryErrors.emplace_back();
+				detail::DescribeUTF8Error(ucharPtr, carry, carryEnd, bytesFed - carrySize, carryErrors.back());
+			}
+		}
+		carrySize = 0;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE bool UTF8ErrorScanner::NextError(UTF8ErrorEvent& event)
+	{
+		if (carryErrorsReported < carryErrors.size())
+		{
+			event = std::move(carryErrors[carryErrorsReported++]);
+			return true;
+		}
+
+		// bulk of the chunk: a char is only looked at with LOOKAHEAD_SIZE bytes after its start, the rest is carried
+		for (;;)
+		{
+			chunkPos = detail::FindFirstNonASCII7(chunkPos, chunkEnd);
+			if (chunkEnd - chunkPos < static_cast<ptrdiff_t>(LOOKAHEAD_SIZE))
+				break;
+			bool bThisCharValid = false, bThisCharValid7bitASCII = false;
+			std::string unusedReason;
+			const detail::utf8_checking_unit_t* const charStart = chunkPos;
+			detail::UTF8CharValidate<false>(chunkPos, chunkEnd, bThisCharValid, bThisCharValid7bitASCII, unusedReason);
+			if (!bThisCharValid)
+			{
+				chunkPos = charStart;
+				detail::DescribeUTF8Error(chunkPos, chunkStart, chunkEnd, bytesFed - (chunkEnd - chunkStart), event);
+				return true;
+			}
+		}
+		if (chunkPos < chunkEnd)
+		{
+			carrySize = chunkEnd - chunkPos;
+			std::memcpy(carry, chunkPos, carrySize);
+			chunkPos = chunkEnd;
+		}
+		return false;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE size_t UTF8ErrorScanner::BytesFed() const
+	{
+		return bytesFed;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE bool BuildUTF8OffsetIndex(std::ifstream& ifs, uint64_t stride, UTF8OffsetIndex& index, std::string& reason)
+	{
+		if (stride == 0)
+			throw std::invalid_argument("text_charset_detection::BuildUTF8OffsetIndex(): stride is 0");
+
+		UTF8OffsetIndex built;
+		built.stride = stride;
+		built.charOffsets.push_back(0);
+		built.lineOffsets.push_back(0);
+		uint64_t charCount = 0, newlineCount = 0;
+		uint64_t nextCharCheckpoint = stride;			// char number of the next charOffsets entry
+		uint64_t nextLineCheckpoint = stride;			// newline count at which the next lineOffsets entry starts
+		UTF8StreamValidator validator;
+		std::vector<unsigned char> block(detail::UTF8_INDEX_READ_BLOCK_SIZE);
+		while (ifs)
+		{
+			ifs.read(reinterpret_cast<char*>(block.data()), static_cast<std::streamsize>(block.size()));
+			const size_t readCount = static_cast<size_t>(ifs.gcount());
+			if (readCount == 0)
+				break;
+			if (!validator.Feed(block.data(), readCount))
+				break;
+
+			// words without a checkpoint in them are only counted, the rest is walked byte by byte
+			const unsigned char* pos = block.data();
+			const unsigned char* const blockEnd = pos + readCount;
+			while (pos < blockEnd)
+			{
+				if (blockEnd - pos >= 8)
+				{
+					uint64_t word;
+					std::memcpy(&word, pos, sizeof(word));
+					unsigned chars, newlines;
+					detail::CountCharsAndNewlines(word, chars, newlines);
+					if (charCount + chars <= nextCharCheckpoint && newlineCount + newlines < nextLineCheckpoint)
+					{
+						charCount += chars;
+						newlineCount += newlines;
+						pos += 8;
+						continue;
+					}
+				}
+				for (const unsigned char* const wordEnd = pos + std::min<ptrdiff_t>(8, blockEnd - pos); pos < wordEnd; ++pos)
+				{
+					if (!detail::UTF8IsContinuationByte(pos))
+					{
+						if (charCount == nextCharCheckpoint)
+						{
+							built.charOffsets.push_back(built.byteSize + (pos - block.data()));
+							nextCharCheckpoint += stride;
+						}
+						++charCount;
+					}
+					if (*pos == '\n' && ++newlineCount == nextLineCheckpoint)
+					{
+						built.lineOffsets.push_back(built.byteSize + (pos - block.data()) + 1);
+						nextLineCheckpoint += stride;
+					}
+				}
+			}
+			built.byteSize += readCount;
+		}
+		if (ifs.bad())
+		{
+			reason += "read error after " + std::to_string(validator.BytesFed()) + " bytes, no index built\n";
+			return false;
+		}
+		if (!validator.Finish())
+		{
+			reason += "invalid UTF-8 at byte offset " + std::to_string(validator.FirstErrorOffset()) + ", no index built\n";
+			return false;
+		}
+
+		built.charCount = charCount;
+		built.lineCount = newlineCount + 1;
+		index = std::move(built);
+		return true;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE std::vector<unsigned char> SerializeUTF8OffsetIndex(const UTF8OffsetIndex& index)
+	{
+		std::vector<unsigned char> out(std::begin(detail::UTF8_INDEX_MAGIC), std::end(detail::UTF8_INDEX_MAGIC));
+		out.reserve(detail::UTF8_INDEX_HEADER_SIZE + sizeof(uint64_t) * (index.charOffsets.size() + index.lineOffsets.size()));
+		for (const uint64_t field : { index.stride, index.byteSize, index.charCount, index.lineCount, static_cast<uint64_t>(index.charOffsets.size()), static_cast<uint64_t>(index.lineOffsets.size()) })
+			detail::AppendLittleEndian64(out, field);
+		for (const uint64_t offset : index.charOffsets)
+			detail::AppendLittleEndian64(out, offset);
+		for (const uint64_t offset : index.lineOffsets)
+			detail::AppendLittleEndian64(out, offset);
+		return out;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE bool WriteUTF8OffsetIndex(const std::string& path, const UTF8OffsetIndex& index, std::string& reason)
+	{
+		// write aside and rename, so a reader never maps a half written sidecar
+		const std::vector<unsigned char> serialised = SerializeUTF8OffsetIndex(index);
+		const std::string tempPath = path + ".tmp";
+		std::ofstream ofs(tempPath, std::ios::binary | std::ios::trunc);
+		ofs.write(reinterpret_cast<const char*>(serialised.data()), static_cast<std::streamsize>(serialised.size()));
+		ofs.close();
+		if (!ofs)
+		{
+			reason += "cannot write index file " + tempPath + "\n";
+			return false;
+		}
+		if (std::rename(tempPath.c_str(), path.c_str()) != 0)
+		{
+			reason += "cannot rename " + tempPath + " to " + path + "\n";
+			return false;
+		}
+		return true;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE bool UTF8OffsetIndexView::Attach(const void* data, size_t size, std::string& reason)
+	{
+		const unsigned char* const bytes = static_cast<const unsigned char*>(data);
+		if (size < detail::UTF8_INDEX_HEADER_SIZE || std::memcmp(bytes, detail::UTF8_INDEX_MAGIC, sizeof(detail::UTF8_INDEX_MAGIC)) != 0)
+		{
+			reason += "not a UTF-8 offset index (or of another format version)\n";
+			return false;
+		}
+		const unsigned char* const fields = bytes + sizeof(detail::UTF8_INDEX_MAGIC);
+		const uint64_t newStride = detail::LoadLittleEndian64(fields);
+		const uint64_t newCharCount = detail::LoadLittleEndian64(fields + 16);
+		const uint64_t newLineCount = detail::LoadLittleEndian64(fields + 24);
+		const uint64_t newCharOffsetCount = detail::LoadLittleEndian64(fields + 32);
+		const uint64_t newLineOffsetCount = detail::LoadLittleEndian64(fields + 40);
+		// the checkpoint counts follow from the totals, and the arrays have to fill the rest exactly
+		const uint64_t arraysSize = (size - detail::UTF8_INDEX_HEADER_SIZE) / sizeof(uint64_t);
+		if (newStride == 0 || newLineCount == 0
+			|| newCharOffsetCount != (newCharCount == 0 ? 1 : (newCharCount - 1) / newStride + 1)
+			|| newLineOffsetCount != (newLineCount - 1) / newStride + 1
+			|| newCharOffsetCount > arraysSize || newLineOffsetCount != arraysSize - newCharOffsetCount
+			|| (size - detail::UTF8_INDEX_HEADER_SIZE) % sizeof(uint64_t) != 0)
+		{
+			reason += "corrupt UTF-8 offset index: header does not match the size\n";
+			return false;
+		}
+
+		stride = newStride;
+		byteSize = detail::LoadLittleEndian64(fields + 8);
+		charCount = newCharCount;
+		lineCount = newLineCount;
+		charOffsets = bytes + detail::UTF8_INDEX_HEADER_SIZE;
+		charOffsetCount = static_cast<size_t>(newCharOffsetCount);
+		lineOffsets = charOffsets + sizeof(uint64_t) * charOffsetCount;
+		lineOffsetCount = static_cast<size_t>(newLineOffsetCount);
+		return true;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE uint64_t UTF8OffsetIndexView::Stride() const
+	{
+		return stride;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE uint64_t UTF8OffsetIndexView::ByteSize() const
+	{
+		return byteSize;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE uint64_t UTF8OffsetIndexView::CharCount() const
+	{
+		return charCount;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE uint64_t UTF8OffsetIndexView::LineCount() const
+	{
+		return lineCount;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE UTF8IndexCheckpoint UTF8OffsetIndexView::CharCheckpoint(uint64_t charIndex) const
+	{
+		if (charOffsets == nullptr || charIndex > charCount)
+			throw std::out_of_range("text_charset_detection::UTF8OffsetIndexView::CharCheckpoint(): char index past the end");
+		// the end position (charIndex == charCount) has a checkpoint of its own only if it is a char
+		const size_t checkpoint = std::min<size_t>(static_cast<size_t>(charIndex / stride), charOffsetCount - 1);
+		return { detail::LoadLittleEndian64(charOffsets + sizeof(uint64_t) * checkpoint), checkpoint * stride };
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE UTF8IndexCheckpoint UTF8OffsetIndexView::LineCheckpoint(uint64_t lineIndex) const
+	{
+		if (lineOffsets == nullptr || lineIndex >= lineCount)
+			throw std::out_of_range("text_charset_detection::UTF8OffsetIndexView::LineCheckpoint(): line index past the end");
+		const size_t checkpoint = static_cast<size_t>(lineIndex / stride);
+		return { detail::LoadLittleEndian64(lineOffsets + sizeof(uint64_t) * checkpoint), checkpoint * stride };
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE size_t SkipUTF8Chars(const unsigned char* buffer, size_t size, uint64_t charCount)
+	{
+		size_t pos = 0;
+		uint64_t remaining = charCount;
+		// whole words while the target char starts after them
+		while (size - pos >= 8)
+		{
+			uint64_t word;
+			std::memcpy(&word, buffer + pos, sizeof(word));
+			unsigned chars, newlines;
+			detail::CountCharsAndNewlines(word, chars, newlines);
+			if (chars > remaining)
+				break;
+			remaining -= chars;
+			pos += 8;
+		}
+		for (; pos < size; ++pos)
+			if (!detail::UTF8IsContinuationByte(buffer + pos) && remaining-- == 0)
+				return pos;
+		return size;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE std::vector<size_t> SplitUTF8Chunks(const unsigned char* buffer, size_t size, size_t chunkCount, bool bPreferNewlines)
+	{
+		if (chunkCount == 0)
+			throw std::invalid_argument("text_charset_detection::SplitUTF8Chunks(): chunkCount is 0");
+
+		// every split point only depends on its even split position, so they are searched independently
+		std::vector<size_t> offsets(chunkCount + 1);
+		const auto evenSplit = [&](size_t idx) { return size / chunkCount * idx + size % chunkCount * idx / chunkCount; };
+		const auto findSplit = [&](size_t idx)
+		{
+			const size_t even = evenSplit(idx);
+			if (bPreferNewlines)
+			{
+				// right after the first newline before the next even split point, if it is close enough
+				const size_t searchEnd = std::min(evenSplit(idx + 1), even + detail::CHUNK_SPLIT_NEWLINE_SEARCH);
+				const void* newline = even < searchEnd ? std::memchr(buffer + even, '\n', searchEnd - even) : nullptr;
+				if (newline != nullptr)
+					return static_cast<size_t>(static_cast<const unsigned char*>(newline) - buffer) + 1;
+			}
+			return UTF8TruncationSize(buffer, size, even);
+		};
+
+		const size_t splitPoints = chunkCount - 1;
+		const size_t threadCount = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), splitPoints / detail::CHUNK_SPLIT_POINTS_PER_THREAD);
+		if (threadCount <= 1)
+		{
+			for (size_t idx = 1; idx < chunkCount; ++idx)
+				offsets[idx] = findSplit(idx);
+		}
+		else
+		{
+			std::vector<std::thread> threads;
+			for (size_t thread = 0; thread < threadCount; ++thread)
+				threads.emplace_back([&, thread]()
+					{
+						for (size_t idx = 1 + thread; idx < chunkCount; idx += threadCount)
+							offsets[idx] = findSplit(idx);
+					});
+			for (std::thread& thread : threads)
+				thread.join();
+		}
+		offsets[0] = 0;
+		offsets[chunkCount] = size;
+
+		// a split moved onto (or, in invalid text, back before) its neighbour leaves an empty chunk, dropped
+		for (size_t idx = 1; idx <= chunkCount; ++idx)
+			offsets[idx] = std::max(offsets[idx], offsets[idx - 1]);
+		offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+		if (offsets.size() == 1)
+			offsets.push_back(size);		// empty buffer: one empty chunk
+		return offsets;
+	}
+
+	template <typename offset_t>
+	TEXT_CHARSET_DETECTION_INLINE size_t ValidateUTF8Batch(const unsigned char* data, size_t dataSize, const offset_t* offsets, size_t rowCount, uint8_t* validityBitmap)
+	{
+		if (rowCount == 0)
+			return 0;
+		// all offsets are checked before anything is read, every row has to lie within [offsets[0], offsets[rowCount]]
+		if (offsets[0] < 0 || static_cast<size_t>(offsets[rowCount]) > dataSize)
+			throw std::out_of_range("text_charset_detection::ValidateUTF8Batch(): offsets out of data");
+		for (size_t row = 0; row < rowCount; ++row)
+			if (offsets[row + 1] < offsets[row])
+				throw std::out_of_range("text_charset_detection::ValidateUTF8Batch(): offsets decreasing at row " + std::to_string(row));
+		detail::AddMetric(detail::METRIC_BYTES_VALIDATED, offsets[rowCount] - offsets[0]);
+
+		// one pass over the blob: 7-bit ASCII word by word regardless of the rows, anything else char by char within its row
+		const detail::utf8_checking_unit_t* const blobEnd = data + offsets[rowCount];
+		const detail::utf8_checking_unit_t* pos = detail::FindFirstNonASCII7(data + offsets[0], blobEnd);
+		std::string unusedReason;		// only written on invalid chars
+		size_t invalidRows = 0;
+		uint8_t bitmapByte = 0;
+		for (size_t row = 0; row < rowCount; ++row)
+		{
+			const detail::utf8_checking_unit_t* const rowEnd = data + offsets[row + 1];
+			bool bRowValid = true;
+			while (pos < rowEnd)
+			{
+				bool bThisCharValid = false, bThisCharValid7bitASCII = false;
+				detail::UTF8CharValidate<true>(pos, rowEnd, bThisCharValid, bThisCharValid7bitASCII, unusedReason);
+				if (!bThisCharValid)
+				{
+					// the rest of the row does not matter
+					bRowValid = false;
+					unusedReason.clear();
+					pos = rowEnd;
+				}
+				pos = detail::FindFirstNonASCII7(pos, blobEnd);
+			}
+			invalidRows += !bRowValid;
+
+			bitmapByte |= static_cast<uint8_t>(bRowValid) << (row % 8);
+			if (row % 8 == 7 || row + 1 == rowCount)
+			{
+				validityBitmap[row / 8] = bitmapByte;
+				bitmapByte = 0;
+			}
+		}
+		return invalidRows;
+	}
+
+#if !defined(TEXT_CHARSET_DETECTION_HEADER_ONLY)
+	template size_t ValidateUTF8Batch<int32_t>(const unsigned char* data, size_t dataSize, const int32_t* offsets, size_t rowCount, uint8_t* validityBitmap);
+	template size_t ValidateUTF8Batch<int64_t>(const unsigned char* data, size_t dataSize, const int64_t* offsets, size_t rowCount, uint8_t* validityBitmap);
+#endif
+
+	TEXT_CHARSET_DETECTION_INLINE bool CheckStreamForUTF8NoBOM(std::ifstream& ifs, std::string& reason)
+	{
+		size_t allocBufferSize = -1;
+		size_t readCount = -1;
+		detail::AddMetric(detail::METRIC_FILES_PROCESSED, 1);
+		detail::MemoryReservation sampleReservation;
+		std::unique_ptr<detail::utf8_checking_unit_t[]> sampleTextBuffer;
+		{
+			detail::PhaseMetricsTimer phaseTimer(DetectionPhase::Read);
+			sampleTextBuffer = detail::ReadSampleToBuffer(ifs, allocBufferSize, readCount, sampleReservation);
+		}
+		if (sampleTextBuffer == nullptr)
+		{
+			DetectionResult result;
+			detail::StreamSampleForResult<false>(ifs, result);
+			reason += result.reason;
+			return result.charset == DetectedCharset::UTF8;
+		}
+
+		return CheckBufferForUTF8NoBOM(sampleTextBuffer.get(), readCount, reason);
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE void SetShadowValidation(double sampleFraction, shadow_mismatch_handler_t onMismatch)
+	{
+		detail::ShadowValidationState& state = detail::ShadowValidation();
+		{
+			std::lock_guard<std::mutex> lock(state.handlerMutex);
+			state.handler = std::make_shared<const shadow_mismatch_handler_t>(std::move(onMismatch));
+		}
+		const double clamped = sampleFraction < 0 ? 0 : sampleFraction > 1 ? 1 : sampleFraction;
+		state.sampleRatePPM.store(static_cast<uint32_t>(clamped * 1000000 + 0.5), std::memory_order_relaxed);
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE ShadowValidationStats GetShadowValidationStats()
+	{
+		detail::ShadowValidationState& state = detail::ShadowValidation();
+		ShadowValidationStats stats;
+		stats.calls = state.calls.load(std::memory_order_relaxed);
+		stats.shadowed = state.shadowed.load(std::memory_order_relaxed);
+		stats.mismatches = state.mismatches.load(std::memory_order_relaxed);
+		stats.shadowNanoseconds = state.shadowNanoseconds.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE shadow_mismatch_handler_t MakeShadowMismatchDumper(const std::string& directory)
+	{
+		std::shared_ptr<std::atomic<uint64_t>> counter = std::make_shared<std::atomic<uint64_t>>(0);
+		return [directory, counter](const ShadowValidationMismatch& mismatch)
+		{
+			const auto offsetToString = [](size_t offset) { return offset == UTF8_NO_ERROR_OFFSET ? std::string("none") : std::to_string(offset); };
+			const std::string base = directory + "/shadow-mismatch-" + std::to_string(counter->fetch_add(1)) + "-" +
+				std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
+			std::ofstream bin(base + ".bin", std::ios::binary | std::ios::trunc);
+			bin.write(reinterpret_cast<const char*>(mismatch.input.data()), mismatch.input.size());
+			std::ofstream txt(base + ".txt", std::ios::trunc);
+			txt << "engine: " << mismatch.engine << "\n"
+				<< "engine verdict: " << (mismatch.bEngineValidUTF8 ? "valid" : "invalid") << ", first error at " << offsetToString(mismatch.engineFirstErrorOffset) << "\n"
+				<< "reference verdict: " << (mismatch.bReferenceValidUTF8 ? "valid" : "invalid") << ", first error at " << offsetToString(mismatch.referenceFirstErrorOffset) << "\n"
+				<< "compared bytes: " << mismatch.coveredSize << " of " << mismatch.input.size() << "\n";
+		};
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE const char* UTF8ErrorClassName(UTF8ErrorClass errorClass)
+	{
+		switch (errorClass)
+		{
+		case UTF8ErrorClass::InvalidLeadingByte:		return "invalid_leading_byte";
+		case UTF8ErrorClass::TruncatedSequence:			return "truncated_sequence";
+		case UTF8ErrorClass::MissingContinuation:		return "missing_continuation";
+		case UTF8ErrorClass::ControlChar:				return "control_char";
+		case UTF8ErrorClass::Overlong2Bytes:			return "overlong_2_bytes";
+		case UTF8ErrorClass::Overlong3Bytes:			return "overlong_3_bytes";
+		case UTF8ErrorClass::SurrogateHalf:				return "surrogate_half";
+		case UTF8ErrorClass::Overlong4Bytes:			return "overlong_4_bytes";
+		case UTF8ErrorClass::InvalidCodePointF4:		return "invalid_code_point_f4";
+		case UTF8ErrorClass::InvalidCodePointNonF4:		return "invalid_code_point_non_f4";
+		case UTF8ErrorClass::Unknown:					return "unknown";
+		default:
+			throw std::logic_error("text_charset_detection::UTF8ErrorClass out of bounds");
+		}
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE const char* DetectionVerdictName(DetectionVerdict verdict)
+	{
+		switch (verdict)
+		{
+		case DetectionVerdict::ASCII7:		return "ascii7";
+		case DetectionVerdict::UTF8:		return "utf8";
+		case DetectionVerdict::NotUTF8:		return "not_utf8";
+		default:
+			throw std::logic_error("text_charset_detection::DetectionVerdict out of bounds");
+		}
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE const char* DetectionPhaseName(DetectionPhase phase)
+	{
+		switch (phase)
+		{
+		case DetectionPhase::Read:			return "read";
+		case DetectionPhase::BOMProbe:		return "bom_probe";
+		case DetectionPhase::Validation:	return "validation";
+		case DetectionPhase::ErrorFormatting:	return "error_formatting";
+		default:
+			throw std::logic_error("text_charset_detection::DetectionPhase out of bounds");
+		}
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE DetectionMetrics GetDetectionMetrics()
+	{
+		uint64_t totals[detail::METRIC_COUNT] = {};
+		detail::MetricsRegistry& registry = detail::Metrics();
+		{
+			std::lock_guard<std::mutex> lock(registry.mutex);
+			for (const detail::MetricsSlot& slot : registry.slots)
+				for (size_t idx = 0; idx < detail::METRIC_COUNT; ++idx)
+					totals[idx] += slot.counters[idx].load(std::memory_order_relaxed);
+		}
+
+		DetectionMetrics metrics;
+		metrics.bytesValidated = totals[detail::METRIC_BYTES_VALIDATED];
+		metrics.filesProcessed = totals[detail::METRIC_FILES_PROCESSED];
+		for (size_t idx = 0; idx < static_cast<size_t>(DetectionVerdict::Count); ++idx)
+			metrics.verdicts[idx] = totals[detail::METRIC_VERDICT_FIRST + idx];
+		for (size_t idx = 0; idx < static_cast<size_t>(UTF8ErrorClass::Count); ++idx)
+			metrics.utf8Errors[idx] = totals[detail::METRIC_UTF8_ERROR_FIRST + idx];
+		for (size_t idx = 0; idx < static_cast<size_t>(DetectionPhase::Count); ++idx)
+			metrics.phaseNanoseconds[idx] = totals[detail::METRIC_PHASE_NANOSECONDS_FIRST + idx];
+		return metrics;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE std::string FormatPrometheusMetrics(const DetectionMetrics& metrics)
+	{
+		std::ostringstream oss;
+		oss << "# HELP detcharset_bytes_validated_total Bytes run through UTF-8 validation.\n"
+			<< "# TYPE detcharset_bytes_validated_total counter\n"
+			<< "detcharset_bytes_validated_total " << metrics.bytesValidated << "\n"
+			<< "# HELP detcharset_files_processed_total Inputs detected (files, buffers, streamed input), however they were decided.\n"
+			<< "# TYPE detcharset_files_processed_total counter\n"
+			<< "detcharset_files_processed_total " << metrics.filesProcessed << "\n"
+			<< "# HELP detcharset_verdicts_total UTF-8 (no BOM) detection results.\n"
+			<< "# TYPE detcharset_verdicts_total counter\n";
+		for (size_t idx = 0; idx < static_cast<size_t>(DetectionVerdict::Count); ++idx)
+			oss << "detcharset_verdicts_total{verdict=\"" << DetectionVerdictName(static_cast<DetectionVerdict>(idx)) << "\"} " << metrics.verdicts[idx] << "\n";
+		oss << "# HELP detcharset_utf8_errors_total Invalid UTF-8 sequences found, by error class.\n"
+			<< "# TYPE detcharset_utf8_errors_total counter\n";
+		for (size_t idx = 0; idx < static_cast<size_t>(UTF8ErrorClass::Count); ++idx)
+			oss << "detcharset_utf8_errors_total{class=\"" << UTF8ErrorClassName(static_cast<UTF8ErrorClass>(idx)) << "\"} " << metrics.utf8Errors[idx] << "\n";
+		oss << "# HELP detcharset_phase_seconds_total Time spent in each detection phase, error formatting included in validation.\n"
+			<< "# TYPE detcharset_phase_seconds_total counter\n";
+		for (size_t idx = 0; idx < static_cast<size_t>(DetectionPhase::Count); ++idx)
+			if (static_cast<DetectionPhase>(idx) != DetectionPhase::ErrorFormatting)
+				oss << "detcharset_phase_seconds_total{phase=\"" << DetectionPhaseName(static_cast<DetectionPhase>(idx)) << "\"} " << metrics.phaseNanoseconds[idx] * 1e-9 << "\n";
+		return oss.str();
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE bool WritePrometheusMetrics(const std::string& path, std::string& reason)
+	{
+		// write aside and rename, so a scraper never sees a half written file
+		const std::string tempPath = path + ".tmp";
+		std::ofstream ofs(tempPath, std::ios::trunc);
+		ofs << FormatPrometheusMetrics(GetDetectionMetrics());
+		ofs.close();
+		if (!ofs)
+		{
+			reason += "cannot write metrics file " + tempPath + "\n";
+			return false;
+		}
+		if (std::rename(tempPath.c_str(), path.c_str()) != 0)
+		{
+			reason += "cannot rename " + tempPath + " to " + path + "\n";
+			return false;
+		}
+		return true;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE void SetMemoryBudget(size_t limitBytes, MemoryBudgetMode mode)
+	{
+		if (limitBytes != 0 && limitBytes < detail::MEMORY_BUDGET_STREAM_BLOCK_SIZE)
+			throw std::invalid_argument("text_charset_detection::SetMemoryBudget(): limit below the stream block size of " + std::to_string(detail::MEMORY_BUDGET_STREAM_BLOCK_SIZE) + " bytes");
+		detail::MemoryBudgetState& state = detail::MemoryBudget();
+		{
+			std::lock_guard<std::mutex> lock(state.mutex);
+			state.limit.store(limitBytes, std::memory_order_relaxed);
+			state.mode = mode;
+		}
+		state.released.notify_all();
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE MemoryBudgetStats GetMemoryBudgetStats()
+	{
+		detail::MemoryBudgetState& state = detail::MemoryBudget();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		MemoryBudgetStats stats;
+		stats.limitBytes = state.limit.load(std::memory_order_relaxed);
+		stats.mode = state.mode;
+		stats.inUseBytes = state.inUse;
+		stats.peakBytes = state.peak;
+		stats.waits = state.waits;
+		stats.streamedSamples = state.streamedSamples;
+		return stats;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE TuningProfile DefaultTuningProfile()
+	{
+		return { detail::UTF8_NO_BOM_TEXT_SAMPLE_SIZE, detail::UTF8_TINY_MODE_SIZE_LIMIT };
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE TuningProfile GetTuningProfile()
+	{
+		detail::TuningState& state = detail::Tuning();
+		return { state.sampleSize.load(std::memory_order_relaxed), state.tinyModeSizeLimit.load(std::memory_order_relaxed) };
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE void SetTuningProfile(const TuningProfile& profile)
+	{
+		detail::TuningState& state = detail::Tuning();
+		state.sampleSize.store(profile.sampleSize, std::memory_order_relaxed);
+		// non-tiny mode cuts UTF8_MAX_CHAR_SIZE bytes from the end, smaller limits would underflow
+		state.tinyModeSizeLimit.store(profile.tinyModeSizeLimit < detail::UTF8_MAX_CHAR_SIZE ? detail::UTF8_MAX_CHAR_SIZE : profile.tinyModeSizeLimit, std::memory_order_relaxed);
+	}
+
+	// profile format: one "key = value" per line, '#' starts a comment line, keys: sample_size, tiny_mode_size_limit (bytes)
+	// keys missing from the file keep their default values
+	TEXT_CHARSET_DETECTION_INLINE bool LoadTuningProfile(const std::string& path, TuningProfile& profile, std::string& reason)
+	{
+		std::ifstream ifs(path);
+		if (!ifs)
+		{
+			reason += "cannot open tuning profile " + path + "\n";
+			return false;
+		}
+
+		TuningProfile loaded = DefaultTuningProfile();
+		std::string line;
+		size_t lineNr = 0;
+		while (std::getline(ifs, line))
+		{
+			++lineNr;
+			const size_t first = line.find_first_not_of(" \t\r");
+			if (first == std::string::npos || line[first] == '#')
+				continue;
+			const size_t eq = line.find('=');
+			if (eq == std::string::npos)
+			{
+				reason += "tuning profile " + path + ":" + std::to_string(lineNr) + ": missing '='\n";
+				return false;
+			}
+			const size_t keyEnd = line.find_last_not_of(" \t", eq - 1);
+			const std::string key = keyEnd == std::string::npos || keyEnd < first ? std::string() : line.substr(first, keyEnd - first + 1);
+
+			size_t value = 0;
+			std::istringstream valueStream(line.substr(eq + 1));
+			std::string trailing;
+			if (!(valueStream >> value) || (valueStream >> trailing && trailing[0] != '#'))
+			{
+				reason += "tuning profile " + path + ":" + std::to_string(lineNr) + ": value of " + key + " is not a byte count\n";
+				return false;
+			}
+
+			if (key == "sample_size")
+				loaded.sampleSize = value;
+			else if (key == "tiny_mode_size_limit")
+				loaded.tinyModeSizeLimit = value;
+			else
+				reason += "tuning profile " + path + ":" + std::to_string(lineNr) + ": unknown key " + key + " ignored\n";
+		}
+
+		profile = loaded;
+		return true;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE bool SaveTuningProfile(const std::string& path, const TuningProfile& profile, std::string& reason)
+	{
+		std::ofstream ofs(path, std::ios::trunc);
+		ofs << "# text_charset_detection tuning profile, load with " << detail::TUNING_PROFILE_ENV_VAR << "=" << path << "\n"
+			<< "sample_size = " << profile.sampleSize << "\n"
+			<< "tiny_mode_size_limit = " << profile.tinyModeSizeLimit << "\n";
+		ofs.close();
+		if (!ofs)
+		{
+			reason += "cannot write tuning profile " + path + "\n";
+			return false;
+		}
+		return true;
+	}
+
+	// prerequisite: stream has to be at 0 reading position
+	TEXT_CHARSET_DETECTION_INLINE bool CheckStreamForUTF8BOM(std::ifstream& ifs, std::string& reason)
+	{
+		assert(static_cast<size_t>(ifs.tellg()) == 0);
+		detail::PhaseMetricsTimer phaseTimer(DetectionPhase::BOMProbe);
+		// checks for UTF-8 representation of U+00FEFF (0xEF 0xBB 0xBF) at the beginning of the stream
+		constexpr detail::utf8_checking_unit_t UTF8BOM[] = { 0xEF, 0xBB, 0xBF };
+
+		const int checkResult = detail::CheckStreamForSignature(ifs, reason, UTF8BOM);
+		switch (checkResult)
+		{
+		case detail::SIGNATURE_CHECK_RESULT_FAIL:
+			return false;
+		case detail::SIGNATURE_CHECK_RESULT_NOT_FOUND:
+			reason += "No UTF-8 BOM found\n";
+			return false;
+		case detail::SIGNATURE_CHECK_RESULT_FOUND:
+			reason += "UTF-8 BOM found\n";
+			return true;
+		default:
+			throw std::logic_error("text_charset_detection::detail::SIGNATURE_CHECK_RESULT_xxxx out of bounds (a)");
+		}
+	}
+
+	// prerequisite: stream has to be at 0 reading position
+	TEXT_CHARSET_DETECTION_INLINE bool CheckStreamForUTF16BOM(std::ifstream& ifs, std::string& reason, bool& bLittleEndian)
+	{
+		assert(static_cast<size_t>(ifs.tellg()) == 0);
+		detail::PhaseMetricsTimer phaseTimer(DetectionPhase::BOMProbe);
+		// checks for UTF-8 representation of U+00FEFF (0xEF 0xBB 0xBF) at the beginning of the stream
+		constexpr detail::utf8_checking_unit_t UTF16LE_BOM[] = { 0xFF, 0xFE };
+		constexpr detail::utf8_checking_unit_t UTF16BE_BOM[] = { 0xFE, 0xFF };
+
+		const int checkResultLE = detail::CheckStreamForSignature(ifs, reason, UTF16LE_BOM);
 		switch (checkResultLE)
 		{
 		case detail::SIGNATURE_CHECK_RESULT_FAIL:
@@ -685,4 +2476,463 @@ namespace text_charset_detection
 		}
 	}
 
+	TEXT_CHARSET_DETECTION_INLINE const char* DetectedCharsetName(DetectedCharset charset)
+	{
+		switch (charset)
+		{
+		case DetectedCharset::Unknown:		return "unknown";
+		case DetectedCharset::ASCII7:		return "ascii7";
+		case DetectedCharset::UTF8:			return "utf-8";
+		case DetectedCharset::UTF8BOM:		return "utf-8-bom";
+		case DetectedCharset::UTF16LE:		return "utf-16le";
+		case DetectedCharset::UTF16BE:		return "utf-16be";
+		default:
+			throw std::logic_error("text_charset_detection::DetectedCharset out of bounds");
+		}
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE const char* EncodingDeclarationSourceName(EncodingDeclarationSource source)
+	{
+		switch (source)
+		{
+		case EncodingDeclarationSource::None:				return "none";
+		case EncodingDeclarationSource::XMLProlog:			return "xml-prolog";
+		case EncodingDeclarationSource::CSSCharsetRule:		return "css-charset-rule";
+		case EncodingDeclarationSource::HTMLMeta:			return "html-meta";
+		default:
+			throw std::logic_error("text_charset_detection::EncodingDeclarationSource out of bounds");
+		}
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE EncodingDeclaration PrescanEncodingDeclaration(const unsigned char* buffer, size_t size)
+	{
+		EncodingDeclaration declaration;
+		const unsigned char* const end = buffer + std::min(size, detail::MARKUP_PRESCAN_SIZE);
+
+		// XML: only a prolog at the very start counts, its encoding pseudo-attribute has to be quoted
+		if (detail::MatchCaseless(buffer, end, "<?xml") && end - buffer > 5 && detail::MarkupSpace(buffer[5]))
+		{
+			const unsigned char* const prologEnd = detail::FindBytes(buffer, end, "?>");
+			for (const unsigned char* pos = detail::FindBytes(buffer, prologEnd, "encoding"); pos < prologEnd; pos = detail::FindBytes(pos, prologEnd, "encoding"))
+			{
+				pos += 8;
+				while (pos < prologEnd && detail::MarkupSpace(*pos))
+					++pos;
+				if (pos == prologEnd || *pos != '=')
+					continue;
+				++pos;
+				while (pos < prologEnd && detail::MarkupSpace(*pos))
+					++pos;
+				if (pos == prologEnd || (*pos != '"' && *pos != '\''))
+					break;
+				const unsigned char* const labelEnd = std::find(pos + 1, prologEnd, *pos);
+				if (labelEnd != prologEnd)
+				{
+					declaration.source = EncodingDeclarationSource::XMLProlog;
+					declaration.label = detail::EncodingLabel(pos + 1, labelEnd);
+				}
+				break;
+			}
+			return declaration;
+		}
+
+		// CSS: the exact bytes @charset "<label>"; at the very start
+		constexpr char CSS_CHARSET_RULE[] = "@charset \"";
+		if (static_cast<size_t>(end - buffer) > sizeof(CSS_CHARSET_RULE) - 1 && std::memcmp(buffer, CSS_CHARSET_RULE, sizeof(CSS_CHARSET_RULE) - 1) == 0)
+		{
+			const unsigned char* const labelStart = buffer + sizeof(CSS_CHARSET_RULE) - 1;
+			const unsigned char* const labelEnd = std::find(labelStart, end, '"');
+			if (end - labelEnd >= 2 && labelEnd[1] == ';')
+			{
+				declaration.source = EncodingDeclarationSource::CSSCharsetRule;
+				declaration.label = detail::EncodingLabel(labelStart, labelEnd);
+			}
+			return declaration;
+		}
+
+		// HTML: only in a document that starts with markup, so that text merely mentioning <meta> is not taken for HTML
+		const unsigned char* pos = buffer;
+		while (pos < end && detail::MarkupSpace(*pos))
+			++pos;
+		if (pos == end || *pos != '<')
+			return declaration;
+		std::string name, value;
+		while (pos < end)
+		{
+			if (*pos != '<')
+			{
+				++pos;
+				continue;
+			}
+			if (detail::MatchCaseless(pos, end, "<!--"))
+			{
+				pos = detail::FindBytes(pos + 2, end, "-->");
+				pos = pos == end ? end : pos + 3;
+			}
+			else if (detail::MatchCaseless(pos, end, "<meta") && end - pos > 5 && (detail::MarkupSpace(pos[5]) || pos[5] == '/'))
+			{
+				const unsigned char* const tagStart = pos;
+				bool bContentTypePragma = false;
+				std::string charset, contentCharset;
+				pos += 5;
+				while (detail::NextMarkupAttribute(pos, end, name, value))
+				{
+					if (name == "http-equiv")
+						bContentTypePragma |= value == "content-type";
+					else if (name == "charset" && charset.empty())
+						charset = detail::EncodingLabel(reinterpret_cast<const unsigned char*>(value.data()), reinterpret_cast<const unsigned char*>(value.data()) + value.size());
+					else if (name == "content" && contentCharset.empty())
+						contentCharset = detail::CharsetOfContentType(value);
+				}
+				if (pos == end)
+					break;											// cut off by the end of the prescanned bytes
+				const std::string& label = !charset.empty() ? charset : bContentTypePragma ? contentCharset : charset;
+				if (!label.empty())
+				{
+					declaration.source = EncodingDeclarationSource::HTMLMeta;
+					declaration.label = label;
+					declaration.offset = tagStart - buffer;
+					return declaration;
+				}
+			}
+			else if (end - pos > 2 && (detail::ASCIILetter(pos[1]) || (pos[1] == '/' && detail::ASCIILetter(pos[2]))))
+			{
+				// other tags: their attributes are parsed, a '>' in a quoted value does not end the tag
+				pos += pos[1] == '/' ? 2 : 1;
+				while (pos < end && !detail::MarkupSpace(*pos) && *pos != '>')
+					++pos;
+				while (detail::NextMarkupAttribute(pos, end, name, value))
+				{
+				}
+			}
+			else if (end - pos > 1 && (pos[1] == '!' || pos[1] == '/' || pos[1] == '?'))
+				pos = std::find(pos + 1, end, '>');
+			else
+				++pos;
+		}
+		return declaration;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE PhaseTimings& PhaseTimings::operator+=(const PhaseTimings& other)
+	{
+		for (size_t idx = 0; idx < static_cast<size_t>(DetectionPhase::Count); ++idx)
+			ticks[idx] += other.ticks[idx];
+		detections += other.detections;
+		return *this;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE double PhaseTimings::Seconds(DetectionPhase phase) const
+	{
+		return ticks[static_cast<size_t>(phase)] / PhaseTimingTicksPerSecond();
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE double PhaseTimingTicksPerSecond()
+	{
+#if defined(TEXT_CHARSET_DETECTION_HAVE_TSC)
+		// measured once against steady_clock, the time stamp counter runs at a constant rate on current x86 CPUs
+		static const double ticksPerSecond = []()
+		{
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			const uint64_t startTicks = detail::PhaseTimestamp<true>();
+			std::chrono::steady_clock::time_point now;
+			do
+			{
+				now = std::chrono::steady_clock::now();
+			} while (now - start < std::chrono::milliseconds(10));
+			const uint64_t ticks = detail::PhaseTimestamp<true>() - startTicks;
+			return ticks / std::chrono::duration<double>(now - start).count();
+		}();
+		return ticksPerSecond;
+#else
+		return 1e9;
+#endif
+	}
+
+	// prerequisite: stream has to be at 0 reading position
+	template <bool bPhaseTimings>
+	TEXT_CHARSET_DETECTION_INLINE DetectionResult DetectCharset(std::ifstream& ifs)
+	{
+		DetectionResult result;
+		if constexpr (bPhaseTimings)
+			result.timings.detections = 1;
+		detail::AddMetric(detail::METRIC_FILES_PROCESSED, 1);
+
+		uint64_t start = detail::PhaseTimestamp<bPhaseTimings>();
+		bool bLittleEndian = false;
+		if (CheckStreamForUTF8BOM(ifs, result.reason))
+			result.charset = DetectedCharset::UTF8BOM;
+		else if (CheckStreamForUTF16BOM(ifs, result.reason, bLittleEndian))
+			result.charset = bLittleEndian ? DetectedCharset::UTF16LE : DetectedCharset::UTF16BE;
+		detail::AddPhaseTicks<bPhaseTimings>(result.timings, DetectionPhase::BOMProbe, start);
+		if (result.charset != DetectedCharset::Unknown)
+			return result;
+
+		start = detail::PhaseTimestamp<bPhaseTimings>();
+		size_t allocBufferSize = -1;
+		// the prescanned bytes are read first and become the start of the sample, a declaration that decides saves reading
+		// the rest of it
+		unsigned char prefix[detail::MARKUP_PRESCAN_SIZE];
+		size_t prefixSize = 0;
+		if constexpr (detail::MARKUP_DECLARATION_PRESCAN)
+		{
+			{
+				detail::PhaseMetricsTimer phaseTimer(DetectionPhase::Read);
+				ifs.read(reinterpret_cast<char*>(prefix), sizeof(prefix));
+				prefixSize = static_cast<size_t>(ifs.gcount());
+				if (prefixSize < sizeof(prefix))
+					ifs.clear();
+			}
+			detail::AddPhaseTicks<bPhaseTimings>(result.timings, DetectionPhase::Read, start);
+			if (detail::DecideByEncodingDeclaration<bPhaseTimings>(prefix, prefixSize, prefixSize < sizeof(prefix), result))
+			{
+				ifs.seekg(-static_cast<std::streamoff>(prefixSize), std::ios::cur);
+				return result;
+			}
+			start = detail::PhaseTimestamp<bPhaseTimings>();
+		}
+		detail::MemoryReservation sampleReservation;
+		std::unique_ptr<detail::utf8_checking_unit_t[]> sampleTextBuffer;
+		{
+			detail::PhaseMetricsTimer phaseTimer(DetectionPhase::Read);
+			sampleTextBuffer = detail::ReadSampleToBuffer(ifs, allocBufferSize, result.sampleSize, sampleReservation, prefix, prefixSize);
+		}
+		detail::AddPhaseTicks<bPhaseTimings>(result.timings, DetectionPhase::Read, start);
+		if (sampleTextBuffer == nullptr)
+		{
+			detail::StreamSampleForResult<bPhaseTimings>(ifs, result, prefix, prefixSize);
+			return result;
+		}
+
+		detail::ValidateSampleForResult<bPhaseTimings>(sampleTextBuffer.get(), result.sampleSize, result);
+		return result;
+	}
+
+#if !defined(TEXT_CHARSET_DETECTION_HEADER_ONLY)
+	template DetectionResult DetectCharset<false>(std::ifstream& ifs);
+	template DetectionResult DetectCharset<true>(std::ifstream& ifs);
+#endif
+
+	template <bool bPhaseTimings>
+	TEXT_CHARSET_DETECTION_INLINE DetectionResult DetectBufferCharset(const unsigned char* buffer, size_t size)
+	{
+		DetectionResult result;
+		if constexpr (bPhaseTimings)
+			result.timings.detections = 1;
+		detail::AddMetric(detail::METRIC_FILES_PROCESSED, 1);
+
+		if (detail::DecideByBOM<bPhaseTimings>(buffer, size, result))
+			return result;
+		if (detail::DecideByEncodingDeclaration<bPhaseTimings>(buffer, std::min(size, detail::MARKUP_PRESCAN_SIZE), size <= detail::MARKUP_PRESCAN_SIZE, result))
+			return result;
+		const size_t sampleSize = detail::Tuning().sampleSize.load(std::memory_order_relaxed);
+		result.sampleSize = sampleSize == 0 || sampleSize > size ? size : sampleSize;
+		detail::ValidateSampleForResult<bPhaseTimings>(buffer, result.sampleSize, result);
+		return result;
+	}
+
+#if !defined(TEXT_CHARSET_DETECTION_HEADER_ONLY)
+	template DetectionResult DetectBufferCharset<false>(const unsigned char* buffer, size_t size);
+	template DetectionResult DetectBufferCharset<true>(const unsigned char* buffer, size_t size);
+#endif
+
+	TEXT_CHARSET_DETECTION_INLINE StreamingCharsetDetector::StreamingCharsetDetector(uint64_t sizeHint) : state(std::make_unique<detail::StreamingDetectorState>())
+	{
+		state->sampleSize = detail::Tuning().sampleSize.load(std::memory_order_relaxed);
+		// the BOM probe and the declaration prescan need the first MARKUP_PRESCAN_SIZE bytes in one piece, whatever the hint says
+		const size_t wantedLimit = state->sampleSize == 0 ? detail::MEMORY_BUDGET_STREAM_BLOCK_SIZE : state->sampleSize;
+		state->bufferLimit = static_cast<size_t>(std::min<uint64_t>(wantedLimit, std::max<uint64_t>(sizeHint, detail::MARKUP_PRESCAN_SIZE)));
+		if (!state->reservation.Reserve(state->bufferLimit, true))
+		{
+			state->bufferLimit = std::min(state->bufferLimit, detail::MEMORY_BUDGET_STREAM_BLOCK_SIZE);
+			state->reservation.Reserve(state->bufferLimit, false);
+		}
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE StreamingCharsetDetector::~StreamingCharsetDetector() = default;
+
+	TEXT_CHARSET_DETECTION_INLINE size_t StreamingCharsetDetector::Feed(const unsigned char* chunk, size_t size)
+	{
+		detail::StreamingDetectorState& s = *state;
+		if (s.bDone)
+			return 0;
+		const size_t taken = s.sampleSize == 0 ? size : std::min(size, s.sampleSize - s.fed);
+		size_t buffered = 0;
+		if (s.validation == nullptr)
+		{
+			// the buffer is filled before anything is decided, so that the BOM probe and the declaration prescan see the start
+			// of the input in one piece however it is chunked (the buffer holds at least MARKUP_PRESCAN_SIZE bytes if the
+			// sample can outgrow it)
+			buffered = std::min(taken, s.bufferLimit - s.buffer.size());
+			if (s.buffer.empty())
+				s.buffer.reserve(s.bufferLimit);
+			s.buffer.insert(s.buffer.end(), chunk, chunk + buffered);
+			s.fed += buffered;
+			if (buffered == taken)
+			{
+				s.bDone = s.sampleSize != 0 && s.fed == s.sampleSize;
+				return taken;
+			}
+
+			// the sample outgrows the buffer: the start of the input decides as in DetectBufferCharset(), or the buffer is the
+			// first block of a streamed validation
+			if (detail::DecideByBOM<false>(s.buffer.data(), s.buffer.size(), s.result)
+				|| detail::DecideByEncodingDeclaration<false>(s.buffer.data(), std::min(s.buffer.size(), detail::MARKUP_PRESCAN_SIZE), false, s.result))
+			{
+				s.bDecided = true;
+				s.bDone = true;
+				return buffered;
+			}
+			s.result.reason += "sample does not fit in its buffer of " + std::to_string(s.bufferLimit) + " bytes, validating it as it streams in\n";
+			s.validation = std::make_unique<detail::StreamedSampleValidation>(s.result);
+			const bool bValidating = s.validation->Feed(s.buffer.data(), s.buffer.size());
+			s.buffer.clear();
+			if (!bValidating)
+			{
+				s.bDone = true;
+				return buffered;
+			}
+		}
+		s.bDone = !s.validation->Feed(chunk + buffered, taken - buffered);
+		s.fed += taken - buffered;
+		s.bDone = s.bDone || (s.sampleSize != 0 && s.fed == s.sampleSize);
+		return taken;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE bool StreamingCharsetDetector::Done() const
+	{
+		return state->bDone;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE DetectionResult StreamingCharsetDetector::Finish(bool bInputEnded)
+	{
+		detail::StreamingDetectorState& s = *state;
+		// a buffered sample is counted by DetectBufferCharset()
+		if (s.validation != nullptr || s.bDecided)
+			detail::AddMetric(detail::METRIC_FILES_PROCESSED, 1);
+		if (s.validation != nullptr)
+			s.validation->Finish(bInputEnded);
+		else if (!s.bDecided)
+			s.result = DetectBufferCharset(s.buffer.data(), s.buffer.size());
+		s.bDone = true;
+		return std::move(s.result);
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE AsyncDetector::AsyncDetector(size_t threadCount, size_t maxQueueDepth) : state(std::make_unique<detail::AsyncDetectorState>())
+	{
+		if (threadCount == 0)
+			threadCount = std::max(1u, std::thread::hardware_concurrency());
+		state->maxQueueDepth = maxQueueDepth != 0 ? maxQueueDepth : threadCount * detail::ASYNC_QUEUE_DEPTH_PER_THREAD;
+		state->workers.reserve(threadCount);
+		try
+		{
+			for (size_t idx = 0; idx < threadCount; ++idx)
+				state->workers.emplace_back(&detail::AsyncDetectorState::Work, state.get());
+		}
+		catch (...)
+		{
+			// the workers already started have to be joined, destroying a joinable thread terminates
+			{
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->bStopping = true;
+			}
+			state->jobQueued.notify_all();
+			for (std::thread& worker : state->workers)
+				worker.join();
+			throw;
+		}
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE AsyncDetector::~AsyncDetector()
+	{
+		{
+			std::lock_guard<std::mutex> lock(state->mutex);
+			state->bStopping = true;
+		}
+		state->jobQueued.notify_all();
+		for (std::thread& worker : state->workers)
+			worker.join();
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE std::future<DetectionResult> AsyncDetector::Submit(const std::string& path)
+	{
+		auto promise = std::make_shared<std::promise<DetectionResult>>();
+		std::future<DetectionResult> future = promise->get_future();
+		state->Enqueue(detail::AsyncDetectionJob(detail::AsyncPathDetection(path), detail::AsyncPromiseHandler(promise)), true);
+		return future;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE void AsyncDetector::Submit(const std::string& path, detection_handler_t onDone)
+	{
+		state->Enqueue(detail::AsyncDetectionJob(detail::AsyncPathDetection(path), std::move(onDone)), true);
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE bool AsyncDetector::TrySubmit(const std::string& path, detection_handler_t onDone)
+	{
+		return state->Enqueue(detail::AsyncDetectionJob(detail::AsyncPathDetection(path), std::move(onDone)), false);
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE bool AsyncDetector::TrySubmit(const std::string& path, std::future<DetectionResult>& future)
+	{
+		auto promise = std::make_shared<std::promise<DetectionResult>>();
+		std::future<DetectionResult> newFuture = promise->get_future();
+		if (!TrySubmit(path, detail::AsyncPromiseHandler(promise)))
+			return false;
+		future = std::move(newFuture);
+		return true;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE std::future<DetectionResult> AsyncDetector::SubmitBuffer(std::vector<unsigned char> data)
+	{
+		auto promise = std::make_shared<std::promise<DetectionResult>>();
+		std::future<DetectionResult> future = promise->get_future();
+		SubmitBuffer(std::move(data), detail::AsyncPromiseHandler(promise));
+		return future;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE void AsyncDetector::SubmitBuffer(std::vector<unsigned char> data, detection_handler_t onDone)
+	{
+		state->Enqueue(detail::AsyncDetectionJob(detail::AsyncBufferDetection(std::move(data)), std::move(onDone)), true);
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE bool AsyncDetector::TrySubmitBuffer(std::vector<unsigned char>& data, detection_handler_t onDone)
+	{
+		// the job is only built (data moved into it) once there is room in the queue and in the memory budget, under the lock
+		{
+			std::lock_guard<std::mutex> lock(state->mutex);
+			if (state->jobs.size() >= state->maxQueueDepth)
+				return false;
+			if (!detail::MemoryReservation::HasRoom(data.size()))
+				return false;
+			state->jobs.push_back(detail::AsyncDetectionJob(detail::AsyncBufferDetection(std::move(data)), std::move(onDone)));
+		}
+		state->jobQueued.notify_one();
+		return true;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE bool AsyncDetector::TrySubmitBuffer(std::vector<unsigned char>& data, std::future<DetectionResult>& future)
+	{
+		auto promise = std::make_shared<std::promise<DetectionResult>>();
+		std::future<DetectionResult> newFuture = promise->get_future();
+		if (!TrySubmitBuffer(data, detail::AsyncPromiseHandler(promise)))
+			return false;
+		future = std::move(newFuture);
+		return true;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE size_t AsyncDetector::QueueDepth() const
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+		return state->jobs.size();
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE size_t AsyncDetector::MaxQueueDepth() const
+	{
+		return state->maxQueueDepth;
+	}
+
+	TEXT_CHARSET_DETECTION_INLINE size_t AsyncDetector::ThreadCount() const
+	{
+		return state->workers.size();
+	}
+
 } // namespace text_charset_detection
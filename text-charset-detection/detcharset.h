@@ -1,12 +1,446 @@
+#pragma once
+
+// header-only mode: define TEXT_CHARSET_DETECTION_HEADER_ONLY before including this header (and do not build or link
+// detcharset.cpp), every function becomes inline, so validation can be inlined into the caller's loops
+#if defined(TEXT_CHARSET_DETECTION_HEADER_ONLY)
+#define TEXT_CHARSET_DETECTION_INLINE inline
+#else
+#define TEXT_CHARSET_DETECTION_INLINE
+#endif
+
 #include <fstream>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <span>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace text_charset_detection
 
 {
 	
 	bool CheckStreamForUTF8NoBOM(std::ifstream& ifs, std::string& reason);
+	bool CheckBufferForUTF8NoBOM(const unsigned char* buffer, size_t size, std::string& reason);		// same as CheckStreamForUTF8NoBOM(), on a sample that is already in memory
+	// plain validity check for many short strings: no reason text, no sampling, no metrics; unlike CheckBufferForUTF8NoBOM()
+	// 7-bit ASCII is valid, control chars other than TAB, CR, LF are not
+	bool IsValidUTF8(const unsigned char* buffer, size_t size);
+	// length of the longest valid prefix (in the sense of IsValidUTF8()), i.e. the offset of the first error, size if none
+	size_t ValidUTF8PrefixSize(const unsigned char* buffer, size_t size);
+	// largest char boundary <= maxSize, for cutting text without splitting a char (found by stepping back over at most
+	// 3 continuation bytes, the text is not validated; with invalid text it is the boundary of the bytes as they stand)
+	size_t UTF8TruncationSize(const unsigned char* buffer, size_t size, size_t maxSize);
+	// offsets of chunkCount nearly equal chunks for parallel processing: {0, ..., size}, chunk i is [offsets[i], offsets[i + 1])
+	// split points never cut a char, with bPreferNewlines they go right after a newline if there is one soon after the even
+	// split point; chunks that would become empty are dropped, so there may be fewer than chunkCount
+	std::vector<size_t> SplitUTF8Chunks(const unsigned char* buffer, size_t size, size_t chunkCount, bool bPreferNewlines = true);
+	// IsValidUTF8() of every row of an Arrow-style string column: row i is data[offsets[i], offsets[i + 1]), offsets has
+	// rowCount + 1 non-decreasing entries (std::out_of_range otherwise); bit i of validityBitmap (LSB first, (rowCount + 7) / 8
+	// bytes, unused bits of the last byte cleared) is set if row i is valid; returns the number of invalid rows
+	// the offsets are all checked before the data is read; then the blob is scanned once, 7-bit ASCII word by word across
+	// row boundaries, other chars one by one within their row
+	template <typename offset_t>
+	size_t ValidateUTF8Batch(const unsigned char* data, size_t dataSize, const offset_t* offsets, size_t rowCount, uint8_t* validityBitmap);
+#if !defined(TEXT_CHARSET_DETECTION_HEADER_ONLY)
+	extern template size_t ValidateUTF8Batch<int32_t>(const unsigned char* data, size_t dataSize, const int32_t* offsets, size_t rowCount, uint8_t* validityBitmap);
+	extern template size_t ValidateUTF8Batch<int64_t>(const unsigned char* data, size_t dataSize, const int64_t* offsets, size_t rowCount, uint8_t* validityBitmap);
+#endif
 	bool CheckStreamForUTF8BOM(std::ifstream& ifs, std::string& reason);
 	bool CheckStreamForUTF16BOM(std::ifstream& ifs, std::string& reason, bool& bLittleEndian);
 
-}
\ No newline at end of file
+	constexpr size_t UTF8_NO_ERROR_OFFSET = static_cast<size_t>(-1);
+
+	// IsValidUTF8() of a payload that arrives in segments (network buffer chains, iovecs), without linearising it:
+	// chars split by a segment boundary are carried over, so the verdict and the first error offset are the same as those
+	// of the concatenated payload; Feed() the segments in order, then Finish()
+	class UTF8StreamValidator
+	{
+	public:
+		bool Feed(const unsigned char* segment, size_t size);		// false once an invalid char was found (further input is ignored)
+		bool Finish();												// final verdict, an incomplete char at the end is invalid
+		size_t FirstErrorOffset() const;							// offset in the payload, UTF8_NO_ERROR_OFFSET if none (yet)
+		size_t BytesFed() const;
+		void Reset();
+	private:
+		static constexpr size_t MAX_CARRY_SIZE = 3;					// the last bytes of a segment when fewer than a char's maximum size
+		unsigned char carry[MAX_CARRY_SIZE] = {};
+		size_t carrySize = 0;
+		size_t bytesFed = 0;
+		size_t firstErrorOffset = UTF8_NO_ERROR_OFFSET;
+	};
+	// the same in one call for a span of segments, e.g. built from an iovec array
+	bool IsValidUTF8(std::span<const std::span<const unsigned char>> segments, size_t* firstErrorOffset = nullptr);
+
+	// kinds of UTF-8 errors the detailed error list (see UTF8_DETAILED_ERROR_LIST) tells apart
+	enum class UTF8ErrorClass { InvalidLeadingByte, TruncatedSequence, MissingContinuation, ControlChar, Overlong2Bytes, Overlong3Bytes, SurrogateHalf, Overlong4Bytes, InvalidCodePointF4, InvalidCodePointNonF4, Unknown, Count };
+
+	// every UTF-8 error of a payload that arrives in chunks (not just the first one as with UTF8StreamValidator): chars split
+	// by a chunk boundary are carried over, nothing else is copied; scanning resumes after each error
+	struct UTF8ErrorEvent
+	{
+		size_t offset = 0;								// in the payload
+		size_t length = 0;								// bytes the error covers, 1 or more
+		UTF8ErrorClass errorClass = UTF8ErrorClass::Unknown;
+		std::string description;						// in the words of the reason of CheckBufferForUTF8NoBOM(), with the payload offset
+	};
+	class UTF8ErrorScanner
+	{
+	public:
+		void Feed(const unsigned char* chunk, size_t size);			// chunk has to stay valid until NextError() returns false
+		void Finish();												// end of the payload, the carried bytes are scanned as its end
+		bool NextError(UTF8ErrorEvent& event);						// errors found lazily, false once the fed bytes are used up
+		size_t BytesFed() const;
+	private:
+		static constexpr size_t LOOKAHEAD_SIZE = 8;					// an error is only described with this many bytes (or the payload end) after its start
+		unsigned char carry[LOOKAHEAD_SIZE - 1] = {};
+		size_t carrySize = 0;
+		std::vector<UTF8ErrorEvent> carryErrors;					// found in the carry joined with the next chunk, reported first
+		size_t carryErrorsReported = 0;
+		const unsigned char* chunkStart = nullptr;
+		const unsigned char* chunkPos = nullptr;
+		const unsigned char* chunkEnd = nullptr;
+		size_t bytesFed = 0;
+	};
+
+	// coroutine interface of UTF8ErrorScanner: ScanUTF8Errors() awaits the chunks of an async byte source and yields the
+	// errors lazily, a consumer coroutine awaits them one by one, no threads and no callbacks involved:
+	//		UTF8ErrorEventStream errors = ScanUTF8Errors(source);
+	//		while (const UTF8ErrorEvent* error = co_await errors.Next())
+	//			...
+	// source: co_await source.Next() gives the next chunk as something convertible to std::span<const unsigned char>, an empty
+	// one at the end of the payload; a chunk has to stay valid until the next source.Next() call
+	// the event pointer is valid until the next Next(); exceptions of the source are rethrown by co_await Next()
+	class UTF8ErrorEventStream
+	{
+	public:
+		struct promise_type
+		{
+			const UTF8ErrorEvent* current = nullptr;
+			std::coroutine_handle<> consumer;
+			std::exception_ptr exception;
+
+			// symmetric transfer back to the consumer on yield and at the end, no recursion however long the stream
+			struct ConsumerResumption
+			{
+				bool await_ready() noexcept { return false; }
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> scanner) noexcept { return scanner.promise().consumer; }
+				void await_resume() noexcept {}
+			};
+			UTF8ErrorEventStream get_return_object() { return UTF8ErrorEventStream(std::coroutine_handle<promise_type>::from_promise(*this)); }
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			ConsumerResumption final_suspend() noexcept { current = nullptr; return {}; }
+			ConsumerResumption yield_value(const UTF8ErrorEvent& event) noexcept { current = &event; return {}; }
+			void return_void() {}
+			void unhandled_exception() { exception = std::current_exception(); }
+		};
+		struct NextAwaiter
+		{
+			std::coroutine_handle<promise_type> scanner;
+			bool await_ready() noexcept { return !scanner || scanner.done(); }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> consumer) noexcept
+			{
+				scanner.promise().consumer = consumer;
+				return scanner;
+			}
+			const UTF8ErrorEvent* await_resume()
+			{
+				if (!scanner)
+					return nullptr;
+				if (scanner.promise().exception)
+					std::rethrow_exception(std::exchange(scanner.promise().exception, nullptr));
+				return scanner.done() ? nullptr : scanner.promise().current;
+			}
+		};
+
+		UTF8ErrorEventStream(UTF8ErrorEventStream&& other) noexcept : scanner(std::exchange(other.scanner, nullptr)) {}
+		UTF8ErrorEventStream& operator=(UTF8ErrorEventStream&& other) noexcept
+		{
+			if (this != &other)
+			{
+				if (scanner)
+					scanner.destroy();
+				scanner = std::exchange(other.scanner, nullptr);
+			}
+			return *this;
+		}
+		~UTF8ErrorEventStream()
+		{
+			if (scanner)
+				scanner.destroy();
+		}
+		NextAwaiter Next() { return NextAwaiter{ scanner }; }		// nullptr once the payload is scanned
+	private:
+		explicit UTF8ErrorEventStream(std::coroutine_handle<promise_type> scanner) : scanner(scanner) {}
+		std::coroutine_handle<promise_type> scanner;
+	};
+
+	template <typename source_t>
+	UTF8ErrorEventStream ScanUTF8Errors(source_t& source)
+	{
+		UTF8ErrorScanner errorScanner;
+		UTF8ErrorEvent event;
+		for (;;)
+		{
+			const std::span<const unsigned char> chunk = co_await source.Next();
+			if (chunk.empty())
+				break;
+			errorScanner.Feed(chunk.data(), chunk.size());
+			while (errorScanner.NextError(event))
+				co_yield event;
+		}
+		errorScanner.Finish();
+		while (errorScanner.NextError(event))
+			co_yield event;
+	}
+
+	// sparse char and line index of a large UTF-8 file, for random access by char or line number without decoding from the
+	// start: the byte offset of every stride-th char and of the start of every stride-th line, recorded in the validation pass
+	struct UTF8OffsetIndex
+	{
+		uint64_t stride = 0;
+		uint64_t byteSize = 0;							// of the indexed file, a sidecar of a file of another size is stale
+		uint64_t charCount = 0;
+		uint64_t lineCount = 0;							// '\n' count + 1
+		std::vector<uint64_t> charOffsets;				// charOffsets[k]: byte offset of char k * stride, charOffsets[0] = 0 even if empty
+		std::vector<uint64_t> lineOffsets;				// lineOffsets[k]: byte offset of line k * stride
+	};
+	// reads ifs from position 0 to its end in blocks; the whole file has to be valid in the sense of IsValidUTF8(), the
+	// first error offset goes to reason otherwise
+	bool BuildUTF8OffsetIndex(std::ifstream& ifs, uint64_t stride, UTF8OffsetIndex& index, std::string& reason);
+	// sidecar format: magic "DCSIDX01", then little-endian uint64 fields stride, byteSize, charCount, lineCount,
+	// charOffsets.size(), lineOffsets.size(), charOffsets, lineOffsets
+	std::vector<unsigned char> SerializeUTF8OffsetIndex(const UTF8OffsetIndex& index);
+	bool WriteUTF8OffsetIndex(const std::string& path, const UTF8OffsetIndex& index, std::string& reason);	// replaces path atomically
+	struct UTF8IndexCheckpoint
+	{
+		uint64_t byteOffset;
+		uint64_t index;									// char or line number at byteOffset
+	};
+	// queries a serialised index in place, e.g. a memory mapped sidecar (nothing is copied, no alignment needed): a seek
+	// gives the nearest checkpoint at or before the target, from there at most stride - 1 chars (see SkipUTF8Chars()) or
+	// lines are left to skip in the text
+	class UTF8OffsetIndexView
+	{
+	public:
+		bool Attach(const void* data, size_t size, std::string& reason);		// data has to outlive the view
+		uint64_t Stride() const;
+		uint64_t ByteSize() const;
+		uint64_t CharCount() const;
+		uint64_t LineCount() const;
+		UTF8IndexCheckpoint CharCheckpoint(uint64_t charIndex) const;			// charIndex <= CharCount(), std::out_of_range otherwise
+		UTF8IndexCheckpoint LineCheckpoint(uint64_t lineIndex) const;			// lineIndex < LineCount(), std::out_of_range otherwise
+	private:
+		uint64_t stride = 0;
+		uint64_t byteSize = 0;
+		uint64_t charCount = 0;
+		uint64_t lineCount = 0;
+		const unsigned char* charOffsets = nullptr;
+		size_t charOffsetCount = 0;
+		const unsigned char* lineOffsets = nullptr;
+		size_t lineOffsetCount = 0;
+	};
+	// byte offset of the char charCount chars after buffer start (size if there are fewer), the text is not validated
+	size_t SkipUTF8Chars(const unsigned char* buffer, size_t size, uint64_t charCount);
+
+	// differential checking for canary deployments of faster engines: a fraction of CheckBufferForUTF8NoBOM() calls (and so
+	// CheckStreamForUTF8NoBOM() calls) on the fast path is repeated with the reference engine (buffer-end checks on every char),
+	// verdicts and first error offsets are compared over the bytes the fast engine covered
+	struct ShadowValidationMismatch
+	{
+		std::string engine;								// engine that produced the returned verdict
+		bool bEngineValidUTF8;
+		size_t engineFirstErrorOffset;					// UTF8_NO_ERROR_OFFSET if none
+		bool bReferenceValidUTF8;
+		size_t referenceFirstErrorOffset;				// UTF8_NO_ERROR_OFFSET if none within coveredSize
+		size_t coveredSize;								// compared prefix of input
+		std::vector<unsigned char> input;				// whole buffer the engines were given
+	};
+	typedef std::function<void(const ShadowValidationMismatch&)> shadow_mismatch_handler_t;
+	struct ShadowValidationStats
+	{
+		uint64_t calls;									// fast path calls seen while shadowing was on
+		uint64_t shadowed;
+		uint64_t mismatches;
+		uint64_t shadowNanoseconds;						// time spent in the reference engine, i.e. the overhead
+	};
+	void SetShadowValidation(double sampleFraction, shadow_mismatch_handler_t onMismatch);		// 0 turns it off; the handler may be called from any detecting thread
+	ShadowValidationStats GetShadowValidationStats();
+	shadow_mismatch_handler_t MakeShadowMismatchDumper(const std::string& directory);			// writes <directory>/shadow-mismatch-*.bin (input) and .txt (verdicts)
+
+	// process wide detection metrics: every thread counts into its own slot, GetDetectionMetrics() sums the slots up
+	// rates (bytes/s, files/s) are left to the consumer, e.g. rate(detcharset_bytes_validated_total[1m]) in Prometheus
+	enum class DetectionVerdict { ASCII7, UTF8, NotUTF8, Count };
+	enum class DetectionPhase { Read, BOMProbe, Validation, ErrorFormatting, Count };		// ErrorFormatting: only split out of Validation by DetectCharset<true>
+	struct DetectionMetrics
+	{
+		uint64_t bytesValidated;												// input of CheckBufferForUTF8NoBOM(), including the stream samples
+		uint64_t filesProcessed;												// detected inputs, however decided: CheckStreamForUTF8NoBOM(), DetectCharset(), DetectBufferCharset(), StreamingCharsetDetector
+		uint64_t verdicts[static_cast<size_t>(DetectionVerdict::Count)];
+		uint64_t utf8Errors[static_cast<size_t>(UTF8ErrorClass::Count)];		// classified by the detailed error list (see UTF8_DETAILED_ERROR_LIST)
+		uint64_t phaseNanoseconds[static_cast<size_t>(DetectionPhase::Count)];
+	};
+	const char* DetectionVerdictName(DetectionVerdict verdict);
+	const char* UTF8ErrorClassName(UTF8ErrorClass errorClass);
+	const char* DetectionPhaseName(DetectionPhase phase);
+	DetectionMetrics GetDetectionMetrics();
+	std::string FormatPrometheusMetrics(const DetectionMetrics& metrics);		// Prometheus text exposition format
+	bool WritePrometheusMetrics(const std::string& path, std::string& reason);	// replaces path atomically, suits the node_exporter textfile collector
+
+	// per-phase time of single detections, PhaseTimings of a batch can be summed up with +=
+	struct PhaseTimings
+	{
+		uint64_t ticks[static_cast<size_t>(DetectionPhase::Count)] = {};		// see PhaseTimingTicksPerSecond()
+		uint64_t detections = 0;												// number of timed detections summed up
+		PhaseTimings& operator+=(const PhaseTimings& other);
+		double Seconds(DetectionPhase phase) const;
+	};
+	double PhaseTimingTicksPerSecond();			// time stamp counter rate where available (measured once, takes 10 ms), 1e9 otherwise
+
+	enum class DetectedCharset { Unknown, ASCII7, UTF8, UTF8BOM, UTF16LE, UTF16BE };
+	const char* DetectedCharsetName(DetectedCharset charset);
+
+	// encoding declared by markup in its first MARKUP_PRESCAN_SIZE (1024) bytes: <?xml ... encoding="..."?> or
+	// @charset "..."; (CSS) at the very start, or <meta charset="..."> / <meta http-equiv="Content-Type" content="...;
+	// charset=..."> in a document starting with a tag (HTML, a WHATWG-style prescan, comments and other tags skipped)
+	enum class EncodingDeclarationSource { None, XMLProlog, CSSCharsetRule, HTMLMeta };
+	const char* EncodingDeclarationSourceName(EncodingDeclarationSource source);
+	struct EncodingDeclaration
+	{
+		EncodingDeclarationSource source = EncodingDeclarationSource::None;
+		std::string label;								// lowercased, spaces trimmed
+		size_t offset = 0;								// of the declaring construct
+	};
+	EncodingDeclaration PrescanEncodingDeclaration(const unsigned char* buffer, size_t size);
+
+	struct DetectionResult
+	{
+		DetectedCharset charset = DetectedCharset::Unknown;
+		bool bValidUTF8 = false;								// of the sample, only set when there was no BOM
+		size_t firstErrorOffset = UTF8_NO_ERROR_OFFSET;			// in the sample
+		size_t sampleSize = 0;									// bytes validated, 0 when a BOM decided
+		EncodingDeclaration declaration;						// found when there was no BOM (a BOM takes precedence, as in WHATWG)
+		std::string reason;
+		PhaseTimings timings;									// all 0 unless detected with bPhaseTimings
+	};
+	// BOM probing, then UTF-8 validation of a sample; stream has to be at 0 reading position
+	// an encoding declaration the first bytes agree with decides without validating the rest of the sample: a declared
+	// UTF-8 label with valid first bytes gives UTF8, any other label with invalid first bytes gives Unknown (otherwise the
+	// declaration is only recorded, the sample is validated as usual)
+	// bPhaseTimings: fills DetectionResult::timings (a couple of time stamp counter reads per phase), no timing code otherwise
+	template <bool bPhaseTimings = false>
+	DetectionResult DetectCharset(std::ifstream& ifs);
+#if !defined(TEXT_CHARSET_DETECTION_HEADER_ONLY)
+	extern template DetectionResult DetectCharset<false>(std::ifstream& ifs);
+	extern template DetectionResult DetectCharset<true>(std::ifstream& ifs);
+#endif
+	// DetectCharset() of data already in memory, validates the first GetTuningProfile().sampleSize bytes
+	template <bool bPhaseTimings = false>
+	DetectionResult DetectBufferCharset(const unsigned char* buffer, size_t size);
+#if !defined(TEXT_CHARSET_DETECTION_HEADER_ONLY)
+	extern template DetectionResult DetectBufferCharset<false>(const unsigned char* buffer, size_t size);
+	extern template DetectionResult DetectBufferCharset<true>(const unsigned char* buffer, size_t size);
+#endif
+	namespace detail { struct StreamingDetectorState; }
+	// DetectBufferCharset() of input that arrives in chunks (archive members, decompressed or received data), in memory
+	// bounded by the sample size whatever size the input has or claims: the sample is buffered (reserved against the memory
+	// budget, the result is the same as DetectBufferCharset()'s then); a sample over the buffer, which is only a stream block
+	// (64 KiB) with sample size 0 or when the budget says to stream, is decided by a BOM or declaration at its start or
+	// validated as it streams in past the buffer, as by DetectCharset()
+	// sizeHint: the input size if it is known, a smaller buffer is enough for a small input (an input larger than it said
+	// is still detected correctly)
+	// Feed() the chunks in order until Done() or the end of the input, then Finish() once
+	class StreamingCharsetDetector
+	{
+	public:
+		explicit StreamingCharsetDetector(uint64_t sizeHint = UINT64_MAX);
+		~StreamingCharsetDetector();
+		StreamingCharsetDetector(const StreamingCharsetDetector&) = delete;
+		StreamingCharsetDetector& operator=(const StreamingCharsetDetector&) = delete;
+		size_t Feed(const unsigned char* chunk, size_t size);			// bytes taken, fewer than size once Done()
+		bool Done() const;												// the sample is complete or decided, the rest of the input is not needed
+		DetectionResult Finish(bool bInputEnded);						// bInputEnded: all of the input was fed, its last char is checked as its end
+	private:
+		std::unique_ptr<detail::StreamingDetectorState> state;
+	};
+
+	namespace detail { struct AsyncDetectorState; }
+	// detection off the caller's thread, e.g. of an event loop: jobs wait in a bounded queue for a fixed set of worker
+	// threads (threadCount 0: hardware concurrency, maxQueueDepth 0: ASYNC_QUEUE_DEPTH_PER_THREAD per thread)
+	// backpressure: Submit*() blocks while the queue is full, TrySubmit*() returns false instead (TrySubmitBuffer() also while
+	// the memory budget has no room for the buffer, see SetMemoryBudget()); a reactor should use those, with a handler or
+	// with a future it polls
+	// a job completes through its future or handler; the handler runs on a worker thread, gets bDetected false (and the
+	// error in result.reason) if the file could not be opened or detection threw, it must not throw itself and must not
+	// call the blocking Submit*() (the queue may be full of jobs only the workers can drain); futures carry such failures
+	// as std::runtime_error; the destructor completes the jobs already queued, then joins the workers
+	class AsyncDetector
+	{
+	public:
+		typedef std::function<void(bool bDetected, const DetectionResult& result)> detection_handler_t;
+		explicit AsyncDetector(size_t threadCount = 0, size_t maxQueueDepth = 0);
+		~AsyncDetector();
+		AsyncDetector(const AsyncDetector&) = delete;
+		AsyncDetector& operator=(const AsyncDetector&) = delete;
+		std::future<DetectionResult> Submit(const std::string& path);									// DetectCharset() of the file
+		void Submit(const std::string& path, detection_handler_t onDone);
+		bool TrySubmit(const std::string& path, detection_handler_t onDone);
+		bool TrySubmit(const std::string& path, std::future<DetectionResult>& future);					// future is set only if accepted
+		std::future<DetectionResult> SubmitBuffer(std::vector<unsigned char> data);						// DetectBufferCharset()
+		void SubmitBuffer(std::vector<unsigned char> data, detection_handler_t onDone);
+		bool TrySubmitBuffer(std::vector<unsigned char>& data, detection_handler_t onDone);				// data is moved from only if accepted
+		bool TrySubmitBuffer(std::vector<unsigned char>& data, std::future<DetectionResult>& future);		// the same, future is set only if accepted
+		size_t QueueDepth() const;												// jobs waiting, not counting the ones being detected
+		size_t MaxQueueDepth() const;
+		size_t ThreadCount() const;
+	private:
+		std::unique_ptr<detail::AsyncDetectorState> state;
+	};
+
+	// process wide bound on the sample buffers of CheckStreamForUTF8NoBOM(), DetectCharset() and StreamingCharsetDetector
+	// (so of AsyncDetector path jobs, the archive and gzip readers and the CLI too): each sample buffer is reserved against
+	// the budget for the time of its detection; a detection whose sample does not fit waits for others to release theirs
+	// (Block) or validates its sample block by block in a small buffer, which is reserved as well (Stream); a sample larger
+	// than the whole budget is streamed in either mode
+	// a streamed sample is validated to its end (but for a char cut off there), its errors are described and counted as in a
+	// buffered one
+	// an AsyncDetector buffer job reserves the whole buffer while a worker detects it, waiting for memory in either mode (a
+	// buffer already in memory cannot be streamed); queued buffers are bounded by the queue depth, not reserved, so that no
+	// worker waits for memory only queued jobs could give back; TrySubmitBuffer() returns false if the buffer does not fit now;
+	// only DetectBufferCharset() and CheckBufferForUTF8NoBOM() of the caller's own buffers are not covered
+	enum class MemoryBudgetMode { Block, Stream };
+	// limitBytes 0: no budget (the default); std::invalid_argument if below the stream block size (64 KiB)
+	// lowering it does not take back buffers already reserved, detections wait until enough of them are released
+	void SetMemoryBudget(size_t limitBytes, MemoryBudgetMode mode = MemoryBudgetMode::Block);
+	struct MemoryBudgetStats
+	{
+		size_t limitBytes;								// 0: no budget, nothing is accounted then
+		MemoryBudgetMode mode;
+		size_t inUseBytes;
+		size_t peakBytes;								// since the process started
+		uint64_t waits;									// detections that had to wait for memory
+		uint64_t streamedSamples;						// detections that validated their sample in blocks
+	};
+	MemoryBudgetStats GetMemoryBudgetStats();
+
+	// size thresholds of CheckStreamForUTF8NoBOM(), host specific optimum can be measured by tools/detcharset_calibrate
+	// a profile file named by the DETCHARSET_TUNING_PROFILE environment variable is applied on first use
+	struct TuningProfile
+	{
+		size_t sampleSize;				// how many bytes to read from the beginning of a text file, 0 means whole file
+		size_t tinyModeSizeLimit;		// samples shorter than this are checked with interleaved buffer-end checks
+	};
+	TuningProfile DefaultTuningProfile();
+	TuningProfile GetTuningProfile();
+	void SetTuningProfile(const TuningProfile& profile);
+	bool LoadTuningProfile(const std::string& path, TuningProfile& profile, std::string& reason);
+	bool SaveTuningProfile(const std::string& path, const TuningProfile& profile, std::string& reason);
+
+}
+
+#if defined(TEXT_CHARSET_DETECTION_HEADER_ONLY)
+#include "detcharset.cpp"
+#endif
@@ -0,0 +1,422 @@
+// Coverage-guided differential fuzz target: every validation engine must agree with the reference engine on arbitrary input.
+//
+// libFuzzer (clang):	clang++ -g -O1 -std=c++20 -fsanitize=fuzzer,address,undefined fuzz_engines.cpp -o fuzz_engines
+//						./fuzz_engines [-max_len=65536] CORPUS_DIR
+// Standalone (any compiler, replays inputs or runs mutated random corpora):
+//						g++ -g -O1 -std=c++20 -DDETCHARSET_FUZZ_STANDALONE -fsanitize=address,undefined fuzz_engines.cpp -o fuzz_engines
+//						./fuzz_engines FILE|DIR...   or   ./fuzz_engines --random 10000 [--seed 1]
+//
+// Checked per input, a failure prints the finding and aborts (libFuzzer then saves the crashing input):
+//	- non-tiny engine (no buffer-end checks) vs reference (tiny engine, every read bounds-checked): verdict and first error
+//	  offset over the bytes the non-tiny engine covers, 7-bit ASCII flag of valid input against its definition
+//	- CheckBufferForUTF8NoBOM() vs the engine it dispatches to for the input size, IsValidUTF8() vs the reference
+//	- ValidUTF8PrefixSize() vs the reference, UTF8TruncationSize() on valid input: char boundary, none larger below the limit
+//	- ValidateUTF8Batch() vs IsValidUTF8() row by row, the input cut into rows at pseudo-random points
+//	- SplitUTF8Chunks(): offsets from 0 to size, strictly increasing, no split inside a char of valid input
+//	- SkipUTF8Chars() vs counting char starts byte by byte; the input as an offset index sidecar: UTF8OffsetIndexView::Attach()
+//	  rejects it or every checkpoint lookup stays inside the buffer
+//	- PrescanEncodingDeclaration(): stays inside the buffer, a declaration found starts inside it
+//	- segmented IsValidUTF8() (UTF8StreamValidator) vs the reference, the input cut into segments at pseudo-random points
+//	- UTF8ErrorScanner: first error at the reference's, every event inside the input and after the previous one, the same
+//	  events for the same segments as for the whole input in one chunk
+//	- UTF8CheckErrors() from every error position the reference reports: makes progress, stays inside the buffer and
+//	  explains itself in reason
+//	- DetectTarMembersCharset() on the input as an archive, and on an archive of one member holding the input whose header
+//	  claims its size or one taken from the input (up to 2^63, octal or base-256), with the default and a 0 sample size:
+//	  nothing allocated by the claimed size, a member of its claimed size detected as by DetectBufferCharset()
+// The engines read up to UTF8_MAX_CHAR_SIZE - 1 bytes past their stop position by design, so inputs are copied to an exactly
+// sized heap buffer first: any read past the real end is reported by AddressSanitizer.
+
+// the engines live in detail:: of the translation unit, pull it in directly instead of linking
+#include "../detcharset.cpp"
+#include "../detarchive.cpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+using namespace text_charset_detection;
+
+namespace
+{
+	using detail::utf8_checking_unit_t;
+
+	void Fail(const char* what, size_t size, size_t expected, size_t actual)
+	{
+		std::fprintf(stderr, "fuzz_engines: %s (input size %zu, expected %zu, got %zu)\n", what, size, expected, actual);
+		std::abort();
+	}
+
+	void CheckEqual(const char* what, size_t size, size_t expected, size_t actual)
+	{
+		if (expected != actual)
+			Fail(what, size, expected, actual);
+	}
+
+	struct EngineResult
+	{
+		bool bValidUTF8;
+		bool b7bitASCIIOnly;
+		size_t firstErrorOffset;
+		std::string reason;
+	};
+
+	template <bool bBufferEndCheck>
+	EngineResult RunEngine(const utf8_checking_unit_t* bufferStart, size_t coveredSize)
+	{
+		EngineResult result;
+		detail::CheckStreamForUTF8NoBOMInternal<bBufferEndCheck>(bufferStart, bufferStart + coveredSize, result.bValidUTF8, result.b7bitASCIIOnly, result.firstErrorOffset, result.reason);
+		return result;
+	}
+
+	// 7-bit ASCII flag of a prefix, straight from the definition
+	bool ASCII7Prefix(const utf8_checking_unit_t* bufferStart, size_t size)
+	{
+		for (size_t idx = 0; idx < size; ++idx)
+			if (!detail::UTF8CharASCII7(bufferStart + idx))
+				return false;
+		return true;
+	}
+
+	void CheckErrorClassifier(const utf8_checking_unit_t* bufferStart, size_t size, size_t errorOffset)
+	{
+		const utf8_checking_unit_t* ucharPtr = bufferStart + errorOffset;
+		std::string reason;
+		detail::UTF8CheckErrors(ucharPtr, bufferStart, bufferStart + size, reason);
+		if (ucharPtr <= bufferStart + errorOffset)
+			Fail("UTF8CheckErrors() made no progress", size, errorOffset, ucharPtr - bufferStart);
+		if (ucharPtr > bufferStart + size)
+			Fail("UTF8CheckErrors() stepped past the buffer end", size, size, ucharPtr - bufferStart);
+		if (reason.empty())
+			Fail("UTF8CheckErrors() gave no reason", size, errorOffset, 0);
+	}
+
+	// ustar header of one regular file, sizes past the octal field go base-256 as GNU tar writes them
+	std::string TarArchiveOf(const uint8_t* data, size_t size, uint64_t claimedSize)
+	{
+		unsigned char header[detail::TAR_BLOCK_SIZE] = {};
+		std::memcpy(header + detail::TAR_NAME, "member", 6);
+		if (claimedSize >> 33 == 0)
+			std::snprintf(reinterpret_cast<char*>(header + detail::TAR_SIZE), detail::TAR_SIZE_SIZE, "%011llo", static_cast<unsigned long long>(claimedSize));
+		else
+		{
+			header[detail::TAR_SIZE] = 0x80;
+			for (size_t idx = 0; idx < sizeof(claimedSize); ++idx)
+				header[detail::TAR_SIZE + detail::TAR_SIZE_SIZE - 1 - idx] = static_cast<unsigned char>(claimedSize >> (8 * idx));
+		}
+		header[detail::TAR_TYPE] = '0';
+		std::memcpy(header + detail::TAR_MAGIC, "ustar\0" "00", 8);
+		std::memset(header + detail::TAR_CHECKSUM, ' ', detail::TAR_CHECKSUM_SIZE);
+		unsigned checksum = 0;
+		for (const unsigned char byte : header)
+			checksum += byte;
+		std::snprintf(reinterpret_cast<char*>(header + detail::TAR_CHECKSUM), detail::TAR_CHECKSUM_SIZE, "%06o", checksum);
+		std::string archive(reinterpret_cast<const char*>(header), sizeof(header));
+		archive.append(reinterpret_cast<const char*>(data), size);
+		archive.append(detail::TarPadding(size) + 2 * detail::TAR_BLOCK_SIZE, '\0');
+		return archive;
+	}
+
+	void CheckTarReader(const uint8_t* data, size_t size)
+	{
+		const DetectionResult expected = DetectBufferCharset(data, size);
+		std::vector<ArchiveMemberResult> members;
+		const archive_member_handler_t onMember = [&members](const ArchiveMemberResult& member) { members.push_back(member); };
+		std::string reason;
+		{
+			std::istringstream archive(std::string(reinterpret_cast<const char*>(data), size));
+			(void)DetectTarMembersCharset(archive, onMember, reason);
+		}
+
+		const uint64_t claimedSize = size >= 9 && data[0] % 2 == 1 ? detail::LoadLittleEndian64(data + 1) >> (data[0] / 2 % 64) >> 1 : size;
+		std::istringstream archive(TarArchiveOf(data, size, claimedSize));
+		members.clear();
+		const bool bIntact = DetectTarMembersCharset(archive, onMember, reason);
+		if (claimedSize != size)
+			return;
+		CheckEqual("DetectTarMembersCharset(): intact archive", size, true, bIntact);
+		CheckEqual("DetectTarMembersCharset(): member count", size, 1, members.size());
+		CheckEqual("DetectTarMembersCharset(): member vs DetectBufferCharset() charset", size, static_cast<size_t>(expected.charset), static_cast<size_t>(members[0].detection.charset));
+		CheckEqual("DetectTarMembersCharset(): member vs DetectBufferCharset() first error", size, expected.firstErrorOffset, members[0].detection.firstErrorOffset);
+	}
+
+	void CheckInput(const uint8_t* data, size_t size)
+	{
+		const std::unique_ptr<utf8_checking_unit_t[]> buffer(new utf8_checking_unit_t[size == 0 ? 1 : size]);
+		std::memcpy(buffer.get(), data, size);
+		const utf8_checking_unit_t* const bufferStart = buffer.get();
+
+		// reference over the whole buffer
+		const EngineResult reference = RunEngine<true>(bufferStart, size);
+		CheckEqual("reference: verdict vs first error offset", size, !reference.bValidUTF8, reference.firstErrorOffset != UTF8_NO_ERROR_OFFSET);
+		if (reference.bValidUTF8)
+			CheckEqual("reference: 7-bit ASCII flag", size, ASCII7Prefix(bufferStart, size), reference.b7bitASCIIOnly);
+
+		// non-tiny engine over everything but the last UTF8_MAX_CHAR_SIZE bytes, compared on that prefix
+		if (size >= detail::UTF8_MAX_CHAR_SIZE)
+		{
+			const size_t coveredSize = size - detail::UTF8_MAX_CHAR_SIZE;
+			const EngineResult nonTiny = RunEngine<false>(bufferStart, coveredSize);
+			const size_t referenceFirstError = reference.firstErrorOffset < coveredSize ? reference.firstErrorOffset : UTF8_NO_ERROR_OFFSET;
+			CheckEqual("non-tiny vs reference: first error offset", size, referenceFirstError, nonTiny.firstErrorOffset);
+			CheckEqual("non-tiny vs reference: verdict", size, referenceFirstError == UTF8_NO_ERROR_OFFSET, nonTiny.bValidUTF8);
+			if (nonTiny.bValidUTF8)
+				CheckEqual("non-tiny vs reference: 7-bit ASCII flag", size, ASCII7Prefix(bufferStart, coveredSize), nonTiny.b7bitASCIIOnly);
+		}
+
+		// public entry point vs the engine it picks
+		{
+			std::string reason;
+			const bool bPublicValid = CheckBufferForUTF8NoBOM(bufferStart, size, reason);
+			const bool bTiny = size < GetTuningProfile().tinyModeSizeLimit;
+			const EngineResult expected = bTiny ? reference : RunEngine<false>(bufferStart, size - detail::UTF8_MAX_CHAR_SIZE);
+			const bool bExpected = expected.bValidUTF8 && !expected.b7bitASCIIOnly;		// pure 7-bit ASCII needs no conversion, reported as false
+			CheckEqual("CheckBufferForUTF8NoBOM() vs its engine", size, bExpected, bPublicValid);
+		}
+
+		// lean predicate vs the reference
+		CheckEqual("IsValidUTF8() vs reference: verdict", size, reference.bValidUTF8, IsValidUTF8(bufferStart, size));
+
+		// longest valid prefix vs the reference, safe truncation of valid input: a char boundary, and the largest one
+		CheckEqual("ValidUTF8PrefixSize() vs reference: first error offset", size, reference.bValidUTF8 ? size : reference.firstErrorOffset, ValidUTF8PrefixSize(bufferStart, size));
+		if (reference.bValidUTF8)
+		{
+			for (size_t maxSize = size > 8 ? size - 8 : 0; maxSize <= size + 1; ++maxSize)
+			{
+				const size_t truncationSize = UTF8TruncationSize(bufferStart, size, maxSize);
+				if (truncationSize > maxSize || !IsValidUTF8(bufferStart, truncationSize))
+					Fail("UTF8TruncationSize() cut a char", size, maxSize, truncationSize);
+				for (size_t longer = truncationSize + 1; longer <= std::min(maxSize, size); ++longer)
+					if (IsValidUTF8(bufferStart, longer))
+						Fail("UTF8TruncationSize() missed a larger boundary", size, longer, truncationSize);
+			}
+		}
+
+		// error events of the whole input in one chunk
+		std::vector<std::pair<size_t, size_t>> wholeErrors;
+		{
+			UTF8ErrorScanner scanner;
+			UTF8ErrorEvent event;
+			scanner.Feed(bufferStart, size);
+			while (scanner.NextError(event))
+				wholeErrors.emplace_back(event.offset, event.length);
+			scanner.Finish();
+			while (scanner.NextError(event))
+				wholeErrors.emplace_back(event.offset, event.length);
+			CheckEqual("UTF8ErrorScanner vs reference: first error offset", size, reference.firstErrorOffset, wholeErrors.empty() ? UTF8_NO_ERROR_OFFSET : wholeErrors[0].first);
+			for (size_t idx = 0; idx < wholeErrors.size(); ++idx)
+			{
+				const size_t previousEnd = idx == 0 ? 0 : wholeErrors[idx - 1].first + wholeErrors[idx - 1].second;
+				CheckEqual("UTF8ErrorScanner: event after the previous one", size, true, wholeErrors[idx].first >= previousEnd && wholeErrors[idx].second > 0);
+				CheckEqual("UTF8ErrorScanner: event inside the input", size, true, wholeErrors[idx].first + wholeErrors[idx].second <= size);
+			}
+		}
+
+		// segmented validation vs the reference, segments cut at pseudo-random points (including empty and 1-byte segments)
+		for (uint32_t seed = 0; seed < 3; ++seed)
+		{
+			std::vector<std::span<const unsigned char>> segments;
+			size_t segmentStart = 0;
+			for (uint32_t state = static_cast<uint32_t>(size) * 2246822519u + seed; segmentStart < size;)
+			{
+				state = state * 1664525u + 1013904223u;
+				const size_t segmentSize = std::min<size_t>(size - segmentStart, (state >> 24) % (seed == 0 ? 3 : 40));
+				segments.emplace_back(bufferStart + segmentStart, segmentSize);
+				segmentStart += segmentSize;
+			}
+			size_t firstErrorOffset;
+			const bool bValid = IsValidUTF8(segments, &firstErrorOffset);
+			CheckEqual("segmented vs reference: verdict", size, reference.bValidUTF8, bValid);
+			CheckEqual("segmented vs reference: first error offset", size, reference.firstErrorOffset, firstErrorOffset);
+
+			UTF8ErrorScanner scanner;
+			UTF8ErrorEvent event;
+			std::vector<std::pair<size_t, size_t>> segmentedErrors;
+			for (const std::span<const unsigned char>& segment : segments)
+			{
+				scanner.Feed(segment.data(), segment.size());
+				while (scanner.NextError(event))
+					segmentedErrors.emplace_back(event.offset, event.length);
+			}
+			scanner.Finish();
+			while (scanner.NextError(event))
+				segmentedErrors.emplace_back(event.offset, event.length);
+			CheckEqual("UTF8ErrorScanner segmented vs whole: events", size, true, segmentedErrors == wholeErrors);
+		}
+
+		// batch validation vs row by row, rows cut at pseudo-random points (including empty rows)
+		{
+			std::vector<int32_t> offsets = { 0 };
+			for (uint32_t state = static_cast<uint32_t>(size) * 2654435761u + 1; static_cast<size_t>(offsets.back()) < size;)
+			{
+				state = state * 1664525u + 1013904223u;
+				offsets.push_back(static_cast<int32_t>(std::min<size_t>(size, offsets.back() + (state >> 24) % 24)));
+			}
+			const size_t rowCount = offsets.size() - 1;
+			std::vector<uint8_t> bitmap((rowCount + 7) / 8, 0xFF);
+			const size_t invalidRows = ValidateUTF8Batch(bufferStart, size, offsets.data(), rowCount, bitmap.data());
+			size_t expectedInvalidRows = 0;
+			for (size_t row = 0; row < rowCount; ++row)
+			{
+				const bool bRowValid = IsValidUTF8(bufferStart + offsets[row], offsets[row + 1] - offsets[row]);
+				expectedInvalidRows += !bRowValid;
+				CheckEqual("ValidateUTF8Batch() vs IsValidUTF8(): row validity", size, bRowValid, (bitmap[row / 8] >> (row % 8)) & 1);
+			}
+			CheckEqual("ValidateUTF8Batch(): invalid row count", size, expectedInvalidRows, invalidRows);
+			if (rowCount % 8 != 0)
+				CheckEqual("ValidateUTF8Batch(): unused bitmap bits", size, 0, bitmap.back() >> (rowCount % 8));
+		}
+
+		// chunk splitting: well-formed offsets for a few chunk counts, with and without newline preference
+		for (size_t chunkCount : { size_t(1), size_t(2), size_t(7), size_t(64) })
+			for (bool bPreferNewlines : { false, true })
+			{
+				const std::vector<size_t> offsets = SplitUTF8Chunks(bufferStart, size, chunkCount, bPreferNewlines);
+				CheckEqual("SplitUTF8Chunks(): first offset", size, 0, offsets.front());
+				CheckEqual("SplitUTF8Chunks(): last offset", size, size, offsets.back());
+				if (offsets.size() < 2 || offsets.size() > chunkCount + 1)
+					Fail("SplitUTF8Chunks(): chunk count", size, chunkCount, offsets.size() - 1);
+				for (size_t idx = 1; idx < offsets.size(); ++idx)
+				{
+					if (offsets[idx] <= offsets[idx - 1] && size != 0)
+						Fail("SplitUTF8Chunks(): offsets not increasing", size, offsets[idx - 1], offsets[idx]);
+					if (reference.bValidUTF8 && !IsValidUTF8(bufferStart + offsets[idx - 1], offsets[idx] - offsets[idx - 1]))
+						Fail("SplitUTF8Chunks() cut a char", size, chunkCount, offsets[idx]);
+				}
+			}
+
+		// char skipping vs the char starts counted one by one
+		{
+			size_t charStarts = 0;
+			for (size_t pos = 0; pos <= size; ++pos)
+				if (pos == size || !detail::UTF8IsContinuationByte(bufferStart + pos))
+				{
+					CheckEqual("SkipUTF8Chars() vs char starts", size, pos, SkipUTF8Chars(bufferStart, size, charStarts));
+					++charStarts;
+				}
+			CheckEqual("SkipUTF8Chars() past the last char", size, size, SkipUTF8Chars(bufferStart, size, charStarts + 7));
+		}
+
+		// arbitrary bytes as a sidecar: ASan reports any lookup outside the buffer
+		{
+			UTF8OffsetIndexView view;
+			std::string reason;
+			if (view.Attach(bufferStart, size, reason))
+			{
+				for (const uint64_t charIndex : { uint64_t(0), view.CharCount() / 2, view.CharCount() })
+					(void)view.CharCheckpoint(charIndex);
+				for (const uint64_t lineIndex : { uint64_t(0), view.LineCount() / 2, view.LineCount() - 1 })
+					(void)view.LineCheckpoint(lineIndex);
+			}
+		}
+
+		// markup prescan: ASan reports any read past the end
+		{
+			const EncodingDeclaration declaration = PrescanEncodingDeclaration(bufferStart, size);
+			if (declaration.source != EncodingDeclarationSource::None)
+				CheckEqual("PrescanEncodingDeclaration(): declaration inside the buffer", size, true, declaration.offset < size);
+		}
+
+		// error classifier from every position the reference stops at
+		if (!reference.bValidUTF8)
+		{
+			CheckErrorClassifier(bufferStart, size, reference.firstErrorOffset);
+			const utf8_checking_unit_t* ucharPtr = bufferStart;
+			while (ucharPtr < bufferStart + size)
+			{
+				bool bThisCharValid, bThisCharValid7bitASCII;
+				std::string reason;
+				detail::UTF8CharValidate<true>(ucharPtr, bufferStart + size, bThisCharValid, bThisCharValid7bitASCII, reason);
+				if (!bThisCharValid)
+				{
+					CheckErrorClassifier(bufferStart, size, ucharPtr - bufferStart);
+					detail::UTF8CheckErrors(ucharPtr, bufferStart, bufferStart + size, reason);
+				}
+			}
+		}
+
+		// archive reader, also with the whole content as the sample, where the claimed size used to decide the allocation
+		CheckTarReader(data, size);
+		const TuningProfile profile = GetTuningProfile();
+		SetTuningProfile({ 0, profile.tinyModeSizeLimit });
+		CheckTarReader(data, size);
+		SetTuningProfile(profile);
+	}
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	CheckInput(data, size);
+	return 0;
+}
+
+#ifdef DETCHARSET_FUZZ_STANDALONE
+
+#include "../bench/bench_common.h"
+
+#include <filesystem>
+#include <iostream>
+#include <random>
+
+namespace
+{
+	size_t ReplayFile(const std::filesystem::path& path)
+	{
+		std::ifstream ifs(path, std::ios::binary);
+		const std::vector<char> content((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+		LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t*>(content.data()), content.size());
+		return 1;
+	}
+
+	// generated corpora of every kind, cut to a random size and hit by a few random byte edits, so the interesting
+	// boundaries (truncated sequences, stray continuation bytes, errors right at the non-tiny stop position) come up often
+	void RunRandom(uint64_t iterations, uint64_t seed)
+	{
+		using namespace text_charset_detection::bench;
+		std::mt19937_64 rng(seed);
+		for (uint64_t iteration = 0; iteration < iterations; ++iteration)
+		{
+			const CorpusKind kind = ALL_CORPUS_KINDS[rng() % (sizeof(ALL_CORPUS_KINDS) / sizeof(ALL_CORPUS_KINDS[0]))];
+			const size_t size = rng() % 2 == 0 ? rng() % 16 : rng() % 4096;
+			std::vector<byte_t> input = GenerateCorpus(kind, size, rng());
+			const size_t edits = input.empty() ? 0 : rng() % 4;
+			for (size_t edit = 0; edit < edits; ++edit)
+				input[rng() % input.size()] = static_cast<byte_t>(rng());
+			LLVMFuzzerTestOneInput(input.data(), input.size());
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	uint64_t iterations = 0, seed = 1;
+	size_t replayed = 0;
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+		if (arg == "--random" && i + 1 < argc)
+			iterations = std::stoull(argv[++i]);
+		else if (arg == "--seed" && i + 1 < argc)
+			seed = std::stoull(argv[++i]);
+		else if (std::filesystem::is_directory(arg))
+		{
+			for (const std::filesystem::directory_entry& entry : std::filesystem::recursive_directory_iterator(arg))
+				if (entry.is_regular_file())
+					replayed += ReplayFile(entry.path());
+		}
+		else if (std::filesystem::is_regular_file(arg))
+			replayed += ReplayFile(arg);
+		else
+		{
+			std::cerr << "usage: " << argv[0] << " [--random ITERATIONS] [--seed SEED] [FILE|DIR]...\n";
+			return 2;
+		}
+	}
+	RunRandom(iterations, seed);
+	std::printf("%zu input(s) replayed, %llu random input(s) checked, no mismatch\n", replayed, static_cast<unsigned long long>(iterations));
+	return 0;
+}
+
+#endif
@@ -0,0 +1,463 @@
+// archive readers of detarchive.h: tar (ustar, pax, GNU long names, damage), zip (stored, deflated, unreadable members,
+// threads), gzip and tar.gz; the archives are built in memory, deflated data with zlib when it is built in
+
+#include "test_common.h"
+#include "../detarchive.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
+#if defined(TEXT_CHARSET_DETECTION_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+using namespace text_charset_detection;
+using namespace text_charset_detection::test;
+
+namespace
+{
+	constexpr size_t TAR_BLOCK_SIZE = 512;
+
+	// ASCII text with an invalid byte at each of errorOffsets
+	std::string TextWithErrors(size_t size, std::initializer_list<size_t> errorOffsets)
+	{
+		std::string text(size, 'a');
+		for (size_t idx = 79; idx < size; idx += 80)
+			text[idx] = '\n';
+		for (const size_t offset : errorOffsets)
+			text[offset] = '\xFF';
+		return text;
+	}
+
+	const std::string UTF8_TEXT = "caf\xC3\xA9 " + TextWithErrors(3000, {});
+
+	// ustar header block; sizes of 2^33 and up are written base-256 as GNU tar does
+	std::string TarHeader(const std::string& name, uint64_t size, char type, const std::string& prefix = std::string())
+	{
+		unsigned char header[TAR_BLOCK_SIZE] = {};
+		std::memcpy(header, name.data(), std::min<size_t>(name.size(), 100));
+		if (size >> 33 == 0)
+			std::snprintf(reinterpret_cast<char*>(header + 124), 12, "%011llo", static_cast<unsigned long long>(size));
+		else
+		{
+			header[124] = 0x80;
+			for (size_t idx = 0; idx < sizeof(size); ++idx)
+				header[135 - idx] = static_cast<unsigned char>(size >> (8 * idx));
+		}
+		header[156] = static_cast<unsigned char>(type);
+		std::memcpy(header + 257, "ustar\0" "00", 8);
+		std::memcpy(header + 345, prefix.data(), std::min<size_t>(prefix.size(), 155));
+		std::memset(header + 148, ' ', 8);
+		unsigned checksum = 0;
+		for (const unsigned char byte : header)
+			checksum += byte;
+		std::snprintf(reinterpret_cast<char*>(header + 148), 8, "%06o", checksum);
+		return std::string(reinterpret_cast<const char*>(header), sizeof(header));
+	}
+
+	std::string TarPadded(const std::string& content)
+	{
+		return content + std::string((TAR_BLOCK_SIZE - content.size() % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE, '\0');
+	}
+
+	std::string TarMember(const std::string& name, const std::string& content, char type = '0')
+	{
+		return TarHeader(name, content.size(), type) + TarPadded(content);
+	}
+
+	const std::string TAR_END(2 * TAR_BLOCK_SIZE, '\0');
+
+	// "<length> <key>=<value>\n", the length counting its own digits
+	std::string PaxRecord(const std::string& key, const std::string& value)
+	{
+		const size_t bodySize = 1 + key.size() + 1 + value.size() + 1;
+		size_t length = bodySize + 1;
+		while (std::to_string(length).size() + bodySize != length)
+			++length;
+		return std::to_string(length) + " " + key + "=" + value + "\n";
+	}
+
+	struct ArchiveRun
+	{
+		bool bIntact;
+		std::string reason;
+		std::vector<ArchiveMemberResult> members;
+	};
+
+	ArchiveRun ReadTar(const std::string& archive)
+	{
+		ArchiveRun run;
+		std::istringstream is(archive);
+		run.bIntact = DetectTarMembersCharset(is, [&run](const ArchiveMemberResult& member) { run.members.push_back(member); }, run.reason);
+		return run;
+	}
+
+	// members sorted by name, the zip reader reports them in completion order
+	ArchiveRun ReadZip(const std::string& archive, size_t threadCount)
+	{
+		const TempFile file(archive);
+		ArchiveRun run;
+		run.bIntact = DetectZipMembersCharset(file.Path(), [&run](const ArchiveMemberResult& member) { run.members.push_back(member); }, run.reason, threadCount);
+		std::sort(run.members.begin(), run.members.end(), [](const ArchiveMemberResult& left, const ArchiveMemberResult& right) { return left.name < right.name; });
+		return run;
+	}
+
+	void AppendLittleEndian(std::string& out, uint64_t value, size_t size)
+	{
+		for (size_t idx = 0; idx < size; ++idx)
+			out += static_cast<char>(value >> (8 * idx));
+	}
+
+	struct ZipMemberSpec
+	{
+		std::string name;
+		std::string data;							// as stored in the archive
+		uint64_t size;								// content size claimed by the directory
+		uint16_t method = 0;
+		uint16_t flags = 0;
+	};
+
+	// local headers and data, central directory, end of central directory record; CRCs are left 0, the reader ignores them
+	std::string ZipArchive(const std::vector<ZipMemberSpec>& specs)
+	{
+		std::string archive, directory;
+		for (const ZipMemberSpec& spec : specs)
+		{
+			const uint64_t localOffset = archive.size();
+			AppendLittleEndian(archive, 0x04034b50, 4);
+			AppendLittleEndian(archive, 20, 2);
+			AppendLittleEndian(archive, spec.flags, 2);
+			AppendLittleEndian(archive, spec.method, 2);
+			AppendLittleEndian(archive, 0, 8);		// time, date, CRC
+			AppendLittleEndian(archive, spec.data.size(), 4);
+			AppendLittleEndian(archive, spec.size, 4);
+			AppendLittleEndian(archive, spec.name.size(), 2);
+			AppendLittleEndian(archive, 0, 2);
+			archive += spec.name + spec.data;
+
+			AppendLittleEndian(directory, 0x02014b50, 4);
+			AppendLittleEndian(directory, 20, 2);
+			AppendLittleEndian(directory, 20, 2);
+			AppendLittleEndian(directory, spec.flags, 2);
+			AppendLittleEndian(directory, spec.method, 2);
+			AppendLittleEndian(directory, 0, 8);	// time, date, CRC
+			AppendLittleEndian(directory, spec.data.size(), 4);
+			AppendLittleEndian(directory, spec.size, 4);
+			AppendLittleEndian(directory, spec.name.size(), 2);
+			AppendLittleEndian(directory, 0, 8);	// extra, comment, disk, internal attributes
+			AppendLittleEndian(directory, 0, 4);	// external attributes
+			AppendLittleEndian(directory, localOffset, 4);
+			directory += spec.name;
+		}
+		const uint64_t directoryOffset = archive.size();
+		archive += directory;
+		AppendLittleEndian(archive, 0x06054b50, 4);
+		AppendLittleEndian(archive, 0, 4);			// disks
+		AppendLittleEndian(archive, specs.size(), 2);
+		AppendLittleEndian(archive, specs.size(), 2);
+		AppendLittleEndian(archive, directory.size(), 4);
+		AppendLittleEndian(archive, directoryOffset, 4);
+		AppendLittleEndian(archive, 0, 2);
+		return archive;
+	}
+
+#if defined(TEXT_CHARSET_DETECTION_HAVE_ZLIB)
+	// windowBits as for deflateInit2(): -15 raw deflate (zip), 31 gzip
+	std::string Deflate(const std::string& content, int windowBits)
+	{
+		z_stream stream = {};
+		if (deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return std::string();
+		std::string out(deflateBound(&stream, static_cast<uLong>(content.size())), '\0');
+		stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(content.data()));
+		stream.avail_in = static_cast<uInt>(content.size());
+		stream.next_out = reinterpret_cast<Bytef*>(out.data());
+		stream.avail_out = static_cast<uInt>(out.size());
+		deflate(&stream, Z_FINISH);
+		out.resize(stream.total_out);
+		deflateEnd(&stream);
+		return out;
+	}
+#endif
+
+	bool DetectGzip(const std::string& data, DetectionResult& result, std::string& reason)
+	{
+		std::istringstream is(data);
+		return DetectGzipCharset(is, result, reason);
+	}
+}
+
+TEST_CASE(TarMembers)
+{
+	const std::string archive = TarMember("dir/", "", '5') + TarMember("ascii.txt", TextWithErrors(1000, {}))
+		+ TarHeader("prefixed.txt", UTF8_TEXT.size(), '0', "some/dir") + TarPadded(UTF8_TEXT)
+		+ TarMember("link", "", '2') + TarMember("bad.txt", TextWithErrors(2000, { 700 })) + TarMember("empty.txt", "") + TAR_END;
+	const ArchiveRun run = ReadTar(archive);
+	CHECK(run.bIntact);
+	CHECK_EQUAL(size_t(4), run.members.size());
+	if (run.members.size() != 4)
+		return;
+	CHECK_EQUAL(std::string("ascii.txt"), run.members[0].name);
+	CHECK_EQUAL(uint64_t(1000), run.members[0].size);
+	CHECK_EQUAL(DetectedCharset::ASCII7, run.members[0].detection.charset);
+	CHECK_EQUAL(std::string("some/dir/prefixed.txt"), run.members[1].name);
+	CHECK_EQUAL(DetectedCharset::UTF8, run.members[1].detection.charset);
+	CHECK_EQUAL(std::string("bad.txt"), run.members[2].name);
+	CHECK(!run.members[2].detection.bValidUTF8);
+	CHECK_EQUAL(size_t(700), run.members[2].detection.firstErrorOffset);
+	CHECK_EQUAL(uint64_t(0), run.members[3].size);
+	for (const ArchiveMemberResult& member : run.members)
+		CHECK(member.bContentRead);
+
+	// archives written without the end marker end at the last member
+	CHECK(ReadTar(TarMember("a.txt", "abc")).bIntact);
+}
+
+TEST_CASE(TarExtendedHeaders)
+{
+	const std::string longName = std::string(150, 'n') + ".txt";
+	const std::string paxRecords = PaxRecord("path", "pax/" + longName) + PaxRecord("mtime", "1.5") + PaxRecord("size", "2000");
+	// the ustar size field is overridden by the pax size
+	const std::string archive = TarMember("././@LongLink", longName + '\0', 'L') + TarMember("short", UTF8_TEXT)
+		+ TarMember("PaxHeaders/x", paxRecords, 'x') + TarHeader("ustar-name", 0, '0') + TarPadded(TextWithErrors(2000, { 1999 }))
+		+ TarMember("plain.txt", "plain") + TAR_END;
+	const ArchiveRun run = ReadTar(archive);
+	CHECK(run.bIntact);
+	CHECK_EQUAL(size_t(3), run.members.size());
+	if (run.members.size() != 3)
+		return;
+	CHECK_EQUAL(longName, run.members[0].name);
+	CHECK_EQUAL(DetectedCharset::UTF8, run.members[0].detection.charset);
+	CHECK_EQUAL("pax/" + longName, run.members[1].name);
+	CHECK_EQUAL(uint64_t(2000), run.members[1].size);
+	CHECK_EQUAL(size_t(1999), run.members[1].detection.firstErrorOffset);
+	// the extended headers only apply to the next member
+	CHECK_EQUAL(std::string("plain.txt"), run.members[2].name);
+	CHECK_EQUAL(uint64_t(5), run.members[2].size);
+
+	const ArchiveRun malformed = ReadTar(TarMember("PaxHeaders/x", "99 path=x\n", 'x') + TarMember("a.txt", "abc") + TAR_END);
+	CHECK(!malformed.bIntact);
+	CHECK(malformed.reason.find("malformed pax header") != std::string::npos);
+}
+
+TEST_CASE(TarDamage)
+{
+	const std::string first = TarMember("first.txt", "first");
+	// truncated in the middle of the second member's content: the first one has been reported
+	const std::string second = TarMember("second.txt", TextWithErrors(5000, {}));
+	const ArchiveRun truncated = ReadTar(first + second.substr(0, TAR_BLOCK_SIZE + 1000));
+	CHECK(!truncated.bIntact);
+	CHECK_EQUAL(size_t(1), truncated.members.size());
+	CHECK(truncated.reason.find("truncated tar member second.txt") != std::string::npos);
+
+	const ArchiveRun cutHeader = ReadTar(first + second.substr(0, 100));
+	CHECK(!cutHeader.bIntact);
+	CHECK(cutHeader.reason.find("truncated tar header at offset 1024") != std::string::npos);
+
+	std::string corrupt = first + second + TAR_END;
+	corrupt[TAR_BLOCK_SIZE * 2 + 10] ^= 1;
+	const ArchiveRun checksum = ReadTar(corrupt);
+	CHECK(!checksum.bIntact);
+	CHECK_EQUAL(size_t(1), checksum.members.size());
+	CHECK(checksum.reason.find("checksum mismatch") != std::string::npos);
+
+	CHECK(!ReadTar(std::string(TAR_BLOCK_SIZE, 'x')).bIntact);
+}
+
+TEST_CASE(TarWholeMemberSamples)
+{
+	const ScopedTuningProfile profile({ 0, DefaultTuningProfile().tinyModeSizeLimit });
+	// a member larger than any sample buffer is validated as it streams by
+	const ArchiveRun large = ReadTar(TarMember("large.txt", TextWithErrors(300000, { 250000 })) + TAR_END);
+	CHECK(large.bIntact);
+	CHECK_EQUAL(size_t(1), large.members.size());
+	if (large.members.size() == 1)
+	{
+		CHECK_EQUAL(size_t(250000), large.members[0].detection.firstErrorOffset);
+		CHECK_EQUAL(size_t(300000), large.members[0].detection.sampleSize);
+	}
+	// a huge claimed size fails as a truncated member instead of sizing a buffer by it
+	const ArchiveRun huge = ReadTar(TarHeader("huge.txt", uint64_t(1) << 46, '0') + TarPadded(TextWithErrors(1000, {})));
+	CHECK(!huge.bIntact);
+	CHECK(huge.members.empty());
+	CHECK(huge.reason.find("truncated tar member huge.txt") != std::string::npos);
+}
+
+TEST_CASE(ZipStoredMembers)
+{
+	const std::vector<ZipMemberSpec> specs = {
+		{ "ascii.txt", TextWithErrors(1000, {}), 1000 },
+		{ "dir/", "", 0 },
+		{ "dir/utf8.txt", UTF8_TEXT, UTF8_TEXT.size() },
+		{ "bad.txt", TextWithErrors(2000, { 1500 }), 2000 },
+		{ "encrypted.txt", "xxxx", 4, 0, 1 },
+		{ "bzip2.txt", "xxxx", 4, 12 },
+		// the directory claims more than the file holds
+		{ "truncated.txt", TextWithErrors(100, {}), 0xFFFFFFF0 },
+	};
+	const std::string archive = ZipArchive(specs);
+	const ArchiveRun expected = ReadZip(archive, 1);
+	CHECK(expected.bIntact);
+	CHECK_EQUAL(size_t(6), expected.members.size());
+	if (expected.members.size() != 6)
+		return;
+	CHECK_EQUAL(std::string("ascii.txt"), expected.members[0].name);
+	CHECK_EQUAL(DetectedCharset::ASCII7, expected.members[0].detection.charset);
+	CHECK_EQUAL(std::string("bad.txt"), expected.members[1].name);
+	CHECK_EQUAL(size_t(1500), expected.members[1].detection.firstErrorOffset);
+	CHECK_EQUAL(std::string("bzip2.txt"), expected.members[2].name);
+	CHECK(!expected.members[2].bContentRead);
+	CHECK(expected.members[2].detection.reason.find("unsupported compression method 12") != std::string::npos);
+	CHECK_EQUAL(std::string("dir/utf8.txt"), expected.members[3].name);
+	CHECK_EQUAL(DetectedCharset::UTF8, expected.members[3].detection.charset);
+	CHECK_EQUAL(std::string("encrypted.txt"), expected.members[4].name);
+	CHECK(!expected.members[4].bContentRead);
+	CHECK(expected.members[4].detection.reason.find("encrypted member") != std::string::npos);
+	CHECK_EQUAL(std::string("truncated.txt"), expected.members[5].name);
+	CHECK(!expected.members[5].bContentRead);
+	CHECK(expected.members[5].detection.reason.find("truncated member") != std::string::npos);
+
+	// the same results whatever the thread count
+	const ArchiveRun threaded = ReadZip(archive, 4);
+	CHECK(threaded.bIntact);
+	CHECK_EQUAL(expected.members.size(), threaded.members.size());
+	for (size_t idx = 0; idx < std::min(expected.members.size(), threaded.members.size()); ++idx)
+	{
+		CHECK_EQUAL(expected.members[idx].name, threaded.members[idx].name);
+		CHECK_EQUAL(expected.members[idx].bContentRead, threaded.members[idx].bContentRead);
+		CHECK_EQUAL(expected.members[idx].detection.charset, threaded.members[idx].detection.charset);
+		CHECK_EQUAL(expected.members[idx].detection.firstErrorOffset, threaded.members[idx].detection.firstErrorOffset);
+	}
+}
+
+TEST_CASE(ZipDeflatedMembers)
+{
+	const std::string content = TextWithErrors(300000, { 250000 });
+#if defined(TEXT_CHARSET_DETECTION_HAVE_ZLIB)
+	const ArchiveRun run = ReadZip(ZipArchive({ { "deflated.txt", Deflate(content, -15), content.size(), 8 }, { "corrupt.txt", "\xFF\xFF\xFF\xFF", 100, 8 } }), 2);
+	CHECK(run.bIntact);
+	CHECK_EQUAL(size_t(2), run.members.size());
+	if (run.members.size() != 2)
+		return;
+	CHECK_EQUAL(std::string("corrupt.txt"), run.members[0].name);
+	CHECK(!run.members[0].bContentRead);
+	CHECK(run.members[0].detection.reason.find("corrupt deflate data") != std::string::npos);
+	// the default sample stops before the error
+	CHECK(run.members[1].bContentRead);
+	CHECK_EQUAL(DetectedCharset::ASCII7, run.members[1].detection.charset);
+
+	// the directory size bounds the content: inflating past it is damage, inflating short of it is detected as it is
+	const std::string withBOM = "\xEF\xBB\xBF" + TextWithErrors(3000, {});
+	const ArchiveRun sized = ReadZip(ZipArchive({ { "over.txt", Deflate(withBOM, -15), 10, 8 }, { "under.txt", Deflate(withBOM, -15), 5000, 8 } }), 1);
+	CHECK_EQUAL(size_t(2), sized.members.size());
+	if (sized.members.size() == 2)
+	{
+		CHECK(!sized.members[0].bContentRead);
+		CHECK(sized.members[0].detection.reason.find("inflates past its size") != std::string::npos);
+		CHECK(sized.members[1].bContentRead);
+		CHECK_EQUAL(DetectedCharset::UTF8BOM, sized.members[1].detection.charset);
+	}
+
+	const ScopedTuningProfile profile({ 0, DefaultTuningProfile().tinyModeSizeLimit });
+	const ArchiveRun whole = ReadZip(ZipArchive({ { "deflated.txt", Deflate(content, -15), content.size(), 8 } }), 1);
+	CHECK_EQUAL(size_t(1), whole.members.size());
+	if (whole.members.size() == 1)
+		CHECK_EQUAL(size_t(250000), whole.members[0].detection.firstErrorOffset);
+#else
+	const ArchiveRun run = ReadZip(ZipArchive({ { "deflated.txt", "xxxx", content.size(), 8 } }), 1);
+	CHECK_EQUAL(size_t(1), run.members.size());
+	if (run.members.size() == 1)
+	{
+		CHECK(!run.members[0].bContentRead);
+		CHECK(run.members[0].detection.reason.find("built without zlib") != std::string::npos);
+	}
+#endif
+}
+
+TEST_CASE(ZipCentralDirectoryDamage)
+{
+	const ArchiveRun notZip = ReadZip(TextWithErrors(1000, {}), 1);
+	CHECK(!notZip.bIntact);
+	CHECK(notZip.reason.find("no end of central directory record") != std::string::npos);
+	CHECK(!ReadZip("PK", 1).bIntact);
+
+	// directory offset past the end of the file
+	std::string archive = ZipArchive({ { "a.txt", "abc", 3 } });
+	archive[archive.size() - 3] = '\x7F';
+	const ArchiveRun outside = ReadZip(archive, 1);
+	CHECK(!outside.bIntact);
+	CHECK(outside.members.empty());
+}
+
+TEST_CASE(GzipContent)
+{
+#if defined(TEXT_CHARSET_DETECTION_HAVE_ZLIB)
+	DetectionResult result;
+	std::string reason;
+	CHECK(DetectGzip(Deflate(UTF8_TEXT, 31), result, reason));
+	CHECK_EQUAL(DetectedCharset::UTF8, result.charset);
+	CHECK_EQUAL(UTF8_TEXT.size(), result.sampleSize);
+
+	// concatenated members are one content, trailing garbage is ignored like gzip does
+	const std::string part = TextWithErrors(1000, {});
+	CHECK(DetectGzip(Deflate(part, 31) + Deflate("caf\xC3", 31) + Deflate("\xA9", 31) + std::string(100, '\0'), result, reason));
+	CHECK_EQUAL(DetectedCharset::UTF8, result.charset);
+	CHECK_EQUAL(part.size() + 5, result.sampleSize);
+
+	std::string corrupt = Deflate(TextWithErrors(100000, {}), 31);
+	corrupt.resize(corrupt.size() / 2);
+	reason.clear();
+	CHECK(!DetectGzip(std::string(corrupt.begin(), corrupt.begin() + 30) + std::string(200, '\xFF'), result, reason));
+	CHECK(!reason.empty());
+	reason.clear();
+	CHECK(!DetectGzip(TextWithErrors(1000, {}), result, reason));
+	CHECK(!reason.empty());
+
+	// whole content as the sample: streamed, not buffered
+	const ScopedTuningProfile profile({ 0, DefaultTuningProfile().tinyModeSizeLimit });
+	const size_t largeSize = size_t(5) << 20;
+	CHECK(DetectGzip(Deflate(TextWithErrors(largeSize, { largeSize - 10 }), 31), result, reason));
+	CHECK_EQUAL(largeSize, result.sampleSize);
+	CHECK_EQUAL(largeSize - 10, result.firstErrorOffset);
+	// the stream ends inside the sample: the truncation is reported, not detected
+	reason.clear();
+	CHECK(!DetectGzip(corrupt, result, reason));
+	CHECK(reason.find("truncated gzip data") != std::string::npos);
+#else
+	DetectionResult result;
+	std::string reason;
+	CHECK(!DetectGzip(std::string("\x1F\x8B\x08\x00", 4), result, reason));
+	CHECK(reason.find("built without zlib") != std::string::npos);
+#endif
+}
+
+TEST_CASE(TarGzMembers)
+{
+#if defined(TEXT_CHARSET_DETECTION_HAVE_ZLIB)
+	const std::string tar = TarMember("a.txt", UTF8_TEXT) + TarMember("b.txt", TextWithErrors(3000, { 10 })) + TAR_END;
+	std::istringstream is(Deflate(tar, 31));
+	std::vector<ArchiveMemberResult> members;
+	std::string reason;
+	CHECK(DetectTarGzMembersCharset(is, [&members](const ArchiveMemberResult& member) { members.push_back(member); }, reason));
+	CHECK_EQUAL(size_t(2), members.size());
+	if (members.size() == 2)
+	{
+		CHECK_EQUAL(DetectedCharset::UTF8, members[0].detection.charset);
+		CHECK_EQUAL(size_t(10), members[1].detection.firstErrorOffset);
+	}
+
+	// damage in the compression layer is reported as such, not as a truncated tar
+	std::string damaged = Deflate(tar, 31);
+	damaged.resize(damaged.size() / 2);
+	std::istringstream damagedStream(damaged);
+	reason.clear();
+	CHECK(!DetectTarGzMembersCharset(damagedStream, [](const ArchiveMemberResult&) {}, reason));
+	CHECK(reason.find("gzip") != std::string::npos);
+#endif
+}
+
+int main()
+{
+	return RunTests();
+}
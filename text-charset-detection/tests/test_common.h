@@ -0,0 +1,153 @@
+#pragma once
+
+// minimal harness of the tests/ executables: TEST_CASE() registers a case, CHECK*() report a failed check and go on,
+// RunTests() runs every case in registration order and gives the exit code for ctest (1 if any check failed)
+
+#include "../detcharset.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace text_charset_detection
+{
+	namespace test {
+		struct TestCase
+		{
+			const char* name;
+			void (*run)();
+		};
+
+		inline std::vector<TestCase>& TestCases()
+		{
+			static std::vector<TestCase> cases;
+			return cases;
+		}
+
+		inline size_t& FailureCount()
+		{
+			static size_t failures = 0;
+			return failures;
+		}
+
+		struct TestRegistration
+		{
+			TestRegistration(const char* name, void (*run)()) { TestCases().push_back({ name, run }); }
+		};
+
+		inline void ReportFailure(const char* file, int line, const std::string& what)
+		{
+			std::fprintf(stderr, "%s:%d: %s\n", file, line, what.c_str());
+			++FailureCount();
+		}
+
+		template <typename value_t>
+		std::string Describe(const value_t& value)
+		{
+			if constexpr (std::is_enum_v<value_t>)
+				return std::to_string(static_cast<long long>(value));
+			else if constexpr (std::is_same_v<value_t, bool>)
+				return value ? "true" : "false";
+			else if constexpr (std::is_integral_v<value_t>)
+				return std::is_signed_v<value_t> ? std::to_string(static_cast<long long>(value)) : std::to_string(static_cast<unsigned long long>(value));
+			else if constexpr (std::is_convertible_v<value_t, std::string>)
+				return "\"" + std::string(value) + "\"";
+			else
+				return "(not printable)";
+		}
+
+		inline int RunTests()
+		{
+			for (const TestCase& testCase : TestCases())
+			{
+				const size_t failuresBefore = FailureCount();
+				testCase.run();
+				std::printf("%s %s\n", FailureCount() == failuresBefore ? "passed" : "FAILED", testCase.name);
+			}
+			std::printf("%zu case(s), %zu failed check(s)\n", TestCases().size(), FailureCount());
+			return FailureCount() == 0 ? 0 : 1;
+		}
+
+		inline std::vector<unsigned char> Bytes(const std::string& text)
+		{
+			return std::vector<unsigned char>(text.begin(), text.end());
+		}
+
+		// file in the temp directory with the given content, removed with the object
+		class TempFile
+		{
+		public:
+			explicit TempFile(const std::string& content)
+			{
+				static std::mt19937_64 rng(std::random_device{}());
+				path = (std::filesystem::temp_directory_path() / ("detcharset_test_" + std::to_string(rng()))).string();
+				std::ofstream ofs(path, std::ios::binary);
+				ofs.write(content.data(), static_cast<std::streamsize>(content.size()));
+			}
+			~TempFile()
+			{
+				std::error_code ec;
+				std::filesystem::remove(path, ec);
+			}
+			TempFile(const TempFile&) = delete;
+			TempFile& operator=(const TempFile&) = delete;
+			const std::string& Path() const { return path; }
+		private:
+			std::string path;
+		};
+
+		// process wide settings a case changes, restored when it ends
+		class ScopedTuningProfile
+		{
+		public:
+			explicit ScopedTuningProfile(const TuningProfile& profile) : saved(GetTuningProfile()) { SetTuningProfile(profile); }
+			~ScopedTuningProfile() { SetTuningProfile(saved); }
+			ScopedTuningProfile(const ScopedTuningProfile&) = delete;
+			ScopedTuningProfile& operator=(const ScopedTuningProfile&) = delete;
+		private:
+			TuningProfile saved;
+		};
+
+		class ScopedMemoryBudget
+		{
+		public:
+			ScopedMemoryBudget(size_t limitBytes, MemoryBudgetMode mode) { SetMemoryBudget(limitBytes, mode); }
+			~ScopedMemoryBudget() { SetMemoryBudget(0); }
+			ScopedMemoryBudget(const ScopedMemoryBudget&) = delete;
+			ScopedMemoryBudget& operator=(const ScopedMemoryBudget&) = delete;
+		};
+	}
+}
+
+#define TEST_CASE(name) \
+	static void name(); \
+	static const text_charset_detection::test::TestRegistration name##Registration(#name, name); \
+	static void name()
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) \
+			text_charset_detection::test::ReportFailure(__FILE__, __LINE__, "CHECK(" #condition ") failed"); \
+	} while (false)
+
+#define CHECK_EQUAL(expected, actual) \
+	do { \
+		const auto& expectedValue = (expected); \
+		const auto& actualValue = (actual); \
+		if (!(expectedValue == actualValue)) \
+			text_charset_detection::test::ReportFailure(__FILE__, __LINE__, "CHECK_EQUAL(" #expected ", " #actual "): expected " \
+				+ text_charset_detection::test::Describe(expectedValue) + ", got " + text_charset_detection::test::Describe(actualValue)); \
+	} while (false)
+
+#define CHECK_THROWS(exception_t, statement) \
+	do { \
+		bool bThrown = false; \
+		try { statement; } \
+		catch (const exception_t&) { bThrown = true; } \
+		if (!bThrown) \
+			text_charset_detection::test::ReportFailure(__FILE__, __LINE__, "CHECK_THROWS(" #exception_t ", " #statement "): nothing thrown"); \
+	} while (false)
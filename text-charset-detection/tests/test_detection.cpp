@@ -0,0 +1,310 @@
+// detection of files and buffers: BOMs, verdicts, metrics, the memory budget (buffered vs streamed samples),
+// StreamingCharsetDetector and AsyncDetector
+
+#include "test_common.h"
+
+#include <chrono>
+#include <future>
+#include <numeric>
+#include <stdexcept>
+
+using namespace text_charset_detection;
+using namespace text_charset_detection::test;
+
+namespace
+{
+	constexpr size_t STREAM_BLOCK_SIZE = 65536;			// the smallest memory budget
+
+	DetectionResult DetectFile(const std::string& content)
+	{
+		const TempFile file(content);
+		std::ifstream ifs(file.Path(), std::ios::binary);
+		const DetectionResult result = DetectCharset(ifs);
+		// the stream is left past a BOM, at the start otherwise
+		if (result.sampleSize != 0 || result.declaration.source != EncodingDeclarationSource::None)
+			CHECK_EQUAL(0, static_cast<int>(ifs.tellg()));
+		return result;
+	}
+
+	DetectionResult DetectInChunks(const std::string& content, size_t chunkSize, uint64_t sizeHint = UINT64_MAX)
+	{
+		StreamingCharsetDetector detector(sizeHint);
+		const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(content.data());
+		size_t fed = 0;
+		for (size_t pos = 0; pos < content.size() && !detector.Done(); pos += chunkSize)
+			fed += detector.Feed(bytes + pos, std::min(chunkSize, content.size() - pos));
+		return detector.Finish(fed == content.size());
+	}
+
+	// ASCII text with an invalid byte at each of errorOffsets
+	std::string TextWithErrors(size_t size, std::initializer_list<size_t> errorOffsets)
+	{
+		std::string text(size, 'a');
+		for (size_t idx = 79; idx < size; idx += 80)
+			text[idx] = '\n';
+		for (const size_t offset : errorOffsets)
+			text[offset] = '\xFF';
+		return text;
+	}
+
+	uint64_t CountedUTF8Errors()
+	{
+		const DetectionMetrics metrics = GetDetectionMetrics();
+		return std::accumulate(std::begin(metrics.utf8Errors), std::end(metrics.utf8Errors), uint64_t(0));
+	}
+}
+
+TEST_CASE(FileVerdicts)
+{
+	CHECK_EQUAL(DetectedCharset::UTF8BOM, DetectFile("\xEF\xBB\xBF" "abc").charset);
+	CHECK_EQUAL(DetectedCharset::UTF16LE, DetectFile(std::string("\xFF\xFE" "a\0", 4)).charset);
+	CHECK_EQUAL(DetectedCharset::UTF16BE, DetectFile(std::string("\xFE\xFF\0a", 4)).charset);
+	CHECK_EQUAL(DetectedCharset::ASCII7, DetectFile(TextWithErrors(5000, {})).charset);
+	CHECK_EQUAL(DetectedCharset::UTF8, DetectFile("caf\xC3\xA9 " + TextWithErrors(5000, {})).charset);
+
+	const DetectionResult invalid = DetectFile(TextWithErrors(5000, { 1234, 4000 }));
+	CHECK_EQUAL(DetectedCharset::Unknown, invalid.charset);
+	CHECK(!invalid.bValidUTF8);
+	CHECK_EQUAL(size_t(1234), invalid.firstErrorOffset);
+	CHECK_EQUAL(size_t(5000), invalid.sampleSize);
+
+	// a declaration decides on the prescanned bytes, which are not read again
+	const DetectionResult declared = DetectFile("<?xml version=\"1.0\" encoding=\"utf-8\"?>" + TextWithErrors(5000, { 3000 }));
+	CHECK_EQUAL(DetectedCharset::UTF8, declared.charset);
+	CHECK_EQUAL(EncodingDeclarationSource::XMLProlog, declared.declaration.source);
+}
+
+TEST_CASE(MetricsCountEveryDetection)
+{
+	// files and buffers decided by a BOM, a declaration or validation, streamed input buffered, decided or validated
+	const std::string contents[] = { "\xEF\xBB\xBF" "abc", "<?xml version=\"1.0\" encoding=\"utf-8\"?>" + TextWithErrors(3000, {}), TextWithErrors(3000, { 10 }) };
+	for (const std::string& content : contents)
+	{
+		uint64_t before = GetDetectionMetrics().filesProcessed;
+		DetectFile(content);
+		CHECK_EQUAL(before + 1, GetDetectionMetrics().filesProcessed);
+		before = GetDetectionMetrics().filesProcessed;
+		DetectBufferCharset(reinterpret_cast<const unsigned char*>(content.data()), content.size());
+		CHECK_EQUAL(before + 1, GetDetectionMetrics().filesProcessed);
+		for (const uint64_t sizeHint : { uint64_t(UINT64_MAX), uint64_t(10) })
+		{
+			before = GetDetectionMetrics().filesProcessed;
+			DetectInChunks(content, 100, sizeHint);
+			CHECK_EQUAL(before + 1, GetDetectionMetrics().filesProcessed);
+		}
+	}
+}
+
+TEST_CASE(SampleSizeLimitsValidation)
+{
+	const ScopedTuningProfile profile({ 4096, DefaultTuningProfile().tinyModeSizeLimit });
+	const DetectionResult result = DetectFile(TextWithErrors(10000, { 8000 }));
+	CHECK_EQUAL(size_t(4096), result.sampleSize);
+	CHECK_EQUAL(DetectedCharset::ASCII7, result.charset);
+	const std::string bytes = TextWithErrors(10000, { 8000 });
+	CHECK_EQUAL(size_t(4096), DetectBufferCharset(reinterpret_cast<const unsigned char*>(bytes.data()), bytes.size()).sampleSize);
+}
+
+TEST_CASE(MemoryBudgetStreamsWhatDoesNotFit)
+{
+	CHECK_THROWS(std::invalid_argument, SetMemoryBudget(STREAM_BLOCK_SIZE - 1));
+	const ScopedTuningProfile profile({ 200000, DefaultTuningProfile().tinyModeSizeLimit });
+	const std::string contents[] = { TextWithErrors(300000, {}), TextWithErrors(300000, { 70000, 150000 }), TextWithErrors(150000, { 131071 }), TextWithErrors(200000, { 199990 }) };
+	for (const std::string& content : contents)
+	{
+		const DetectionResult buffered = DetectFile(content);
+		for (const MemoryBudgetMode mode : { MemoryBudgetMode::Stream, MemoryBudgetMode::Block })
+		{
+			const ScopedMemoryBudget budget(STREAM_BLOCK_SIZE, mode);
+			const uint64_t streamedBefore = GetMemoryBudgetStats().streamedSamples;
+			const uint64_t errorsBefore = CountedUTF8Errors();
+			const DetectionResult streamed = DetectFile(content);
+			const MemoryBudgetStats stats = GetMemoryBudgetStats();
+			CHECK_EQUAL(streamedBefore + 1, stats.streamedSamples);
+			CHECK(stats.peakBytes <= STREAM_BLOCK_SIZE);
+			CHECK_EQUAL(size_t(0), stats.inUseBytes);
+			CHECK(streamed.reason.find("validating it in blocks") != std::string::npos);
+			CHECK_EQUAL(buffered.charset, streamed.charset);
+			CHECK_EQUAL(buffered.bValidUTF8, streamed.bValidUTF8);
+			CHECK_EQUAL(buffered.firstErrorOffset, streamed.firstErrorOffset);
+			CHECK_EQUAL(buffered.sampleSize, streamed.sampleSize);
+			// errors of streamed samples are counted like those of buffered ones
+			if (!streamed.bValidUTF8)
+				CHECK(CountedUTF8Errors() > errorsBefore);
+		}
+	}
+
+	// a file that ends right at the end of the sample: its last char is checked as the end of the file
+	const ScopedMemoryBudget budget(STREAM_BLOCK_SIZE, MemoryBudgetMode::Stream);
+	const DetectionResult truncated = DetectFile(TextWithErrors(199999, {}) + "\xC3");
+	CHECK(!truncated.bValidUTF8);
+	CHECK_EQUAL(size_t(199999), truncated.firstErrorOffset);
+	// cut by the sample, not by the file: left out as by the buffered non-tiny engine
+	CHECK(DetectFile(TextWithErrors(199999, {}) + "\xC3\xA9" + TextWithErrors(1000, {})).bValidUTF8);
+}
+
+TEST_CASE(StreamingDetectorMatchesBufferDetection)
+{
+	const std::string contents[] = {
+		"",
+		"short",
+		"\xEF\xBB\xBF" "bom",
+		"<?xml version=\"1.0\" encoding=\"utf-8\"?><a>caf\xC3\xA9</a>",
+		TextWithErrors(50000, {}) + "\xE2\x82\xAC",
+		TextWithErrors(90000, { 12, 45000, 89999 }),
+	};
+	for (const std::string& content : contents)
+	{
+		const DetectionResult expected = DetectBufferCharset(reinterpret_cast<const unsigned char*>(content.data()), content.size());
+		for (const size_t chunkSize : { size_t(1), size_t(7), size_t(1000), size_t(1) << 20 })
+		{
+			const DetectionResult chunked = DetectInChunks(content, chunkSize, chunkSize == 7 ? content.size() : UINT64_MAX);
+			CHECK_EQUAL(expected.charset, chunked.charset);
+			CHECK_EQUAL(expected.bValidUTF8, chunked.bValidUTF8);
+			CHECK_EQUAL(expected.firstErrorOffset, chunked.firstErrorOffset);
+			CHECK_EQUAL(expected.sampleSize, chunked.sampleSize);
+			CHECK_EQUAL(expected.reason, chunked.reason);
+		}
+	}
+}
+
+TEST_CASE(StreamingDetectorWithAnUnderstatedSize)
+{
+	// the start of the input decides as in DetectBufferCharset() even if it arrives in one chunk over the buffer, or split
+	const std::string contents[] = {
+		"\xEF\xBB\xBF" + TextWithErrors(3000, { 2000 }),
+		std::string("\xFF\xFE", 2) + TextWithErrors(3000, {}),
+		"<?xml version=\"1.0\" encoding=\"utf-8\"?>" + TextWithErrors(3000, { 2000 }),
+		"caf\xC3\xA9 " + TextWithErrors(3000, { 2500 }),
+	};
+	for (const std::string& content : contents)
+	{
+		const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(content.data());
+		const DetectionResult expected = DetectBufferCharset(bytes, content.size());
+		for (const uint64_t sizeHint : { uint64_t(10), uint64_t(2000) })
+			for (const size_t split : { size_t(0), size_t(1), size_t(2), size_t(1500) })
+			{
+				StreamingCharsetDetector detector(sizeHint);
+				size_t fed = detector.Feed(bytes, split);
+				if (!detector.Done())
+					fed += detector.Feed(bytes + split, content.size() - split);
+				const DetectionResult streamed = detector.Finish(fed == content.size());
+				CHECK_EQUAL(expected.charset, streamed.charset);
+				CHECK_EQUAL(expected.bValidUTF8, streamed.bValidUTF8);
+				CHECK_EQUAL(expected.firstErrorOffset, streamed.firstErrorOffset);
+				CHECK_EQUAL(expected.sampleSize, streamed.sampleSize);
+				CHECK_EQUAL(expected.declaration.source, streamed.declaration.source);
+			}
+	}
+}
+
+TEST_CASE(StreamingDetectorBoundsItsBuffer)
+{
+	{
+		// whole input as the sample: validated in blocks past the first one
+		const ScopedTuningProfile profile({ 0, DefaultTuningProfile().tinyModeSizeLimit });
+		const DetectionResult streamed = DetectInChunks(TextWithErrors(300000, { 200000 }), 16384);
+		CHECK_EQUAL(size_t(300000), streamed.sampleSize);
+		CHECK_EQUAL(size_t(200000), streamed.firstErrorOffset);
+		CHECK(streamed.reason.find("validating it as it streams in") != std::string::npos);
+		// the end of the input is checked as such only if it was all fed
+		StreamingCharsetDetector detector;
+		const std::string truncated = TextWithErrors(100000, {}) + "\xF0\x9F";
+		CHECK_EQUAL(truncated.size(), detector.Feed(reinterpret_cast<const unsigned char*>(truncated.data()), truncated.size()));
+		const DetectionResult ended = detector.Finish(true);
+		CHECK_EQUAL(size_t(100000), ended.firstErrorOffset);
+		StreamingCharsetDetector cut;
+		cut.Feed(reinterpret_cast<const unsigned char*>(truncated.data()), truncated.size());
+		CHECK(cut.Finish(false).bValidUTF8);
+		// a BOM past the first block decides without the rest
+		StreamingCharsetDetector bom;
+		const std::string withBOM = "\xEF\xBB\xBF" + TextWithErrors(100000, { 90000 });
+		const size_t taken = bom.Feed(reinterpret_cast<const unsigned char*>(withBOM.data()), STREAM_BLOCK_SIZE) + bom.Feed(reinterpret_cast<const unsigned char*>(withBOM.data()) + STREAM_BLOCK_SIZE, 10);
+		CHECK(bom.Done());
+		CHECK_EQUAL(STREAM_BLOCK_SIZE, taken);
+		CHECK_EQUAL(DetectedCharset::UTF8BOM, bom.Finish(false).charset);
+	}
+
+	// the sample ends the feeding
+	const ScopedTuningProfile profile({ 1000, DefaultTuningProfile().tinyModeSizeLimit });
+	StreamingCharsetDetector detector;
+	const std::string text = TextWithErrors(2000, { 1500 });
+	const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(text.data());
+	CHECK_EQUAL(size_t(800), detector.Feed(bytes, 800));
+	CHECK(!detector.Done());
+	CHECK_EQUAL(size_t(200), detector.Feed(bytes + 800, 800));
+	CHECK(detector.Done());
+	CHECK_EQUAL(size_t(0), detector.Feed(bytes + 1000, 1000));
+	const DetectionResult result = detector.Finish(false);
+	CHECK_EQUAL(size_t(1000), result.sampleSize);
+	CHECK_EQUAL(DetectedCharset::ASCII7, result.charset);
+
+	// an input larger than its hint is still detected as a whole
+	const ScopedTuningProfile wholeInput({ 0, DefaultTuningProfile().tinyModeSizeLimit });
+	const DetectionResult underHinted = DetectInChunks(TextWithErrors(100000, { 80000 }), 4096, 10);
+	CHECK_EQUAL(size_t(80000), underHinted.firstErrorOffset);
+
+	// its buffer is reserved against the memory budget
+	const ScopedMemoryBudget budget(STREAM_BLOCK_SIZE, MemoryBudgetMode::Stream);
+	{
+		StreamingCharsetDetector reserved;
+		CHECK_EQUAL(STREAM_BLOCK_SIZE, GetMemoryBudgetStats().inUseBytes);
+	}
+	CHECK_EQUAL(size_t(0), GetMemoryBudgetStats().inUseBytes);
+}
+
+TEST_CASE(AsyncDetection)
+{
+	const TempFile file(TextWithErrors(3000, { 100 }));
+	{
+		AsyncDetector detector(2, 4);
+		CHECK_EQUAL(size_t(2), detector.ThreadCount());
+		CHECK_EQUAL(size_t(4), detector.MaxQueueDepth());
+		std::future<DetectionResult> fromPath = detector.Submit(file.Path());
+		std::future<DetectionResult> missing = detector.Submit(file.Path() + ".missing");
+		std::future<DetectionResult> fromBuffer = detector.SubmitBuffer(Bytes("caf\xC3\xA9"));
+		CHECK_EQUAL(size_t(100), fromPath.get().firstErrorOffset);
+		CHECK_THROWS(std::runtime_error, missing.get());
+		CHECK_EQUAL(DetectedCharset::UTF8, fromBuffer.get().charset);
+
+		std::promise<bool> handled;
+		detector.Submit(file.Path() + ".missing", [&handled](bool bDetected, const DetectionResult& result)
+		{
+			handled.set_value(!bDetected && result.reason.find("cannot open") != std::string::npos);
+		});
+		CHECK(handled.get_future().get());
+
+		// a buffer the memory budget has no room for now is refused and left with the caller
+		const ScopedTuningProfile profile({ 1 << 20, DefaultTuningProfile().tinyModeSizeLimit });
+		const ScopedMemoryBudget budget(1 << 20, MemoryBudgetMode::Block);
+		const StreamingCharsetDetector holder(900000);
+		std::vector<unsigned char> data(400000, 'b');
+		std::future<DetectionResult> refused;
+		CHECK(!detector.TrySubmitBuffer(data, refused));
+		CHECK_EQUAL(size_t(400000), data.size());
+		CHECK(!refused.valid());
+	}
+	CHECK_EQUAL(size_t(0), GetMemoryBudgetStats().inUseBytes);
+}
+
+TEST_CASE(AsyncBufferJobsDoNotStarvePathJobs)
+{
+	// queued buffers hold no memory: a worker reserving a file's sample cannot wait for a buffer only it could detect
+	const TempFile file(TextWithErrors(200000, {}));
+	AsyncDetector detector(1, 4);
+	const ScopedMemoryBudget budget(1 << 20, MemoryBudgetMode::Block);
+	// the worker is kept busy until both jobs are queued, the path job first
+	std::promise<void> gateOpened;
+	detector.Submit(file.Path(), [gate = gateOpened.get_future().share()](bool, const DetectionResult&) { gate.wait(); });
+	std::future<DetectionResult> fromPath = detector.Submit(file.Path());
+	std::future<DetectionResult> fromBuffer = detector.SubmitBuffer(std::vector<unsigned char>(1000000, 'a'));
+	gateOpened.set_value();
+	CHECK(fromPath.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+	CHECK(fromBuffer.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+	CHECK(GetMemoryBudgetStats().peakBytes <= size_t(1) << 20);
+}
+
+int main()
+{
+	return RunTests();
+}
@@ -0,0 +1,324 @@
+// validation primitives of detcharset.h: plain checks, batch, segmented input, error scanning (callback and coroutine),
+// prefix and truncation, chunk splitting, char skipping and the offset index, the markup prescan
+
+#include "test_common.h"
+
+#include <coroutine>
+#include <span>
+
+using namespace text_charset_detection;
+using namespace text_charset_detection::test;
+
+namespace
+{
+	// valid text with 1 to 4 byte chars, line breaks and a tab, long enough for the non-tiny engines
+	std::string MixedText(size_t repeat)
+	{
+		std::string text;
+		for (size_t idx = 0; idx < repeat; ++idx)
+			text += "ascii line\tw\xC3\xA9th \xE2\x82\xAC and \xF0\x9F\x98\x80\n";
+		return text;
+	}
+
+	// every error of the payload fed to a UTF8ErrorScanner in chunks of chunkSize bytes
+	std::vector<UTF8ErrorEvent> ScanErrors(const std::vector<unsigned char>& payload, size_t chunkSize)
+	{
+		std::vector<UTF8ErrorEvent> events;
+		UTF8ErrorScanner scanner;
+		UTF8ErrorEvent event;
+		for (size_t pos = 0; pos < payload.size(); pos += chunkSize)
+		{
+			scanner.Feed(payload.data() + pos, std::min(chunkSize, payload.size() - pos));
+			while (scanner.NextError(event))
+				events.push_back(event);
+		}
+		scanner.Finish();
+		while (scanner.NextError(event))
+			events.push_back(event);
+		return events;
+	}
+
+	// chunk source for ScanUTF8Errors() whose chunks are always ready
+	struct ReadyChunkSource
+	{
+		std::vector<std::span<const unsigned char>> chunks;
+		size_t next = 0;
+
+		struct ChunkAwaiter
+		{
+			std::span<const unsigned char> chunk;
+			bool await_ready() const noexcept { return true; }
+			void await_suspend(std::coroutine_handle<>) const noexcept {}
+			std::span<const unsigned char> await_resume() const noexcept { return chunk; }
+		};
+		ChunkAwaiter Next() { return ChunkAwaiter{ next < chunks.size() ? chunks[next++] : std::span<const unsigned char>() }; }
+	};
+
+	// consumer coroutine that runs to its end without suspending for long (the source is always ready)
+	struct ConsumerTask
+	{
+		struct promise_type
+		{
+			ConsumerTask get_return_object() { return ConsumerTask{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_always final_suspend() noexcept { return {}; }
+			void return_void() {}
+			void unhandled_exception() { throw; }
+		};
+		~ConsumerTask() { handle.destroy(); }
+		std::coroutine_handle<promise_type> handle;
+	};
+
+	ConsumerTask CollectErrors(ReadyChunkSource& source, std::vector<size_t>& offsets)
+	{
+		UTF8ErrorEventStream errors = ScanUTF8Errors(source);
+		while (const UTF8ErrorEvent* error = co_await errors.Next())
+			offsets.push_back(error->offset);
+	}
+}
+
+TEST_CASE(PlainValidityAndPrefix)
+{
+	const std::vector<unsigned char> valid = Bytes(MixedText(3));
+	CHECK(IsValidUTF8(valid.data(), valid.size()));
+	CHECK_EQUAL(valid.size(), ValidUTF8PrefixSize(valid.data(), valid.size()));
+
+	const std::vector<unsigned char> control = Bytes("ab\x01" "cd");
+	CHECK(!IsValidUTF8(control.data(), control.size()));
+	CHECK_EQUAL(size_t(2), ValidUTF8PrefixSize(control.data(), control.size()));
+
+	const std::vector<unsigned char> truncated = Bytes("abc\xE2\x82");
+	CHECK(!IsValidUTF8(truncated.data(), truncated.size()));
+	CHECK_EQUAL(size_t(3), ValidUTF8PrefixSize(truncated.data(), truncated.size()));
+
+	for (const char* invalid : { "\xC0\x80", "\xED\xA0\x80", "\xF4\x90\x80\x80", "\xFF" })
+	{
+		const std::vector<unsigned char> bytes = Bytes(invalid);
+		CHECK(!IsValidUTF8(bytes.data(), bytes.size()));
+		CHECK_EQUAL(size_t(0), ValidUTF8PrefixSize(bytes.data(), bytes.size()));
+	}
+}
+
+TEST_CASE(TruncationKeepsCharsWhole)
+{
+	const std::vector<unsigned char> text = Bytes("a\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80");
+	const size_t boundaries[] = { 0, 1, 1, 3, 3, 3, 6, 6, 6, 6, 10 };
+	for (size_t maxSize = 0; maxSize <= text.size(); ++maxSize)
+		CHECK_EQUAL(boundaries[maxSize], UTF8TruncationSize(text.data(), text.size(), maxSize));
+	CHECK_EQUAL(text.size(), UTF8TruncationSize(text.data(), text.size(), text.size() + 5));
+}
+
+TEST_CASE(ChunkSplitting)
+{
+	const std::vector<unsigned char> text = Bytes(MixedText(200));
+	for (const bool bPreferNewlines : { false, true })
+		for (const size_t chunkCount : { size_t(1), size_t(3), size_t(16) })
+		{
+			const std::vector<size_t> offsets = SplitUTF8Chunks(text.data(), text.size(), chunkCount, bPreferNewlines);
+			CHECK(offsets.size() >= 2 && offsets.size() <= chunkCount + 1);
+			CHECK_EQUAL(size_t(0), offsets.front());
+			CHECK_EQUAL(text.size(), offsets.back());
+			for (size_t idx = 1; idx < offsets.size(); ++idx)
+			{
+				CHECK(offsets[idx - 1] < offsets[idx]);
+				if (offsets[idx] < text.size())
+					CHECK((text[offsets[idx]] & 0xC0) != 0x80);
+				if (bPreferNewlines && offsets[idx] < text.size())
+					CHECK_EQUAL('\n', static_cast<char>(text[offsets[idx] - 1]));
+			}
+		}
+	CHECK_EQUAL(size_t(2), SplitUTF8Chunks(text.data(), 1, 8).size());
+}
+
+TEST_CASE(BatchRowVerdicts)
+{
+	const std::string blob = std::string("valid") + "\xC3\xA9" + "bad\xFF" + "\x01" + MixedText(10) + "\xE2\x82";
+	const std::vector<unsigned char> data = Bytes(blob);
+	const size_t rowEnds[] = { 7, 11, 11, 12, 12 + MixedText(10).size(), data.size() };
+	std::vector<int32_t> offsets32 = { 0 };
+	std::vector<int64_t> offsets64 = { 0 };
+	for (const size_t rowEnd : rowEnds)
+	{
+		offsets32.push_back(static_cast<int32_t>(rowEnd));
+		offsets64.push_back(static_cast<int64_t>(rowEnd));
+	}
+	const size_t rowCount = offsets32.size() - 1;
+	uint8_t bitmap32[1] = { 0xFF }, bitmap64[1] = { 0xFF };
+	CHECK_EQUAL(size_t(3), ValidateUTF8Batch(data.data(), data.size(), offsets32.data(), rowCount, bitmap32));
+	CHECK_EQUAL(size_t(3), ValidateUTF8Batch(data.data(), data.size(), offsets64.data(), rowCount, bitmap64));
+	// rows: valid, bad, empty, control char, valid text, truncated char; unused bits cleared
+	CHECK_EQUAL(0x15, static_cast<int>(bitmap32[0]));
+	CHECK_EQUAL(0x15, static_cast<int>(bitmap64[0]));
+	for (size_t row = 0; row < rowCount; ++row)
+		CHECK_EQUAL(IsValidUTF8(data.data() + offsets32[row], offsets32[row + 1] - offsets32[row]), ((bitmap32[0] >> row) & 1) != 0);
+
+	// offsets are checked before any data is read
+	const int32_t pastEnd[] = { 0, 4, static_cast<int32_t>(data.size()) + 4000 };
+	CHECK_THROWS(std::out_of_range, ValidateUTF8Batch(data.data(), data.size(), pastEnd, 2, bitmap32));
+	const int64_t decreasing[] = { 0, 6, 5 };
+	CHECK_THROWS(std::out_of_range, ValidateUTF8Batch(data.data(), data.size(), decreasing, 2, bitmap64));
+	const int32_t negative[] = { -1, 3 };
+	CHECK_THROWS(std::out_of_range, ValidateUTF8Batch(data.data(), data.size(), negative, 1, bitmap32));
+}
+
+TEST_CASE(SegmentedValidationMatchesWholePayload)
+{
+	const std::string text = MixedText(4);
+	for (const std::string& payload : { text, text + "\xE2\x82", text.substr(0, 30) + "\xC3" + text, text + "\xF0\x9F\x98" })
+	{
+		const std::vector<unsigned char> bytes = Bytes(payload);
+		const size_t expectedOffset = IsValidUTF8(bytes.data(), bytes.size()) ? UTF8_NO_ERROR_OFFSET : ValidUTF8PrefixSize(bytes.data(), bytes.size());
+		for (size_t split = 0; split <= bytes.size(); ++split)
+		{
+			UTF8StreamValidator validator;
+			validator.Feed(bytes.data(), split);
+			validator.Feed(bytes.data() + split, bytes.size() - split);
+			CHECK_EQUAL(expectedOffset == UTF8_NO_ERROR_OFFSET, validator.Finish());
+			CHECK_EQUAL(expectedOffset, validator.FirstErrorOffset());
+			if (expectedOffset == UTF8_NO_ERROR_OFFSET)
+				CHECK_EQUAL(bytes.size(), validator.BytesFed());
+
+			const std::span<const unsigned char> segments[] = { { bytes.data(), split }, { bytes.data() + split, bytes.size() - split } };
+			size_t firstErrorOffset = 0;
+			CHECK_EQUAL(expectedOffset == UTF8_NO_ERROR_OFFSET, IsValidUTF8(segments, &firstErrorOffset));
+			CHECK_EQUAL(expectedOffset, firstErrorOffset);
+		}
+	}
+}
+
+TEST_CASE(ErrorScannerReportsEveryError)
+{
+	const std::string text = MixedText(2);
+	const std::vector<unsigned char> payload = Bytes(text + "\x01" + text + "\xC3(" + text + "\xE2\x82");
+	const std::vector<UTF8ErrorEvent> whole = ScanErrors(payload, payload.size());
+	CHECK_EQUAL(size_t(3), whole.size());
+	if (whole.size() == 3)
+	{
+		CHECK_EQUAL(text.size(), whole[0].offset);
+		CHECK_EQUAL(UTF8ErrorClass::ControlChar, whole[0].errorClass);
+		CHECK_EQUAL(2 * text.size() + 1, whole[1].offset);
+		CHECK_EQUAL(payload.size() - 2, whole[2].offset);
+		CHECK_EQUAL(UTF8ErrorClass::TruncatedSequence, whole[2].errorClass);
+		for (const UTF8ErrorEvent& event : whole)
+		{
+			CHECK(event.length >= 1);
+			CHECK(event.description.find(std::to_string(event.offset)) != std::string::npos);
+		}
+	}
+	// chunk boundaries do not change the events
+	for (const size_t chunkSize : { size_t(1), size_t(2), size_t(3), size_t(7), size_t(64) })
+	{
+		const std::vector<UTF8ErrorEvent> chunked = ScanErrors(payload, chunkSize);
+		CHECK_EQUAL(whole.size(), chunked.size());
+		for (size_t idx = 0; idx < std::min(whole.size(), chunked.size()); ++idx)
+		{
+			CHECK_EQUAL(whole[idx].offset, chunked[idx].offset);
+			CHECK_EQUAL(whole[idx].errorClass, chunked[idx].errorClass);
+			CHECK_EQUAL(whole[idx].description, chunked[idx].description);
+		}
+	}
+}
+
+TEST_CASE(CoroutineScannerYieldsTheSameErrors)
+{
+	const std::string text = MixedText(3);
+	const std::vector<unsigned char> payload = Bytes(text + "\xFF" + text + "\xC3");
+	const std::vector<UTF8ErrorEvent> expected = ScanErrors(payload, payload.size());
+	ReadyChunkSource source;
+	for (size_t pos = 0; pos < payload.size(); pos += 5)
+		source.chunks.emplace_back(payload.data() + pos, std::min<size_t>(5, payload.size() - pos));
+	std::vector<size_t> offsets;
+	{
+		const ConsumerTask consumer = CollectErrors(source, offsets);
+		CHECK(consumer.handle.done());
+	}
+	CHECK_EQUAL(expected.size(), offsets.size());
+	for (size_t idx = 0; idx < std::min(expected.size(), offsets.size()); ++idx)
+		CHECK_EQUAL(expected[idx].offset, offsets[idx]);
+}
+
+TEST_CASE(OffsetIndexAndCharSkipping)
+{
+	const std::string text = MixedText(300);
+	const TempFile file(text);
+	std::ifstream ifs(file.Path(), std::ios::binary);
+	UTF8OffsetIndex index;
+	std::string reason;
+	CHECK(BuildUTF8OffsetIndex(ifs, 64, index, reason));
+	CHECK_EQUAL(uint64_t(text.size()), index.byteSize);
+	CHECK_EQUAL(uint64_t(301), index.lineCount);
+
+	// char starts straight from the definition
+	std::vector<size_t> charStarts;
+	for (size_t pos = 0; pos < text.size(); ++pos)
+		if ((static_cast<unsigned char>(text[pos]) & 0xC0) != 0x80)
+			charStarts.push_back(pos);
+	CHECK_EQUAL(uint64_t(charStarts.size()), index.charCount);
+
+	const std::vector<unsigned char> sidecar = SerializeUTF8OffsetIndex(index);
+	UTF8OffsetIndexView view;
+	CHECK(view.Attach(sidecar.data(), sidecar.size(), reason));
+	CHECK_EQUAL(uint64_t(64), view.Stride());
+	const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(text.data());
+	for (const uint64_t charIndex : { uint64_t(0), uint64_t(1), uint64_t(63), uint64_t(64), uint64_t(1000), uint64_t(charStarts.size() - 1) })
+	{
+		const UTF8IndexCheckpoint checkpoint = view.CharCheckpoint(charIndex);
+		CHECK(checkpoint.index <= charIndex && charIndex - checkpoint.index < 64);
+		const size_t offset = checkpoint.byteOffset + SkipUTF8Chars(bytes + checkpoint.byteOffset, text.size() - checkpoint.byteOffset, charIndex - checkpoint.index);
+		CHECK_EQUAL(charStarts[charIndex], offset);
+	}
+	CHECK_EQUAL(text.size(), SkipUTF8Chars(bytes, text.size(), charStarts.size() + 10));
+	const UTF8IndexCheckpoint lineCheckpoint = view.LineCheckpoint(128);
+	CHECK_EQUAL(uint64_t(128), lineCheckpoint.index);
+	CHECK_EQUAL(uint64_t(128 * (text.size() / 300)), lineCheckpoint.byteOffset);
+	CHECK_THROWS(std::out_of_range, view.LineCheckpoint(301));
+	CHECK_THROWS(std::out_of_range, view.CharCheckpoint(index.charCount + 1));
+
+	// damaged sidecars are rejected, not read past their end
+	UTF8OffsetIndexView damaged;
+	CHECK(!damaged.Attach(sidecar.data(), sidecar.size() - 1, reason));
+	CHECK(!damaged.Attach(sidecar.data(), 8, reason));
+
+	// an invalid file cannot be indexed
+	const TempFile invalidFile(text + "\xFF");
+	std::ifstream invalidIfs(invalidFile.Path(), std::ios::binary);
+	UTF8OffsetIndex invalidIndex;
+	CHECK(!BuildUTF8OffsetIndex(invalidIfs, 64, invalidIndex, reason));
+}
+
+TEST_CASE(MarkupDeclarationPrescan)
+{
+	const struct
+	{
+		const char* markup;
+		EncodingDeclarationSource source;
+		const char* label;
+	} cases[] = {
+		{ "<?xml version=\"1.0\" encoding=\"UTF-8\"?><a/>", EncodingDeclarationSource::XMLProlog, "utf-8" },
+		{ "@charset \"ISO-8859-1\";\nbody {}", EncodingDeclarationSource::CSSCharsetRule, "iso-8859-1" },
+		{ "<!DOCTYPE html><!-- <meta charset=koi8-r> --><html><head><meta charset=\" windows-1252 \">", EncodingDeclarationSource::HTMLMeta, "windows-1252" },
+		{ "<html><meta http-equiv=\"Content-Type\" content=\"text/html; charset=shift_jis\">", EncodingDeclarationSource::HTMLMeta, "shift_jis" },
+		{ "plain text mentioning <meta charset=utf-8>", EncodingDeclarationSource::None, "" },
+	};
+	for (const auto& testCase : cases)
+	{
+		const std::vector<unsigned char> bytes = Bytes(testCase.markup);
+		const EncodingDeclaration declaration = PrescanEncodingDeclaration(bytes.data(), bytes.size());
+		CHECK_EQUAL(testCase.source, declaration.source);
+		CHECK_EQUAL(std::string(testCase.label), declaration.label);
+	}
+
+	// a declared UTF-8 label decides on valid first bytes, the rest of the sample is not validated
+	const std::vector<unsigned char> declared = Bytes("<?xml version=\"1.0\" encoding=\"utf-8\"?>" + std::string(4000, 'x') + "\xFF");
+	const DetectionResult decided = DetectBufferCharset(declared.data(), declared.size());
+	CHECK_EQUAL(DetectedCharset::UTF8, decided.charset);
+	CHECK_EQUAL(EncodingDeclarationSource::XMLProlog, decided.declaration.source);
+	// another label with invalid first bytes gives Unknown
+	const std::vector<unsigned char> latin1 = Bytes("<?xml version=\"1.0\" encoding=\"iso-8859-1\"?><a>caf\xE9</a>");
+	CHECK_EQUAL(DetectedCharset::Unknown, DetectBufferCharset(latin1.data(), latin1.size()).charset);
+}
+
+int main()
+{
+	return RunTests();
+}
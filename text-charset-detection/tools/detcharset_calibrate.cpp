@@ -0,0 +1,223 @@
+// Measures the host specific optimum of the CheckStreamForUTF8NoBOM() size thresholds and writes a tuning profile.
+//
+// Build (from this directory):	g++ -O2 -std=c++20 detcharset_calibrate.cpp -o detcharset_calibrate
+// Usage:	detcharset_calibrate [--output detcharset-tuning.conf] [--dir PATH] [--budget-us 1000]
+// Then:	export DETCHARSET_TUNING_PROFILE=<output>		(read by the library on first use)
+//
+// tiny_mode_size_limit:	smallest sample size from which the non-tiny path (no buffer-end checks) stays faster than
+//							the tiny path on this CPU, measured on latin and cjk text, never below MIN_TINY_MODE_SIZE_LIMIT
+//							since the non-tiny path leaves the last UTF8_MAX_CHAR_SIZE bytes unchecked
+// sample_size:				largest power of two sample that is read and validated within --budget-us (median),
+//							measured on files in --dir (default: temp directory) with the page cache dropped for the file
+//							before every read where posix_fadvise() is available, so it reflects the storage, not memory
+
+// the engines live in detail:: of the translation unit, pull it in directly instead of linking
+#include "../detcharset.cpp"
+#include "../bench/bench_common.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace text_charset_detection;
+using namespace text_charset_detection::bench;
+
+namespace
+{
+	constexpr size_t MIN_TINY_MODE_SIZE_LIMIT = 256;
+	constexpr size_t MIN_SAMPLE_SIZE = size_t(4) << 10;
+	constexpr size_t MAX_SAMPLE_SIZE = size_t(4) << 20;
+	constexpr double MEASURE_SECONDS = 0.05;
+	constexpr int SAMPLE_SIZE_REPETITIONS = 15;
+
+	template <bool bBufferEndCheck>
+	double BestSeconds(const std::vector<byte_t>& corpus)
+	{
+		const detail::utf8_checking_unit_t* bufferStart = corpus.data();
+		const detail::utf8_checking_unit_t* stopPos = bBufferEndCheck ? bufferStart + corpus.size() : bufferStart + corpus.size() - detail::UTF8_MAX_CHAR_SIZE;
+		double best = 1e300;
+		std::string reason;
+		const bench_clock_t::time_point measureStart = bench_clock_t::now();
+		do
+		{
+			reason.clear();
+			bool bValidUTF8 = true, b7bitASCIIOnly = true;
+			size_t firstErrorOffset;
+			const bench_clock_t::time_point start = bench_clock_t::now();
+			detail::CheckStreamForUTF8NoBOMInternal<bBufferEndCheck>(bufferStart, stopPos, bValidUTF8, b7bitASCIIOnly, firstErrorOffset, reason);
+			best = std::min(best, SecondsSince(start));
+			DoNotOptimize(bValidUTF8);
+		} while (SecondsSince(measureStart) < MEASURE_SECONDS);
+		return best;
+	}
+
+	size_t CalibrateTinyModeSizeLimit()
+	{
+		std::printf("%-8s %12s %12s   (ns, best of runs, latin + cjk)\n", "size", "tiny", "non-tiny");
+		std::vector<size_t> sizes;
+		std::vector<bool> nonTinyFaster;
+		for (size_t size = 64; size <= (size_t(64) << 10); size *= 2)
+		{
+			double tiny = 0, nonTiny = 0;
+			for (CorpusKind kind : { CorpusKind::Latin, CorpusKind::CJK })
+			{
+				const std::vector<byte_t> corpus = GenerateCorpus(kind, size);
+				tiny += BestSeconds<true>(corpus);
+				nonTiny += BestSeconds<false>(corpus);
+			}
+			std::printf("%-8s %12.0f %12.0f\n", FormatSize(size).c_str(), tiny * 1e9, nonTiny * 1e9);
+			sizes.push_back(size);
+			nonTinyFaster.push_back(nonTiny < tiny);
+		}
+
+		// crossover: first size from which non-tiny wins at every larger measured size
+		size_t limit = sizes.back();
+		for (size_t idx = sizes.size(); idx-- > 0 && nonTinyFaster[idx];)
+			limit = sizes[idx];
+		return std::max(limit, MIN_TINY_MODE_SIZE_LIMIT);
+	}
+
+	// writes the dirty pages of path back to the storage, POSIX_FADV_DONTNEED only drops clean ones
+	void SyncFile(const std::string& path)
+	{
+#if defined(__unix__) || defined(__APPLE__)
+		const int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw std::runtime_error("cannot open " + path);
+#if defined(__APPLE__)
+		const int status = fsync(fd);
+#else
+		const int status = fdatasync(fd);
+#endif
+		close(fd);
+		if (status != 0)
+			throw std::runtime_error("cannot sync " + path);
+#else
+		(void)path;
+#endif
+	}
+
+	// drops the page cache of path where the platform allows it, so the next read hits the storage
+	void DropFileCache(const std::string& path)
+	{
+#if defined(POSIX_FADV_DONTNEED)
+		const int fd = open(path.c_str(), O_RDONLY);
+		if (fd >= 0)
+		{
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			close(fd);
+		}
+#else
+		(void)path;
+#endif
+	}
+
+	size_t CalibrateSampleSize(const std::filesystem::path& dir, double budgetSeconds)
+	{
+		// a few files, so consecutive reads do not profit from read-ahead of the previous one
+		constexpr size_t FILE_COUNT = 4;
+		std::vector<std::string> paths;
+		for (size_t idx = 0; idx < FILE_COUNT; ++idx)
+		{
+			const std::vector<byte_t> content = GenerateCorpus(CorpusKind::Latin, 2 * MAX_SAMPLE_SIZE, idx);
+			const std::filesystem::path path = dir / ("detcharset-calibrate-" + std::to_string(idx) + ".txt");
+			std::ofstream ofs(path, std::ios::binary);
+			ofs.write(reinterpret_cast<const char*>(content.data()), content.size());
+			ofs.close();
+			if (!ofs)
+				throw std::runtime_error("cannot write " + path.string());
+			SyncFile(path.string());
+			paths.push_back(path.string());
+		}
+
+		std::printf("\n%-8s %12s   (us, median of %d reads + validation, budget %.0f us)\n", "sample", "latency", SAMPLE_SIZE_REPETITIONS, budgetSeconds * 1e6);
+		const TuningProfile savedProfile = GetTuningProfile();
+		size_t chosen = MIN_SAMPLE_SIZE;
+		for (size_t sampleSize = MIN_SAMPLE_SIZE; sampleSize <= MAX_SAMPLE_SIZE; sampleSize *= 2)
+		{
+			SetTuningProfile({ sampleSize, savedProfile.tinyModeSizeLimit });
+			std::vector<double> latencies;
+			for (int rep = 0; rep < SAMPLE_SIZE_REPETITIONS; ++rep)
+			{
+				const std::string& path = paths[rep % FILE_COUNT];
+				DropFileCache(path);
+				const bench_clock_t::time_point start = bench_clock_t::now();
+				std::ifstream ifs(path, std::ios::binary);
+				std::string reason;
+				DoNotOptimize(CheckStreamForUTF8NoBOM(ifs, reason));
+				latencies.push_back(SecondsSince(start));
+			}
+			std::sort(latencies.begin(), latencies.end());
+			const double median = latencies[latencies.size() / 2];
+			std::printf("%-8s %12.1f\n", FormatSize(sampleSize).c_str(), median * 1e6);
+			if (median <= budgetSeconds)
+				chosen = sampleSize;
+		}
+		SetTuningProfile(savedProfile);
+
+		for (const std::string& path : paths)
+			std::filesystem::remove(path);
+		return chosen;
+	}
+
+	void PrintUsage(const char* argv0)
+	{
+		std::cerr << "usage: " << argv0 << " [--output PATH] [--dir PATH] [--budget-us MICROSECONDS]\n";
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::string output = "detcharset-tuning.conf";
+	std::filesystem::path dir = std::filesystem::temp_directory_path();
+	double budgetSeconds = 1e-3;
+	try
+	{
+		for (int i = 1; i + 1 < argc; i += 2)
+		{
+			const std::string arg = argv[i];
+			if (arg == "--output")
+				output = argv[i + 1];
+			else if (arg == "--dir")
+				dir = argv[i + 1];
+			else if (arg == "--budget-us")
+				budgetSeconds = std::stod(argv[i + 1]) * 1e-6;
+			else
+			{
+				PrintUsage(argv[0]);
+				return 2;
+			}
+		}
+		if (argc % 2 == 0)
+		{
+			PrintUsage(argv[0]);
+			return 2;
+		}
+
+		TuningProfile profile;
+		profile.tinyModeSizeLimit = CalibrateTinyModeSizeLimit();
+		SetTuningProfile({ GetTuningProfile().sampleSize, profile.tinyModeSizeLimit });
+		profile.sampleSize = CalibrateSampleSize(dir, budgetSeconds);
+
+		std::string reason;
+		if (!SaveTuningProfile(output, profile, reason))
+		{
+			std::cerr << reason;
+			return 1;
+		}
+		std::printf("\ntiny_mode_size_limit = %zu\nsample_size = %zu\nwritten to %s, enable with:\n  export DETCHARSET_TUNING_PROFILE=%s\n",
+			profile.tinyModeSizeLimit, profile.sampleSize, output.c_str(), std::filesystem::absolute(output).string().c_str());
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << "\n";
+		return 1;
+	}
+	return 0;
+}
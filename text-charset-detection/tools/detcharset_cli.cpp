@@ -0,0 +1,450 @@
+// detcharset: detects the charset of files in parallel and streams one JSON record per file (NDJSON) to stdout.
+//
+// Build:	cmake target detcharset, or (from this directory)	g++ -O2 -std=c++20 -pthread detcharset_cli.cpp ../detcharset.cpp ../detarchive.cpp -o detcharset
+// Usage:	detcharset [options] [PATH|DIR|-]...
+//			PATH			file to detect
+//			DIR				every regular file below it, recursively
+//			-				detect the content of stdin
+//			--files-from F	newline separated paths from file F ('-': stdin), e.g. find ... | detcharset --files-from -
+//			--jobs N		worker threads (default: hardware concurrency)
+//			--format F		ndjson (default, records as they complete) or json (one array, in input order, at the end)
+//			--max-errors N	error descriptions per record (default 3)
+//			--timings		per-phase timings in the records (DetectCharset<true>, files only: stdin, members and *.gz get zeros)
+//			--archives		scan *.tar, *.tar.gz, *.tgz and *.zip files member by member (nothing extracted): one record per
+//							regular file member, with "member":"dir/a.txt" after "path"; members that cannot be read (encrypted,
+//							unsupported compression) get error records, a damaged archive adds an error record for the archive
+//			--decompress	detect *.gz files by their decompressed content (only the sample is decompressed, no temp file);
+//							"size" and "confidence" are null unless the whole content fit in the sample
+//			--memory-budget N	bound on the sample buffers of concurrent detections in bytes (see SetMemoryBudget()), files, stdin,
+//							archive members and *.gz alike; detections wait for memory when it is used up
+//			--stream-over-budget	with --memory-budget: validate samples that do not fit block by block instead of waiting
+//			--no-summary	no throughput summary on stderr
+//
+// Record:	{"path":"a.txt","encoding":"utf-8","bom":false,"declared_encoding":null,"confidence":1,"size":1234,"sample_size":1234,
+//			 "valid_utf8":true,"first_error_offset":null,"errors":[],"time_us":12.5,"timings_us":{...}}
+//			encoding: see DetectedCharsetName(), "unknown" for neither BOM nor valid UTF-8
+//			declared_encoding: label of an XML/CSS/HTML encoding declaration in the first bytes (PrescanEncodingDeclaration())
+//			confidence: 1 when a BOM decided, otherwise the part of the file the sample covered (the rest was not looked at)
+//			errors: the first --max-errors UTF-8 error descriptions of the sample
+//			files that cannot be read get {"path":...,"error":"..."} instead
+// Exit code: 0 all files detected, 1 some could not be read, 2 usage error.
+
+#include "../detcharset.h"
+#include "../detarchive.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+using namespace text_charset_detection;
+
+namespace
+{
+	constexpr const char* STDIN_PATH = "-";
+	constexpr uint64_t UNKNOWN_SIZE = UINT64_MAX;		// decompressed size of compressed input that was not read to its end
+
+	struct Options
+	{
+		size_t jobs = std::max(1u, std::thread::hardware_concurrency());
+		bool bNDJSON = true;
+		size_t maxErrors = 3;
+		bool bTimings = false;
+		bool bArchives = false;
+		bool bDecompress = false;
+		bool bSummary = true;
+		size_t memoryBudget = 0;
+		MemoryBudgetMode memoryBudgetMode = MemoryBudgetMode::Block;
+	};
+
+	struct FileOutcome
+	{
+		std::string record;				// JSON object, no trailing newline
+		bool bReadable = false;
+		DetectedCharset charset = DetectedCharset::Unknown;
+		uint64_t size = 0;
+		uint64_t sampleSize = 0;
+	};
+
+	std::string JsonString(const std::string& text)
+	{
+		std::string json = "\"";
+		for (const char c : text)
+		{
+			switch (c)
+			{
+			case '"':	json += "\\\""; break;
+			case '\\':	json += "\\\\"; break;
+			case '\n':	json += "\\n"; break;
+			case '\r':	json += "\\r"; break;
+			case '\t':	json += "\\t"; break;
+			default:
+				if (static_cast<unsigned char>(c) < 0x20)
+				{
+					char escaped[8];
+					std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned char>(c));
+					json += escaped;
+				}
+				else
+					json += c;		// paths are passed through byte by byte, non-UTF-8 file names stay non-UTF-8
+			}
+		}
+		return json + "\"";
+	}
+
+	// error descriptions of the reason text, the lines the error classifier wrote
+	std::vector<std::string> FirstErrors(const std::string& reason, size_t maxErrors)
+	{
+		std::vector<std::string> errors;
+		std::istringstream iss(reason);
+		std::string line;
+		while (errors.size() < maxErrors && std::getline(iss, line))
+			if (line.rfind("Invalid ", 0) == 0 || line.rfind("Unknown UTF-8 error", 0) == 0)
+				errors.push_back(line);
+		return errors;
+	}
+
+	FileOutcome MakeOutcome(const std::string& path, uint64_t size, const DetectionResult& result, double seconds, const Options& options, const std::string* member = nullptr)
+	{
+		const bool bBOM = result.charset == DetectedCharset::UTF8BOM || result.charset == DetectedCharset::UTF16LE || result.charset == DetectedCharset::UTF16BE;
+		const double confidence = bBOM || size == 0 ? 1.0 : size == UNKNOWN_SIZE ? -1.0 : static_cast<double>(result.sampleSize) / size;
+
+		std::ostringstream oss;
+		oss << "{\"path\":" << JsonString(path);
+		if (member != nullptr)
+			oss << ",\"member\":" << JsonString(*member);
+		oss << ",\"encoding\":\"" << DetectedCharsetName(result.charset) << "\""
+			<< ",\"bom\":" << (bBOM ? "true" : "false")
+			<< ",\"declared_encoding\":" << (result.declaration.source == EncodingDeclarationSource::None ? "null" : JsonString(result.declaration.label));
+		if (size == UNKNOWN_SIZE)
+			oss << ",\"confidence\":null,\"size\":null";
+		else
+			oss << ",\"confidence\":" << confidence << ",\"size\":" << size;
+		oss << ",\"sample_size\":" << result.sampleSize
+			<< ",\"valid_utf8\":" << (bBOM ? "null" : result.bValidUTF8 ? "true" : "false")
+			<< ",\"first_error_offset\":";
+		if (result.firstErrorOffset == UTF8_NO_ERROR_OFFSET)
+			oss << "null";
+		else
+			oss << result.firstErrorOffset;
+		oss << ",\"errors\":[";
+		const std::vector<std::string> errors = FirstErrors(result.reason, options.maxErrors);
+		for (size_t idx = 0; idx < errors.size(); ++idx)
+			oss << (idx == 0 ? "" : ",") << JsonString(errors[idx]);
+		oss << "],\"time_us\":" << seconds * 1e6;
+		if (options.bTimings)
+		{
+			oss << ",\"timings_us\":{";
+			for (size_t idx = 0; idx < static_cast<size_t>(DetectionPhase::Count); ++idx)
+				oss << (idx == 0 ? "" : ",") << "\"" << DetectionPhaseName(static_cast<DetectionPhase>(idx)) << "\":" << result.timings.Seconds(static_cast<DetectionPhase>(idx)) * 1e6;
+			oss << "}";
+		}
+		oss << "}";
+
+		FileOutcome outcome;
+		outcome.record = oss.str();
+		outcome.bReadable = true;
+		outcome.charset = result.charset;
+		outcome.size = size == UNKNOWN_SIZE ? result.sampleSize : size;
+		outcome.sampleSize = result.sampleSize;
+		return outcome;
+	}
+
+	FileOutcome ErrorOutcome(const std::string& path, const std::string& error, const std::string* member = nullptr)
+	{
+		FileOutcome outcome;
+		outcome.record = "{\"path\":" + JsonString(path) + (member != nullptr ? ",\"member\":" + JsonString(*member) : "") + ",\"error\":" + JsonString(error) + "}";
+		return outcome;
+	}
+
+	std::string FirstLine(const std::string& text)
+	{
+		return text.substr(0, text.find('\n'));
+	}
+
+	FileOutcome DetectPath(const std::string& path, const Options& options)
+	{
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (path == STDIN_PATH)
+		{
+			// streamed: the sample buffer is bounded (and reserved against --memory-budget) whatever comes in, the rest is
+			// only counted
+			StreamingCharsetDetector detector;
+			char chunk[16384];
+			uint64_t size = 0;
+			bool bAllFed = true;
+			while (std::cin.read(chunk, sizeof(chunk)) || std::cin.gcount() > 0)
+			{
+				const size_t chunkSize = static_cast<size_t>(std::cin.gcount());
+				size += chunkSize;
+				bAllFed = bAllFed && detector.Feed(reinterpret_cast<const unsigned char*>(chunk), chunkSize) == chunkSize;
+			}
+			const DetectionResult result = detector.Finish(bAllFed);
+			return MakeOutcome(path, size, result, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), options);
+		}
+
+		std::error_code ec;
+		const uint64_t size = std::filesystem::file_size(path, ec);
+		if (ec)
+			return ErrorOutcome(path, ec.message());
+		std::ifstream ifs(path, std::ios::binary);
+		if (!ifs)
+			return ErrorOutcome(path, "cannot open");
+		const DetectionResult result = options.bTimings ? DetectCharset<true>(ifs) : DetectCharset<false>(ifs);
+		return MakeOutcome(path, size, result, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), options);
+	}
+
+	bool EndsWith(const std::string& text, const std::string& suffix)
+	{
+		return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+	}
+
+	bool IsTarGzPath(const std::string& path)
+	{
+		return EndsWith(path, ".tar.gz") || EndsWith(path, ".tgz");
+	}
+
+	bool IsArchivePath(const std::string& path)
+	{
+		return EndsWith(path, ".tar") || EndsWith(path, ".zip") || IsTarGzPath(path);
+	}
+
+	FileOutcome DetectGzipPath(const std::string& path, const Options& options)
+	{
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		std::ifstream ifs(path, std::ios::binary);
+		if (!ifs)
+			return ErrorOutcome(path, "cannot open");
+		DetectionResult result;
+		std::string reason;
+		if (!DetectGzipCharset(ifs, result, reason))
+			return ErrorOutcome(path, FirstLine(reason));
+		const bool bWholeContent = GetTuningProfile().sampleSize == 0 || result.sampleSize < GetTuningProfile().sampleSize;
+		return MakeOutcome(path, bWholeContent ? result.sampleSize : UNKNOWN_SIZE, result, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), options);
+	}
+
+	// one record per member, in the order the archive reader reports them; time_us of a member is the time since the
+	// previous report (tar: including reading past the previous member), the members of a zip are read on one thread, the
+	// workers already run in parallel across inputs
+	std::vector<FileOutcome> DetectArchive(const std::string& path, const Options& options)
+	{
+		std::vector<FileOutcome> outcomes;
+		std::chrono::steady_clock::time_point memberStart = std::chrono::steady_clock::now();
+		const archive_member_handler_t onMember = [&](const ArchiveMemberResult& member)
+		{
+			const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			if (member.bContentRead)
+				outcomes.push_back(MakeOutcome(path, member.size, member.detection, std::chrono::duration<double>(now - memberStart).count(), options, &member.name));
+			else
+				outcomes.push_back(ErrorOutcome(path, FirstLine(member.detection.reason), &member.name));
+			memberStart = now;
+		};
+		std::string reason;
+		bool bIntact;
+		if (EndsWith(path, ".zip"))
+			bIntact = DetectZipMembersCharset(path, onMember, reason, 1);
+		else
+		{
+			std::ifstream ifs(path, std::ios::binary);
+			if (!ifs)
+				return { ErrorOutcome(path, "cannot open") };
+			bIntact = IsTarGzPath(path) ? DetectTarGzMembersCharset(ifs, onMember, reason) : DetectTarMembersCharset(ifs, onMember, reason);
+		}
+		if (!bIntact)
+			outcomes.push_back(ErrorOutcome(path, FirstLine(reason)));
+		return outcomes;
+	}
+
+	void AddPath(const std::string& arg, std::vector<std::string>& paths)
+	{
+		std::error_code ec;
+		if (arg != STDIN_PATH && std::filesystem::is_directory(arg, ec))
+		{
+			for (std::filesystem::recursive_directory_iterator it(arg, std::filesystem::directory_options::skip_permission_denied, ec), end; !ec && it != end; it.increment(ec))
+				if (it->is_regular_file(ec))
+					paths.push_back(it->path().string());
+		}
+		else
+			paths.push_back(arg);
+	}
+
+	void AddPathsFrom(std::istream& is, std::vector<std::string>& paths)
+	{
+		std::string line;
+		while (std::getline(is, line))
+		{
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			if (!line.empty())
+				AddPath(line, paths);
+		}
+	}
+
+	void PrintUsage(const char* argv0)
+	{
+		std::cerr << "usage: " << argv0 << " [--files-from FILE|-] [--jobs N] [--format ndjson|json] [--max-errors N] [--timings] [--archives] [--decompress] [--memory-budget N [--stream-over-budget]] [--no-summary] [PATH|DIR|-]...\n";
+	}
+}
+
+int main(int argc, char** argv)
+{
+#if defined(_WIN32)
+	_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	std::ios::sync_with_stdio(false);
+
+	Options options;
+	std::vector<std::string> paths;
+	bool bStdinUsed = false;
+	try
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string arg = argv[i];
+			if (arg == "--files-from" && i + 1 < argc)
+			{
+				const std::string listPath = argv[++i];
+				if (listPath == STDIN_PATH)
+				{
+					AddPathsFrom(std::cin, paths);
+					bStdinUsed = true;
+				}
+				else
+				{
+					std::ifstream list(listPath);
+					if (!list)
+						throw std::runtime_error("cannot open " + listPath);
+					AddPathsFrom(list, paths);
+				}
+			}
+			else if (arg == "--jobs" && i + 1 < argc)
+				options.jobs = std::max<size_t>(1, std::stoul(argv[++i]));
+			else if (arg == "--format" && i + 1 < argc)
+			{
+				const std::string format = argv[++i];
+				if (format != "ndjson" && format != "json")
+					throw std::invalid_argument("unknown format " + format);
+				options.bNDJSON = format == "ndjson";
+			}
+			else if (arg == "--max-errors" && i + 1 < argc)
+				options.maxErrors = std::stoul(argv[++i]);
+			else if (arg == "--timings")
+				options.bTimings = true;
+			else if (arg == "--archives")
+				options.bArchives = true;
+			else if (arg == "--decompress")
+				options.bDecompress = true;
+			else if (arg == "--memory-budget" && i + 1 < argc)
+				options.memoryBudget = std::stoull(argv[++i]);
+			else if (arg == "--stream-over-budget")
+				options.memoryBudgetMode = MemoryBudgetMode::Stream;
+			else if (arg == "--no-summary")
+				options.bSummary = false;
+			else if (arg.size() > 1 && arg[0] == '-' && arg != STDIN_PATH)
+				throw std::invalid_argument("unknown option " + arg);
+			else
+				AddPath(arg, paths);
+		}
+		SetMemoryBudget(options.memoryBudget, options.memoryBudgetMode);
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << "\n";
+		PrintUsage(argv[0]);
+		return 2;
+	}
+	if (paths.empty() && !bStdinUsed)
+		paths.push_back(STDIN_PATH);
+	if (bStdinUsed && std::find(paths.begin(), paths.end(), STDIN_PATH) != paths.end())
+	{
+		std::cerr << "stdin cannot be both the file list and an input\n";
+		return 2;
+	}
+
+	// workers take the next path, NDJSON records go out as they complete, JSON keeps input order
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::vector<std::vector<FileOutcome>> outcomes(options.bNDJSON ? 0 : paths.size());
+	std::atomic<size_t> nextPath{ 0 };
+	std::mutex outputMutex;
+	size_t records = 0, unreadable = 0;
+	uint64_t totalSize = 0, totalSampleSize = 0;
+	std::map<DetectedCharset, size_t> charsetCounts;
+	const auto worker = [&]()
+	{
+		for (size_t idx = nextPath.fetch_add(1); idx < paths.size(); idx = nextPath.fetch_add(1))
+		{
+			const std::string& path = paths[idx];
+			std::vector<FileOutcome> pathOutcomes;
+			if (options.bArchives && IsArchivePath(path))
+				pathOutcomes = DetectArchive(path, options);
+			else if (options.bDecompress && EndsWith(path, ".gz"))
+				pathOutcomes.push_back(DetectGzipPath(path, options));
+			else
+				pathOutcomes.push_back(DetectPath(path, options));
+			std::lock_guard<std::mutex> lock(outputMutex);
+			for (const FileOutcome& outcome : pathOutcomes)
+			{
+				++records;
+				unreadable += !outcome.bReadable;
+				if (outcome.bReadable)
+				{
+					totalSize += outcome.size;
+					totalSampleSize += outcome.sampleSize;
+					++charsetCounts[outcome.charset];
+				}
+				if (options.bNDJSON)
+					std::cout << outcome.record << "\n";
+			}
+			if (!options.bNDJSON)
+				outcomes[idx] = std::move(pathOutcomes);
+		}
+	};
+	std::vector<std::thread> workers;
+	for (size_t idx = 1; idx < std::min(options.jobs, paths.size()); ++idx)
+		workers.emplace_back(worker);
+	worker();
+	for (std::thread& thread : workers)
+		thread.join();
+
+	if (!options.bNDJSON)
+	{
+		std::cout << "[";
+		bool bFirst = true;
+		for (const std::vector<FileOutcome>& pathOutcomes : outcomes)
+			for (const FileOutcome& outcome : pathOutcomes)
+			{
+				std::cout << (bFirst ? "\n" : ",\n") << outcome.record;
+				bFirst = false;
+			}
+		std::cout << "\n]\n";
+	}
+	std::cout.flush();
+
+	if (options.bSummary)
+	{
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::fprintf(stderr, "%zu file(s), %zu unreadable, %.1f MB (%.1f MB validated) in %.3f s: %.0f files/s, %.1f MB/s validated\n",
+			records, unreadable, totalSize / 1e6, totalSampleSize / 1e6, seconds, records / seconds, totalSampleSize / 1e6 / seconds);
+		for (const std::pair<const DetectedCharset, size_t>& count : charsetCounts)
+			std::fprintf(stderr, "  %-10s %zu\n", DetectedCharsetName(count.first), count.second);
+		if (options.memoryBudget != 0)
+		{
+			const MemoryBudgetStats budget = GetMemoryBudgetStats();
+			std::fprintf(stderr, "memory budget: peak %zu of %zu bytes, %llu wait(s), %llu streamed sample(s)\n",
+				budget.peakBytes, budget.limitBytes, static_cast<unsigned long long>(budget.waits), static_cast<unsigned long long>(budget.streamedSamples));
+		}
+	}
+	return unreadable == 0 ? 0 : 1;
+}